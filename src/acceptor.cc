@@ -15,17 +15,26 @@
 #include "acceptor.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <chrono>
+#include <functional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "addr.h"
+#include "caps.h"
 #include "check.h"
 #include "logging.h"
+#include "stats.h"
 
 namespace hcproxy {
 
@@ -34,49 +43,156 @@ namespace {
 addrinfo* Resolve(const char* host, uint16_t port) {
   addrinfo* res;
   addrinfo hint = {};
-  hint.ai_family = AF_INET;
+  hint.ai_family = AF_UNSPEC;
   hint.ai_socktype = SOCK_STREAM;
   hint.ai_flags = AI_PASSIVE;
   int ret;
   CHECK((ret = getaddrinfo(host, std::to_string(port).c_str(), &hint, &res)) == 0)
       << gai_strerror(ret);
-  CHECK(res->ai_addr->sa_family == AF_INET);
   return res;
 }
 
-void SetSockOpt(int fd, int level, int optname) {
-  int one = 1;
-  CHECK(setsockopt(fd, level, optname, &one, sizeof(one)) == 0) << Errno();
+void SetSockOpt(int fd, int level, int optname, int val = 1) {
+  CHECK(setsockopt(fd, level, optname, &val, sizeof(val)) == 0) << Errno();
 }
 
+// Accepting this many connections in a row lets other handlers on the same event loop run.
+// The listening socket is level-triggered, so the rest are picked up on the next round.
+constexpr int kMaxAcceptsPerEvent = 32;
+
+class ListenEventHandler : public EventHandler {
+ public:
+  // `accept` returns false when there are no more connections to accept.
+  ListenEventHandler(int fd, std::function<bool()> accept)
+      : EventHandler(fd), accept_(std::move(accept)) {}
+
+  void OnEvent(EventLoop*, int) override {
+    for (int i = 0; i != kMaxAcceptsPerEvent; ++i) {
+      if (!accept_()) break;
+    }
+  }
+
+  void OnTimeout(EventLoop*) override { CHECK(false) << "listening socket timed out"; }
+
+ private:
+  std::function<bool()> accept_;
+};
+
 }  // namespace
 
-Acceptor::Acceptor(const Options& opt) {
-  addrinfo* addr = Resolve(opt.listen_addr.c_str(), opt.listen_port);
-  LOG(INFO) << "Listening on " << IpPort(*addr);
-  CHECK((fd_ = socket(addr->ai_family, SOCK_STREAM, 0)) >= 0) << Errno();
-  SetSockOpt(fd_, SOL_SOCKET, SO_REUSEADDR);
-  CHECK(bind(fd_, addr->ai_addr, addr->ai_addrlen) == 0) << Errno();
-  CHECK(listen(fd_, opt.accept_queue_size) == 0) << Errno();
-  freeaddrinfo(addr);
+Acceptor::Acceptor(const Options& opt, const LatencyOptions& latency)
+    : num_accepted_(1 + opt.extra_listen_ports.size()) {
+  ports_.push_back(opt.listen_port);
+  ports_.insert(ports_.end(), opt.extra_listen_ports.begin(), opt.extra_listen_ports.end());
+  for (std::uint16_t port : ports_) {
+    addrinfo* addr = Resolve(opt.listen_addr.c_str(), port);
+    LOG(INFO) << "Listening on " << IpPort(*addr);
+    // With several listening sockets we poll() them and then call accept4(), which must not
+    // block if the connection gets reset in between.
+    int fd = socket(addr->ai_family, SOCK_STREAM | (ports_.size() > 1 ? SOCK_NONBLOCK : 0), 0);
+    CHECK(fd >= 0) << Errno();
+    SetSockOpt(fd, SOL_SOCKET, SO_REUSEADDR);
+    if (opt.listen_reuse_port) SetSockOpt(fd, SOL_SOCKET, SO_REUSEPORT);
+    // Accepted sockets inherit busy poll settings from the listening socket.
+    SetBusyPoll(fd, latency);
+    if (opt.defer_accept_timeout > Duration::zero()) {
+      auto sec = std::chrono::ceil<std::chrono::seconds>(opt.defer_accept_timeout);
+      SetSockOpt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, sec.count());
+    }
+    if (opt.listen_tcp_fastopen_queue_size > 0) {
+      if (GetCaps().tcp_fastopen_server) {
+        SetSockOpt(fd, IPPROTO_TCP, TCP_FASTOPEN, opt.listen_tcp_fastopen_queue_size);
+      } else {
+        LOG(WARN) << "TCP Fast Open for incoming connections isn't supported; not using it";
+      }
+    }
+    CHECK(bind(fd, addr->ai_addr, addr->ai_addrlen) == 0) << Errno();
+    CHECK(listen(fd, opt.accept_queue_size) == 0) << Errno();
+    freeaddrinfo(addr);
+    fds_.push_back(fd);
+  }
 }
 
-Acceptor::~Acceptor() { CHECK(close(fd_) == 0) << Errno(); }
+Acceptor::~Acceptor() {
+  for (int fd : fds_) CHECK(close(fd) == 0) << Errno();
+}
 
-int Acceptor::Accept() {
+int Acceptor::Accept(std::uint16_t* listen_port) {
   while (true) {
-    struct sockaddr addr = {};
-    socklen_t addrlen = sizeof(addr);
-    int conn = accept4(fd_, &addr, &addrlen, SOCK_NONBLOCK);
+    size_t idx = fds_.size() > 1 ? Poll() : 0;
+    int conn = TryAccept(idx);
     if (conn >= 0) {
-      CHECK(addrlen == sizeof(addr));
-      CHECK(addr.sa_family == AF_INET);
-      LOG(INFO) << "[" << conn << "] accepted connection from " << IpPort(addr);
-      SetSockOpt(conn, IPPROTO_TCP, TCP_NODELAY);
+      if (listen_port) *listen_port = ports_[idx];
       return conn;
     }
-    LOG(ERROR) << "accept4() failed: " << Errno();
-    CHECK(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) << Errno();
+  }
+}
+
+void Acceptor::Start(EventLoop* loop, Callback cb) {
+  CHECK(loop);
+  CHECK(cb);
+  for (size_t idx = 0; idx != fds_.size(); ++idx) {
+    int flags = fcntl(fds_[idx], F_GETFL);
+    CHECK(flags >= 0) << Errno();
+    CHECK(fcntl(fds_[idx], F_SETFL, flags | O_NONBLOCK) == 0) << Errno();
+    auto* eh = new ListenEventHandler(fds_[idx], [this, idx, cb]() {
+      int conn = TryAccept(idx);
+      if (conn < 0) return false;
+      cb(conn, ports_[idx]);
+      return true;
+    });
+    loop->Add(eh, EPOLLIN, EventLoop::kNoTimeout);
+  }
+}
+
+int Acceptor::TryAccept(size_t idx) {
+  sockaddr_storage addr = {};
+  socklen_t addrlen = sizeof(addr);
+  int conn = accept4(fds_[idx], reinterpret_cast<sockaddr*>(&addr), &addrlen, SOCK_NONBLOCK);
+  if (conn >= 0) {
+    CHECK(addrlen <= sizeof(addr));
+    LOG(INFO) << "[" << conn << "] accepted connection from " << IpPort(addr);
+    SetSockOpt(conn, IPPROTO_TCP, TCP_NODELAY);
+    Count(Counter::kAccepted);
+    num_accepted_[idx].store(num_accepted_[idx].load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+    return conn;
+  }
+  if (errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+  LOG(ERROR) << "accept4() failed: " << Errno();
+  Count(Counter::kAcceptErrors);
+  CHECK(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) << Errno();
+  return -1;
+}
+
+std::vector<std::pair<std::uint16_t, std::uint64_t>> Acceptor::num_accepted() const {
+  std::vector<std::pair<std::uint16_t, std::uint64_t>> res;
+  for (size_t i = 0; i != ports_.size(); ++i) {
+    res.emplace_back(ports_[i], num_accepted_[i].load(std::memory_order_relaxed));
+  }
+  return res;
+}
+
+size_t Acceptor::Poll() {
+  std::vector<pollfd> fds(fds_.size());
+  for (size_t i = 0; i != fds_.size(); ++i) {
+    fds[i].fd = fds_[i];
+    fds[i].events = POLLIN;
+  }
+  while (true) {
+    int n = poll(fds.data(), fds.size(), -1);
+    if (n < 0) {
+      CHECK(errno == EINTR) << Errno();
+      continue;
+    }
+    // Start from a different socket every time so that a busy port can't starve the others.
+    for (size_t i = 0; i != fds.size(); ++i) {
+      size_t idx = (next_ + i) % fds.size();
+      if (fds[idx].revents) {
+        next_ = idx + 1;
+        return idx;
+      }
+    }
   }
 }
 
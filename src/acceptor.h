@@ -16,8 +16,16 @@
 #define ROMKATV_HCPROXY_ACCEPTOR_H_
 
 #include <stddef.h>
+#include <atomic>
 #include <cstdint>
+#include <functional>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include "event_loop.h"
+#include "latency.h"
+#include "time.h"
 
 namespace hcproxy {
 
@@ -28,22 +36,62 @@ class Acceptor {
     std::string listen_addr = "0.0.0.0";
     // Listen for incoming connections on this port.
     std::uint16_t listen_port = 8889;
+    // Also listen on these ports.
+    std::vector<std::uint16_t> extra_listen_ports = {};
     // Queue up to this many incoming, not yet accepted, connections.
     // Any extra incoming connections will get rejected.
     size_t accept_queue_size = 64;
+    // Set SO_REUSEPORT on the listening socket. This allows several acceptors to
+    // listen on the same address. The kernel load-balances incoming connections
+    // between them.
+    bool listen_reuse_port = false;
+    // If positive, set TCP_DEFER_ACCEPT on the listening socket: a connection isn't
+    // accepted until the client sends data or this much time passes since the handshake.
+    // Clients of a CONNECT proxy always speak first, so by the time a connection is
+    // accepted, the request is usually there. Rounded up to whole seconds.
+    Duration defer_accept_timeout = Duration::zero();
+    // If positive, accept TCP Fast Open connections (with data in SYN) and allow up to
+    // this many of them to be pending the completion of the handshake. Requires
+    // net.ipv4.tcp_fastopen & 2; ignored otherwise.
+    int listen_tcp_fastopen_queue_size = 0;
   };
 
-  explicit Acceptor(const Options& opt);
+  explicit Acceptor(const Options& opt, const LatencyOptions& latency = {});
   Acceptor(Acceptor&&) = delete;
   ~Acceptor();
 
   // Blocks until there is an incoming connection and returns it.
   // The result is always a valid socket file description. Must not
-  // be called concurrently.
-  int Accept();
+  // be called concurrently. If `listen_port` is not null, it's set to
+  // the port on which the connection was accepted.
+  int Accept(std::uint16_t* listen_port = nullptr);
+
+  using Callback = std::function<void(int fd, std::uint16_t listen_port)>;
+
+  // Accepts incoming connections on `loop` without blocking and calls `cb` for each of
+  // them from the loop thread. Can be called only from the loop thread and at most once.
+  // Accept() must not be called afterwards.
+  void Start(EventLoop* loop, Callback cb);
+
+  // Returns the number of accepted connections for every listening port.
+  // Can be called from any thread.
+  std::vector<std::pair<std::uint16_t, std::uint64_t>> num_accepted() const;
 
  private:
-  int fd_;
+  // Returns the index of a listening socket that has an incoming connection.
+  size_t Poll();
+
+  // Accepts a connection from the specified listening socket. Returns -1 if there is
+  // no connection or accept4() has failed.
+  int TryAccept(size_t idx);
+
+  // Parallel arrays.
+  std::vector<int> fds_;
+  std::vector<std::uint16_t> ports_;
+  // Written only by TryAccept().
+  std::vector<std::atomic<std::uint64_t>> num_accepted_;
+  // Index of the listening socket that Poll() checks first.
+  size_t next_ = 0;
 };
 
 }  // namespace hcproxy
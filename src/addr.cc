@@ -20,24 +20,36 @@ namespace hcproxy {
 
 namespace {
 
-const sockaddr_in& Cast(const sockaddr& addr) {
-  CHECK(addr.sa_family == AF_INET);
-  return reinterpret_cast<const sockaddr_in&>(addr);
+const sockaddr& Cast(const sockaddr& addr) {
+  CHECK(addr.sa_family == AF_INET || addr.sa_family == AF_INET6) << addr.sa_family;
+  return addr;
 }
 
-const sockaddr_in& Cast(const addrinfo& addr) {
+const sockaddr& Cast(const addrinfo& addr) {
   CHECK(addr.ai_addr);
   return Cast(*addr.ai_addr);
 }
 
 }  // namespace
 
-IpPort::IpPort(const sockaddr_in& addr) : addr(addr) {}
 IpPort::IpPort(const sockaddr& addr) : addr(Cast(addr)) {}
+IpPort::IpPort(const sockaddr_in& addr) : addr(Cast(reinterpret_cast<const sockaddr&>(addr))) {}
+IpPort::IpPort(const sockaddr_in6& addr) : addr(Cast(reinterpret_cast<const sockaddr&>(addr))) {}
+IpPort::IpPort(const sockaddr_storage& addr)
+    : addr(Cast(reinterpret_cast<const sockaddr&>(addr))) {}
+IpPort::IpPort(const SockAddr& addr) : addr(Cast(addr.sa)) {}
 IpPort::IpPort(const addrinfo& addr) : addr(Cast(addr)) {}
 
 std::ostream& operator<<(std::ostream& strm, const IpPort& x) {
-  return strm << inet_ntoa(x.addr.sin_addr) << ':' << ntohs(x.addr.sin_port);
+  char buf[INET6_ADDRSTRLEN];
+  if (x.addr.sa_family == AF_INET) {
+    const auto& a = reinterpret_cast<const sockaddr_in&>(x.addr);
+    CHECK(inet_ntop(AF_INET, &a.sin_addr, buf, sizeof(buf)));
+    return strm << buf << ':' << ntohs(a.sin_port);
+  }
+  const auto& a = reinterpret_cast<const sockaddr_in6&>(x.addr);
+  CHECK(inet_ntop(AF_INET6, &a.sin6_addr, buf, sizeof(buf)));
+  return strm << '[' << buf << "]:" << ntohs(a.sin6_port);
 }
 
 }  // namespace hcproxy
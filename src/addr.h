@@ -20,16 +20,42 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <cstddef>
 #include <ostream>
 
 namespace hcproxy {
 
+// An IPv4 or IPv6 address with port.
+union SockAddr {
+  sockaddr sa;
+  sockaddr_in v4;
+  sockaddr_in6 v6;
+};
+
+// The size of the address as expected by connect().
+inline socklen_t SockAddrLen(const SockAddr& addr) {
+  return addr.sa.sa_family == AF_INET ? sizeof(addr.v4) : sizeof(addr.v6);
+}
+
+// Addresses of a server in the order in which they should be tried. Trivially copyable,
+// so handing it from thread to thread doesn't touch any shared memory.
+struct ServerAddrs {
+  static constexpr size_t kMaxSize = 16;
+
+  size_t size = 0;
+  SockAddr addrs[kMaxSize];
+};
+
+// Prints an IPv4 address as 1.2.3.4:80 and IPv6 as [::1]:80.
 struct IpPort {
-  IpPort(const sockaddr_in& addr);
   IpPort(const sockaddr& addr);
+  IpPort(const sockaddr_in& addr);
+  IpPort(const sockaddr_in6& addr);
+  IpPort(const sockaddr_storage& addr);
+  IpPort(const SockAddr& addr);
   IpPort(const addrinfo& addr);
 
-  const sockaddr_in& addr;
+  const sockaddr& addr;
 };
 
 std::ostream& operator<<(std::ostream& strm, const IpPort& x);
@@ -0,0 +1,159 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "admin.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <utility>
+
+#include "addr.h"
+#include "bits.h"
+#include "check.h"
+#include "event_loop.h"
+#include "logging.h"
+
+namespace hcproxy {
+
+namespace {
+
+// Admin connections that stay idle for this long get closed.
+constexpr Duration kTimeout = std::chrono::seconds(10);
+
+// Stop reading the request after this many bytes and reply anyway.
+constexpr size_t kMaxRequestSize = 4 << 10;
+
+int Listen(const AdminServer::Options& opt) {
+  addrinfo* addr;
+  addrinfo hint = {};
+  hint.ai_family = AF_UNSPEC;
+  hint.ai_socktype = SOCK_STREAM;
+  hint.ai_flags = AI_PASSIVE;
+  int ret;
+  CHECK((ret = getaddrinfo(opt.admin_listen_addr.c_str(),
+                           std::to_string(opt.admin_listen_port).c_str(), &hint, &addr)) == 0)
+      << gai_strerror(ret);
+  LOG(INFO) << "Serving metrics on " << IpPort(*addr);
+  int fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  CHECK(fd >= 0) << Errno();
+  int one = 1;
+  CHECK(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0) << Errno();
+  CHECK(bind(fd, addr->ai_addr, addr->ai_addrlen) == 0) << Errno();
+  CHECK(listen(fd, 16) == 0) << Errno();
+  freeaddrinfo(addr);
+  return fd;
+}
+
+// Reads an HTTP request, ignores its content and replies with the output of the handler.
+class ConnectionEventHandler : public EventHandler {
+ public:
+  ConnectionEventHandler(int fd, const AdminServer::Handler& handler)
+      : EventHandler(fd), handler_(handler) {}
+
+  ~ConnectionEventHandler() override { CHECK(close(fd()) == 0) << Errno(); }
+
+  void OnEvent(EventLoop* loop, int events) override {
+    if (HasBits(events, EPOLLERR)) return loop->Remove(this);
+    if (response_.empty()) {
+      if (!Read()) return loop->Remove(this);
+      if (response_.empty()) return;
+      loop->Modify(this, EPOLLOUT);
+    }
+    if (!Write()) return loop->Remove(this);
+  }
+
+  void OnTimeout(EventLoop* loop) override { loop->Remove(this); }
+
+ private:
+  // Returns false on error. Fills response_ once the request has been read.
+  bool Read() {
+    char buf[1024];
+    while (true) {
+      ssize_t n = read(fd(), buf, sizeof(buf));
+      if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+      if (n == 0) return false;
+      request_.append(buf, n);
+      if (request_.find("\r\n\r\n") != std::string::npos || request_.size() > kMaxRequestSize) {
+        std::string body = handler_();
+        response_ =
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " +
+            std::to_string(body.size()) +
+            "\r\n"
+            "Connection: close\r\n"
+            "\r\n" +
+            body;
+        return true;
+      }
+    }
+  }
+
+  // Returns false when done or on error.
+  bool Write() {
+    while (written_ != response_.size()) {
+      ssize_t n = write(fd(), response_.data() + written_, response_.size() - written_);
+      if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+      written_ += n;
+    }
+    return false;
+  }
+
+  const AdminServer::Handler& handler_;
+  std::string request_;
+  std::string response_;
+  size_t written_ = 0;
+};
+
+class ListenEventHandler : public EventHandler {
+ public:
+  ListenEventHandler(int fd, AdminServer::Handler handler)
+      : EventHandler(fd), handler_(std::move(handler)) {}
+
+  void OnEvent(EventLoop* loop, int events) override {
+    while (true) {
+      int conn = accept4(fd(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (conn < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          LOG(ERROR) << "accept4() failed on the admin port: " << Errno();
+        }
+        return;
+      }
+      loop->Add(new ConnectionEventHandler(conn, handler_), EPOLLIN);
+    }
+  }
+
+  void OnTimeout(EventLoop*) override { CHECK(false) << "listening socket timed out"; }
+
+ private:
+  const AdminServer::Handler handler_;
+};
+
+}  // namespace
+
+AdminServer::AdminServer(const Options& opt, Handler handler)
+    : event_loop_(*new EventLoop(kTimeout)) {
+  CHECK(opt.admin_listen_port);
+  CHECK(handler);
+  auto* eh = new ListenEventHandler(Listen(opt), std::move(handler));
+  event_loop_.Schedule([this, eh]() { event_loop_.Add(eh, EPOLLIN, EventLoop::kNoTimeout); });
+}
+
+}  // namespace hcproxy
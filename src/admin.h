@@ -0,0 +1,51 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_ADMIN_H_
+#define ROMKATV_HCPROXY_ADMIN_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace hcproxy {
+
+class EventLoop;
+
+// A tiny HTTP server for monitoring. Replies to every request with the output of a
+// function, which is expected to render metrics in Prometheus text format. It runs
+// on its own thread and never touches the sockets of proxied connections.
+class AdminServer {
+ public:
+  struct Options {
+    // Listen for admin requests on this address and port. The address should
+    // normally stay local. If the port is zero, there is no admin server.
+    std::string admin_listen_addr = "127.0.0.1";
+    std::uint16_t admin_listen_port = 0;
+  };
+
+  // Called from the admin thread on every request. Returns the response body.
+  using Handler = std::function<std::string()>;
+
+  AdminServer(const Options& opt, Handler handler);
+  AdminServer(AdminServer&&) = delete;
+  ~AdminServer() = delete;
+
+ private:
+  EventLoop& event_loop_;
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_ADMIN_H_
@@ -0,0 +1,179 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "caps.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fstream>
+#include <vector>
+
+#include "check.h"
+#include "epoll.h"
+#include "logging.h"
+#include "uring_forwarder.h"
+
+namespace hcproxy {
+
+namespace {
+
+// Closes file descriptors on destruction.
+class Fds {
+ public:
+  Fds() {}
+  Fds(Fds&&) = delete;
+  ~Fds() {
+    for (int fd : fds_) CHECK(close(fd) == 0) << Errno();
+  }
+
+  // Takes ownership of `fd` unless it's negative. Returns `fd`.
+  int Add(int fd) {
+    if (fd >= 0) fds_.push_back(fd);
+    return fd;
+  }
+
+ private:
+  std::vector<int> fds_;
+};
+
+bool SetIntSockOpt(int fd, int level, int optname, int val) {
+  return setsockopt(fd, level, optname, &val, sizeof(val)) == 0;
+}
+
+// Sets up a loopback TCP connection, fills its send buffer and then splices from
+// a pipe into it. The splice must fail with EAGAIN and leave the pipe alone.
+// Returns false if anything goes wrong along the way.
+bool ProbeSpliceKeepsPipeOnEagain() {
+  Fds fds;
+  int listener = fds.Add(socket(AF_INET, SOCK_STREAM, 0));
+  if (listener < 0) return false;
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrlen = sizeof(addr);
+  if (!SetIntSockOpt(listener, SOL_SOCKET, SO_RCVBUF, 4096) ||
+      bind(listener, reinterpret_cast<sockaddr*>(&addr), addrlen) != 0 ||
+      listen(listener, 1) != 0 ||
+      getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addrlen) != 0) {
+    return false;
+  }
+  int client = fds.Add(socket(AF_INET, SOCK_STREAM, 0));
+  if (client < 0 || !SetIntSockOpt(client, SOL_SOCKET, SO_SNDBUF, 4096) ||
+      connect(client, reinterpret_cast<sockaddr*>(&addr), addrlen) != 0 ||
+      fds.Add(accept4(listener, nullptr, nullptr, 0)) < 0 ||
+      fcntl(client, F_SETFL, fcntl(client, F_GETFL, 0) | O_NONBLOCK) != 0) {
+    return false;
+  }
+  char buf[4096] = {};
+  // The send buffer is small but this loop is bounded anyway.
+  for (int i = 0; i != 1024; ++i) {
+    if (send(client, buf, sizeof(buf), 0) < 0) break;
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+  int p[2];
+  if (pipe(p) != 0) return false;
+  fds.Add(p[0]);
+  fds.Add(p[1]);
+  if (write(p[1], buf, sizeof(buf)) != sizeof(buf)) return false;
+  if (splice(p[0], nullptr, client, nullptr, sizeof(buf), SPLICE_F_NONBLOCK | SPLICE_F_MOVE) >= 0 ||
+      errno != EAGAIN) {
+    return false;
+  }
+  int len = 0;
+  return ioctl(p[0], FIONREAD, &len) == 0 && len == sizeof(buf);
+}
+
+size_t ProbeMaxPipeSize() {
+  constexpr int kLimit = 64 << 20;
+  int p[2];
+  CHECK(pipe(p) == 0) << Errno();
+  int res = fcntl(p[0], F_GETPIPE_SZ);
+  CHECK(res > 0) << Errno();
+  for (int size = 2 * res; size <= kLimit; size *= 2) {
+    int ret = fcntl(p[0], F_SETPIPE_SZ, size);
+    if (ret < 0) break;
+    res = ret;
+  }
+  for (int fd : p) CHECK(close(fd) == 0) << Errno();
+  return res;
+}
+
+int ReadTcpFastOpenSysctl() {
+  std::ifstream file("/proc/sys/net/ipv4/tcp_fastopen");
+  int val = 0;
+  return file >> val ? val : 0;
+}
+
+bool ProbeTcpFastOpenClient() {
+  if (!(ReadTcpFastOpenSysctl() & 1)) return false;
+  Fds fds;
+  int fd = fds.Add(socket(AF_INET, SOCK_STREAM, 0));
+  return fd >= 0 && SetIntSockOpt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+}
+
+bool ProbeTcpFastOpenServer() {
+  if (!(ReadTcpFastOpenSysctl() & 2)) return false;
+  Fds fds;
+  int fd = fds.Add(socket(AF_INET, SOCK_STREAM, 0));
+  return fd >= 0 && SetIntSockOpt(fd, IPPROTO_TCP, TCP_FASTOPEN, 1);
+}
+
+bool ProbeSocketBusyPoll() {
+  Fds fds;
+  int fd = fds.Add(socket(AF_INET, SOCK_STREAM, 0));
+  // Zero doesn't require CAP_NET_ADMIN.
+  return fd >= 0 && SetIntSockOpt(fd, SOL_SOCKET, SO_BUSY_POLL, 0);
+}
+
+bool ProbeEpollBusyPoll() {
+  EPoll epoll;
+  return epoll.SetBusyPoll(0, 0, false);
+}
+
+const char* YesNo(bool val) { return val ? "yes" : "no"; }
+
+Caps Probe() {
+  Caps caps;
+  caps.splice_keeps_pipe_on_eagain = ProbeSpliceKeepsPipeOnEagain();
+  caps.max_pipe_size = ProbeMaxPipeSize();
+  caps.io_uring = UringForwarder::IsSupported();
+  caps.tcp_fastopen_client = ProbeTcpFastOpenClient();
+  caps.tcp_fastopen_server = ProbeTcpFastOpenServer();
+  caps.socket_busy_poll = ProbeSocketBusyPoll();
+  caps.epoll_busy_poll = ProbeEpollBusyPoll();
+  LOG(INFO) << "Kernel capabilities:"
+            << " splice-keeps-pipe-on-EAGAIN=" << YesNo(caps.splice_keeps_pipe_on_eagain)
+            << " max-pipe-size=" << caps.max_pipe_size
+            << " io_uring=" << YesNo(caps.io_uring)
+            << " tcp-fastopen-client=" << YesNo(caps.tcp_fastopen_client)
+            << " tcp-fastopen-server=" << YesNo(caps.tcp_fastopen_server)
+            << " socket-busy-poll=" << YesNo(caps.socket_busy_poll)
+            << " epoll-busy-poll=" << YesNo(caps.epoll_busy_poll);
+  return caps;
+}
+
+}  // namespace
+
+const Caps& GetCaps() {
+  static const Caps caps = Probe();
+  return caps;
+}
+
+}  // namespace hcproxy
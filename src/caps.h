@@ -0,0 +1,49 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_CAPS_H_
+#define ROMKATV_HCPROXY_CAPS_H_
+
+#include <cstddef>
+
+namespace hcproxy {
+
+// What the kernel we are running on can do. Workarounds and optional fast paths
+// are enabled based on this.
+struct Caps {
+  // When splice() from a pipe into a socket fails with EAGAIN, the data stays in
+  // the pipe. False on WSL, where splice() clears the pipe on any error.
+  bool splice_keeps_pipe_on_eagain = false;
+  // The largest pipe capacity that F_SETPIPE_SZ accepts from this process.
+  size_t max_pipe_size = 0;
+  // io_uring supports everything UringForwarder needs.
+  bool io_uring = false;
+  // TCP Fast Open is enabled for outgoing connections (net.ipv4.tcp_fastopen & 1)
+  // and TCP_FASTOPEN_CONNECT is supported.
+  bool tcp_fastopen_client = false;
+  // TCP Fast Open is enabled for incoming connections (net.ipv4.tcp_fastopen & 2).
+  bool tcp_fastopen_server = false;
+  // SO_BUSY_POLL is supported.
+  bool socket_busy_poll = false;
+  // epoll busy poll parameters can be set (Linux 6.9+).
+  bool epoll_busy_poll = false;
+};
+
+// Probes the kernel on the first call and logs the results. Subsequent calls return
+// the same object. Thread-safe.
+const Caps& GetCaps();
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_CAPS_H_
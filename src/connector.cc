@@ -19,77 +19,385 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iterator>
+#include <mutex>
 #include <optional>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 
 #include "addr.h"
 #include "bits.h"
+#include "caps.h"
 #include "check.h"
 #include "event_loop.h"
+#include "latency.h"
 #include "logging.h"
+#include "pool.h"
+#include "scoreboard.h"
+#include "stats.h"
 #include "sock.h"
 
 namespace hcproxy {
 
+namespace internal_connector {
+
+// Servers that have recently failed to accept data in SYN.
+//
+// Thread-safe.
+class FastOpenBlacklist {
+ public:
+  FastOpenBlacklist(Duration ttl, size_t max_size) : ttl_(ttl), max_size_(max_size) {}
+  FastOpenBlacklist(FastOpenBlacklist&&) = delete;
+
+  bool Contains(const ServerIp& server, Time now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = expiry_.find(server);
+    if (it == expiry_.end()) return false;
+    if (it->second > now) return true;
+    expiry_.erase(it);
+    return false;
+  }
+
+  void Add(const ServerIp& server, Time now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (expiry_.size() >= max_size_ && !expiry_.count(server)) {
+      for (auto it = expiry_.begin(); it != expiry_.end();) {
+        it = it->second > now ? std::next(it) : expiry_.erase(it);
+      }
+      if (expiry_.size() >= max_size_) return;
+    }
+    expiry_[server] = now + ttl_;
+  }
+
+ private:
+  const Duration ttl_;
+  const size_t max_size_;
+  std::mutex mutex_;
+  // Server IP => the time when it leaves the blacklist.
+  std::unordered_map<ServerIp, Time, ServerIpHash> expiry_;
+};
+
+}  // namespace internal_connector
+
 namespace {
 
-int ConnectAsync(const addrinfo& addr) {
-  int fd = socket(addr.ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+using internal_connector::FastOpenBlacklist;
+
+// Connect() tries at most this many addresses of a server.
+constexpr size_t kMaxAttempts = ServerAddrs::kMaxSize;
+
+// Returns true if the error is on our side rather than the server's.
+bool IsLocalError(int err) {
+  return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM || err == EAFNOSUPPORT;
+}
+
+// Closes a socket on which connect() has failed. Returns -1 with errno preserved.
+int Abort(int fd) {
+  const int err = errno;
+  LOG(WARN) << "[" << fd << "] connect() failed: " << Errno(err);
+  CHECK(close(fd) == 0) << Errno();
+  errno = err;
+  return -1;
+}
+
+// Starts connecting to the server. Returns the socket or -1 on error with errno set.
+//
+// If the client has already sent some data and we have a TCP Fast Open cookie for the
+// server, sends up to one packet of the data in SYN and sets `syn_data` to its size. The
+// data isn't consumed from `client_fd`: only the attempt that wins the race may do that.
+int ConnectAsync(const SockAddr& addr, const LatencyOptions& latency, int client_fd,
+                 FastOpenBlacklist* tfo_blacklist, ssize_t* syn_data) {
+  *syn_data = 0;
+  int fd = socket(addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (fd < 0) {
     LOG(ERROR) << "socket() failed: " << Errno();
-    CHECK(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) << Errno();
+    CHECK(IsLocalError(errno)) << Errno();
     return -1;
   }
   LOG(INFO) << "[" << fd << "] connecting to " << IpPort(addr);
   int one = 1;
   CHECK(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0) << Errno();
-  if (connect(fd, addr.ai_addr, addr.ai_addrlen) != 0 && errno != EINPROGRESS) {
-    LOG(WARN) << "[" << fd << "] connect() failed: " << Errno();
-    CHECK(close(fd) == 0) << Errno();
-    return -1;
+  SetBusyPoll(fd, latency);
+  // SYN can carry at most one packet of data. The kernel trims it further if necessary.
+  char early[1460];
+  ssize_t early_size = 0;
+  if (tfo_blacklist && !tfo_blacklist->Contains(GetServerIp(addr.sa), Clock::now())) {
+    early_size = recv(client_fd, early, sizeof(early), MSG_PEEK | MSG_DONTWAIT);
+    if (early_size > 0) {
+      CHECK(setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) == 0) << Errno();
+    }
+  }
+  if (connect(fd, &addr.sa, SockAddrLen(addr)) != 0) {
+    if (errno == EINPROGRESS) return fd;
+    return Abort(fd);
+  }
+  if (early_size <= 0) return fd;
+  // We have a Fast Open cookie for the server, so connect() has returned without sending
+  // anything. SYN goes out on the first write. Without a cookie connect() sends SYN with
+  // a cookie request and fails with EINPROGRESS.
+  ssize_t n = send(fd, early, early_size, MSG_NOSIGNAL);
+  if (n < 0) {
+    if (errno == EINPROGRESS) return fd;
+    return Abort(fd);
   }
+  *syn_data = n;
   return fd;
 }
 
-class ConnectEventHandler : public EventHandler {
+// Returns true if the server has acknowledged data in SYN.
+bool SynDataAccepted(int fd) {
+  tcp_info info;
+  socklen_t len = sizeof(info);
+  CHECK(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) << Errno();
+  return info.tcpi_options & TCPI_OPT_SYN_DATA;
+}
+
+class ConnectRace;
+
+// A connection attempt to one of the addresses of the server.
+class Attempt : public EventHandler, public Pooled<Attempt> {
  public:
-  ConnectEventHandler(int fd, Connector::Callback cb) : EventHandler(fd), cb_(std::move(cb)) {}
+  Attempt(int fd, ConnectRace* race, const SockAddr& addr, ssize_t syn_data)
+      : EventHandler(fd), race(race), addr(addr), syn_data(syn_data), ip(GetServerIp(addr.sa)) {}
+
+  void OnEvent(EventLoop* loop, int events) override;
+  void OnTimeout(EventLoop* loop) override;
 
-  void OnEvent(EventLoop* loop, int events) override {
-    if (HasBits(events, EPOLLERR) || HasBits(events, EPOLLOUT)) Finish(loop, SockError(fd()));
+  ConnectRace* const race;
+  const SockAddr& addr;
+  // The number of bytes of client data sent in SYN.
+  const ssize_t syn_data;
+  const ServerIp ip;
+  const Time start = Clock::now();
+};
+
+// Connects to one of the addresses of the server as in Happy Eyeballs (RFC 8305).
+//
+// Addresses are ordered by their rank in the scoreboard, falling back to the order in
+// which they come from DNS, and then interleaved by address family. A new attempt starts
+// when the previous one fails or hasn't succeeded within connection_attempt_delay. The
+// first attempt to succeed wins; the rest are closed. Every attempt feeds the scoreboard.
+class ConnectRace : public Pooled<ConnectRace> {
+ public:
+  ConnectRace(const Connector::Options& opt, const LatencyOptions& latency,
+              Scoreboard* scoreboard, FastOpenBlacklist* tfo_blacklist,
+              const ServerAddrs& addrs, int client_fd, Connector::Callback cb)
+      : opt_(opt),
+        latency_(latency),
+        scoreboard_(scoreboard),
+        tfo_blacklist_(tfo_blacklist),
+        addrs_(addrs),
+        client_fd_(client_fd),
+        cb_(std::move(cb)) {}
+
+  // Must be called from the event loop thread. Deletes `this` when done.
+  void Start(EventLoop* loop) {
+    deadline_ = loop->now() + opt_.connect_timeout;
+    struct Candidate {
+      const SockAddr* addr;
+      Scoreboard::Rank rank;
+    };
+    Candidate sorted[kMaxAttempts];
+    const size_t n = addrs_.size;
+    for (size_t i = 0; i != n; ++i) {
+      const SockAddr& addr = addrs_.addrs[i];
+      sorted[i] = {&addr, scoreboard_->GetRank(GetServerIp(addr.sa), loop->now())};
+    }
+    // Equally ranked addresses keep the order in which DNS has returned them. Not
+    // std::stable_sort() because it allocates a buffer.
+    std::sort(sorted, sorted + n, [](const Candidate& x, const Candidate& y) {
+      if (x.rank < y.rank) return true;
+      if (y.rank < x.rank) return false;
+      return x.addr < y.addr;
+    });
+    const SockAddr* by_family[2][kMaxAttempts];
+    size_t num[2] = {};
+    for (size_t i = 0; i != n; ++i) {
+      size_t f = sorted[i].addr->sa.sa_family != sorted[0].addr->sa.sa_family;
+      by_family[f][num[f]++] = sorted[i].addr;
+    }
+    for (size_t i = 0; i != std::max(num[0], num[1]); ++i) {
+      for (size_t f : {0, 1}) {
+        if (i < num[f]) candidates_[num_candidates_++] = by_family[f][i];
+      }
+    }
+    StartNext(loop);
+    if (live_ == 0) Fail();
   }
 
-  void OnTimeout(EventLoop* loop) override { Finish(loop, ETIME); }
+  void OnDone(EventLoop* loop, Attempt* a, int err) {
+    if (err == 0) return Win(loop, a);
+    LOG(WARN) << "[" << a->fd() << "] unable to connect to " << IpPort(a->addr) << ": "
+              << Errno(err);
+    error_ = err;
+    RecordFailure(loop, a->ip);
+    RecordFastOpenFailure(a);
+    Drop(loop, a);
+    // A failed attempt doesn't wait out the delay before the next one starts.
+    if (a == latest_) StartNext(loop);
+    if (live_ == 0) Fail();
+  }
+
+  void OnTimeout(EventLoop* loop, Attempt* a) {
+    if (loop->now() >= deadline_) return OnDone(loop, a, ETIME);
+    // Only the latest attempt has a short timeout: connection_attempt_delay has passed.
+    if (a == latest_) StartNext(loop);
+    loop->SetTimeout(a, deadline_ - loop->now());
+  }
 
  private:
-  void Finish(EventLoop* loop, int err) {
-    loop->Remove(this);
-    if (err == 0) {
-      LOG(INFO) << "[" << fd() << "] connected";
-      cb_(fd());
+  // Starts the next attempt that doesn't fail right away, if there are any left.
+  void StartNext(EventLoop* loop) {
+    while (next_ != num_candidates_ && loop->now() < deadline_) {
+      const SockAddr& addr = *candidates_[next_++];
+      ssize_t syn_data;
+      int fd = ConnectAsync(addr, latency_, client_fd_, tfo_blacklist_, &syn_data);
+      if (fd < 0) {
+        error_ = errno;
+        if (!IsLocalError(error_)) RecordFailure(loop, GetServerIp(addr.sa));
+        continue;
+      }
+      latest_ = new Attempt(fd, this, addr, syn_data);
+      attempts_[live_++] = latest_;
+      Duration timeout = deadline_ - loop->now();
+      if (next_ != num_candidates_) timeout = std::min(timeout, opt_.connection_attempt_delay);
+      loop->Add(latest_, EPOLLOUT, timeout);
+      return;
+    }
+  }
+
+  // Unregisters the attempt and closes its socket.
+  void Drop(EventLoop* loop, Attempt* a) {
+    *std::find(attempts_, attempts_ + live_, a) = attempts_[live_ - 1];
+    --live_;
+    const int fd = a->fd();
+    loop->Remove(a);
+    CHECK(close(fd) == 0) << Errno();
+  }
+
+  void Win(EventLoop* loop, Attempt* a) {
+    const int fd = a->fd();
+    LOG(INFO) << "[" << fd << "] connected to " << IpPort(a->addr);
+    Count(Counter::kConnected);
+    Record(a->addr.sa.sa_family == AF_INET6 ? Histogram::kConnectIpv6 : Histogram::kConnectIpv4,
+           Clock::now() - start_);
+    if (a->syn_data) {
+      // The server has got the data in SYN one way or another.
+      CHECK(recv(client_fd_, nullptr, a->syn_data, MSG_TRUNC | MSG_DONTWAIT) == a->syn_data)
+          << Errno();
+      RecordFastOpen(a);
+    }
+    scoreboard_->RecordSuccess(a->ip, Clock::now() - a->start, loop->now());
+    *std::find(attempts_, attempts_ + live_, a) = attempts_[live_ - 1];
+    --live_;
+    loop->Remove(a);
+    while (live_) {
+      // Being outrun by a later attempt is a strike against the server. Without it a
+      // blackholed address would be tried first forever.
+      Attempt* loser = attempts_[0];
+      if (loser->start < a->start) {
+        RecordFailure(loop, loser->ip);
+        RecordFastOpenFailure(loser);
+      }
+      Drop(loop, loser);
+    }
+    cb_(fd);
+    delete this;
+  }
+
+  void RecordFastOpen(Attempt* a) {
+    if (SynDataAccepted(a->fd())) {
+      Count(Counter::kTcpFastOpenAccepted);
     } else {
-      LOG(WARN) << "[" << fd() << "] unable to connect: " << Errno(err);
-      CHECK(close(fd()) == 0) << Errno();
-      cb_(-1);
+      // The kernel has retransmitted the data after the handshake, so nothing is lost
+      // except the round trip we hoped to save.
+      LOG(INFO) << "[" << a->fd() << "] server didn't accept data in SYN";
+      Count(Counter::kTcpFastOpenRejected);
+      tfo_blacklist_->Add(a->ip, Clock::now());
     }
   }
 
+  // Servers and middleboxes that drop SYNs with data make the attempt fail or time out
+  // rather than complete without the data. Either way, the next connection to the server
+  // shouldn't try its luck with TCP Fast Open again.
+  void RecordFastOpenFailure(Attempt* a) {
+    if (!a->syn_data) return;
+    LOG(INFO) << "[" << a->fd() << "] connection with data in SYN failed";
+    Count(Counter::kTcpFastOpenFailed);
+    tfo_blacklist_->Add(a->ip, Clock::now());
+  }
+
+  void RecordFailure(EventLoop* loop, const ServerIp& ip) {
+    if (scoreboard_->RecordFailure(ip, loop->now())) Count(Counter::kCircuitBreakerTrips);
+  }
+
+  void Fail() {
+    CHECK(live_ == 0);
+    Count(error_ == ETIME ? Counter::kConnectTimeouts : Counter::kConnectErrors);
+    cb_(-1);
+    delete this;
+  }
+
+  const Connector::Options& opt_;
+  const LatencyOptions& latency_;
+  Scoreboard* const scoreboard_;
+  FastOpenBlacklist* const tfo_blacklist_;
+  const ServerAddrs addrs_;
+  const int client_fd_;
   const Connector::Callback cb_;
+  const Time start_ = Clock::now();
+  Time deadline_;
+  // Addresses in the order in which they are tried.
+  const SockAddr* candidates_[kMaxAttempts];
+  size_t num_candidates_ = 0;
+  // Index of the next address in candidates_ to try.
+  size_t next_ = 0;
+  // Attempts in progress. The first live_ elements are valid.
+  Attempt* attempts_[kMaxAttempts];
+  size_t live_ = 0;
+  // The attempt that has started last.
+  Attempt* latest_ = nullptr;
+  // The error of the last failed attempt.
+  int error_ = 0;
 };
 
+void Attempt::OnEvent(EventLoop* loop, int events) {
+  if (HasBits(events, EPOLLERR) || HasBits(events, EPOLLOUT)) {
+    race->OnDone(loop, this, SockError(fd()));
+  }
+}
+
+void Attempt::OnTimeout(EventLoop* loop) { race->OnTimeout(loop, this); }
+
 }  // namespace
 
-Connector::Connector(const Options& opt) : event_loop_(*new EventLoop(opt.connect_timeout)) {}
+Connector::Connector(const Options& opt, const LatencyOptions& latency, EventLoop* loop)
+    : opt_(opt),
+      latency_(latency),
+      scoreboard_(*new Scoreboard(opt)),
+      tfo_blacklist_(opt.tcp_fastopen && GetCaps().tcp_fastopen_client
+                         ? new FastOpenBlacklist(opt.tcp_fastopen_blacklist_duration,
+                                                 opt.tcp_fastopen_blacklist_size)
+                         : nullptr),
+      event_loop_(loop ? *loop : *new EventLoop(opt.connect_timeout, latency)) {
+  CHECK(opt.connection_attempt_delay > Duration::zero());
+  if (opt.tcp_fastopen && !tfo_blacklist_) {
+    LOG(WARN) << "TCP Fast Open for outgoing connections isn't supported; not using it";
+  }
+}
 
-void Connector::Connect(const addrinfo& addr, Callback cb) {
+void Connector::Connect(const ServerAddrs& addrs, int client_fd, Callback cb) {
+  CHECK(addrs.size > 0);
   CHECK(cb);
-  int fd = ConnectAsync(addr);
-  if (fd < 0) {
-    cb(fd);
-    return;
-  }
-  auto* eh = new ConnectEventHandler(fd, std::move(cb));
-  event_loop_.ScheduleOrRun([this, eh]() { event_loop_.Add(eh, EPOLLOUT); });
+  auto* race = new ConnectRace(opt_, latency_, &scoreboard_, tfo_blacklist_, addrs, client_fd,
+                               std::move(cb));
+  event_loop_.ScheduleOrRun([this, race]() { race->Start(&event_loop_); });
 }
 
+void Connector::Pin(const std::vector<int>& cpus) { event_loop_.Pin(cpus); }
+
 }  // namespace hcproxy
@@ -15,40 +15,81 @@
 #ifndef ROMKATV_HCPROXY_CONNECTOR_H_
 #define ROMKATV_HCPROXY_CONNECTOR_H_
 
-#include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <chrono>
 #include <functional>
+#include <vector>
 
+#include "addr.h"
 #include "event_loop.h"
+#include "latency.h"
+#include "scoreboard.h"
 #include "time.h"
 
 namespace hcproxy {
 
+namespace internal_connector {
+
+class FastOpenBlacklist;
+
+}  // namespace internal_connector
+
 class Connector {
  public:
-  struct Options {
+  // Scoreboard options control the order in which the addresses of a server are tried.
+  struct Options : Scoreboard::Options {
     // Close the client connection if unable to establish a server connection
     // within this time. More specifically, this is how much time we allow
     // for the socket to become writable after we call connect() on it.
     Duration connect_timeout = std::chrono::seconds(10);
+    // When the server has several addresses, start connecting to the next one if none
+    // of the previous attempts has succeeded within this time. Addresses of different
+    // families (IPv6 and IPv4) are tried alternately. The first connection to be
+    // established wins; the rest are closed. See RFC 8305.
+    Duration connection_attempt_delay = std::chrono::milliseconds(250);
+    // Connect to servers with TCP Fast Open if the client has already sent some data.
+    // The data (up to one packet) is carried in SYN, which saves a round trip if the
+    // server accepts it. Clients usually send data early only with optimistic_response
+    // or when they don't wait for the response on their own. Requires support for
+    // TCP_FASTOPEN_CONNECT and net.ipv4.tcp_fastopen & 1; ignored otherwise.
+    bool tcp_fastopen = false;
+    // Don't use TCP Fast Open with a server for this long after it has failed to accept
+    // data in SYN, or after a connection attempt with data in SYN has failed or timed out.
+    Duration tcp_fastopen_blacklist_duration = std::chrono::hours(1);
+    // The maximum number of servers in the TCP Fast Open blacklist. When it's full,
+    // new failures aren't recorded until old entries expire.
+    size_t tcp_fastopen_blacklist_size = 4096;
   };
 
-  explicit Connector(const Options& opt);
+  // If `loop` is not null, runs on it instead of a thread of its own.
+  explicit Connector(const Options& opt, const LatencyOptions& latency = {},
+                     EventLoop* loop = nullptr);
   Connector(Connector&&) = delete;
   ~Connector() = delete;
 
   using Callback = std::function<void(int)>;
 
-  // Creates a socket and attempts to connect it to the server at the specified
-  // address. Then calls `cb` with the newly created socket file descriptor as
-  // argument, or with -1 on error.
+  // Creates a socket and attempts to connect it to the server at one of the specified
+  // addresses, which must not be empty. Then calls `cb` with
+  // the newly created socket file descriptor as argument, or with -1 on error.
+  //
+  // If TCP Fast Open is enabled, data that has been received from `client_fd` may
+  // be sent to the server in SYN. Such data is consumed from `client_fd`.
   //
   // Does not block.
-  void Connect(const addrinfo& addr, Callback cb);
+  void Connect(const ServerAddrs& addrs, int client_fd, Callback cb);
+
+  // Restricts the connector thread to the specified CPUs. Can be called from any thread.
+  void Pin(const std::vector<int>& cpus);
 
  private:
+  const Options opt_;
+  const LatencyOptions latency_;
+  // Used only from the event loop thread.
+  Scoreboard& scoreboard_;
+  // Null if TCP Fast Open is disabled.
+  internal_connector::FastOpenBlacklist* const tfo_blacklist_;
   EventLoop& event_loop_;
 };
 
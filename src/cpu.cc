@@ -0,0 +1,44 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cpu.h"
+
+#include <sched.h>
+
+#include "check.h"
+#include "logging.h"
+
+namespace hcproxy {
+
+void PinThread(pthread_t thread, const std::vector<int>& cpus) {
+  if (cpus.empty()) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CHECK(cpu >= 0 && cpu < CPU_SETSIZE) << cpu;
+    CPU_SET(cpu, &set);
+  }
+  int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+  CHECK(err == 0) << Errno(err);
+}
+
+void SetRealtimePriority(pthread_t thread, int priority) {
+  if (priority <= 0) return;
+  sched_param param = {};
+  param.sched_priority = priority;
+  int err = pthread_setschedparam(thread, SCHED_FIFO, &param);
+  if (err) LOG(WARN) << "Unable to switch thread to SCHED_FIFO: " << Errno(err);
+}
+
+}  // namespace hcproxy
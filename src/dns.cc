@@ -19,52 +19,80 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
 #include <chrono>
 #include <cstring>
+#include <mutex>
+#include <new>
 #include <sstream>
+#include <string>
+#include <system_error>
 #include <utility>
+#include <vector>
 
-#include "addr.h"
 #include "check.h"
+#include "epoch.h"
 #include "logging.h"
+#include "stats.h"
 
 namespace hcproxy {
 
 namespace {
 
-std::shared_ptr<const addrinfo> Advance(std::shared_ptr<const addrinfo>& p) {
-  return std::exchange(p, p ? std::shared_ptr<const addrinfo>(p, p->ai_next) : nullptr);
-}
+constexpr size_t kNumShards = 64;
+constexpr size_t kMinTableCapacity = 16;
+
+// DNS names are at most 253 characters long. IP literals are shorter.
+constexpr size_t kMaxHostSize = 253;
+
+// Cache hits record the time of use in the entry at most this often, so that a popular
+// host doesn't have its cache line bounce between threads.
+constexpr Duration kUseResolution = std::chrono::seconds(1);
 
+// Doesn't require `head` to be the head of a circular list: stops at either.
 std::string Describe(const addrinfo& head) {
   std::ostringstream strm;
-  for (const addrinfo* p = &head; p; p = p->ai_next) {
+  for (const addrinfo* p = &head; p; p = p->ai_next == &head ? nullptr : p->ai_next) {
+    char ip[INET6_ADDRSTRLEN];
     if (p != &head) strm << ", ";
-    strm << IpPort(*p);
+    if (getnameinfo(p->ai_addr, p->ai_addrlen, ip, sizeof(ip), nullptr, 0, NI_NUMERICHOST)) {
+      strm << '?';
+    } else {
+      strm << ip;
+    }
   }
   return strm.str();
 }
 
-std::shared_ptr<const addrinfo> ResolveSync(const std::string& host_port) {
-  const char* port = std::strchr(host_port.c_str(), ':');
-  if (!port) {
-    LOG(WARN) << "Malformed host:port: " << host_port;
-    return nullptr;
-  }
-  std::string host(host_port.c_str(), port);
-  ++port;
+// Splits "host:port" or "[ipv6]:port" and writes the lower-cased host to `buf`. Returns
+// false if the host is empty or too long, or if the port isn't a number in [1, 65535].
+bool SplitHostPort(std::string_view host_port, char (&buf)[kMaxHostSize], std::string_view* host,
+                   std::uint16_t* port) {
+  size_t sep = host_port.rfind(':');
+  if (sep == std::string_view::npos) return false;
+  std::string_view h = host_port.substr(0, sep);
+  if (h.size() >= 2 && h.front() == '[' && h.back() == ']') h = h.substr(1, h.size() - 2);
+  if (h.empty() || h.size() > sizeof(buf)) return false;
+  const char* end = host_port.data() + host_port.size();
+  auto [ptr, ec] = std::from_chars(host_port.data() + sep + 1, end, *port);
+  if (ec != std::errc() || ptr != end || *port == 0) return false;
+  for (size_t i = 0; i != h.size(); ++i) buf[i] = std::tolower(static_cast<unsigned char>(h[i]));
+  *host = std::string_view(buf, h.size());
+  return true;
+}
+
+std::shared_ptr<const addrinfo> ResolveSync(const std::string& host, int family) {
   addrinfo* res;
   addrinfo hint = {};
-  hint.ai_family = AF_INET;
+  hint.ai_family = family;
   hint.ai_socktype = SOCK_STREAM;
-  hint.ai_flags = AI_NUMERICSERV;
-  int ret = getaddrinfo(host.c_str(), port, &hint, &res);
+  int ret = getaddrinfo(host.c_str(), nullptr, &hint, &res);
   if (ret != 0) {
-    LOG(WARN) << "DNS error for '" << host_port << "': " << gai_strerror(ret);
+    LOG(WARN) << "DNS error for '" << host << "': " << gai_strerror(ret);
     return nullptr;
   }
-  CHECK(res->ai_addr->sa_family == AF_INET);
-  LOG(INFO) << "Resolved " << host_port << " as " << Describe(*res);
   for (addrinfo* tail = res;; tail = tail->ai_next) {
     if (tail->ai_next) continue;
     tail->ai_next = res;
@@ -75,77 +103,330 @@ std::shared_ptr<const addrinfo> ResolveSync(const std::string& host_port) {
   }
 }
 
+void SetPort(SockAddr& addr, std::uint16_t port) {
+  if (addr.sa.sa_family == AF_INET) {
+    addr.v4.sin_port = htons(port);
+  } else {
+    addr.v6.sin6_port = htons(port);
+  }
+}
+
+int64_t Ticks(Time t) { return t.time_since_epoch().count(); }
+
 }  // namespace
 
+// The addresses of a host as of the last successful lookup. Immutable. Followed in memory
+// by `size` addresses with zero ports.
+struct DnsResolver::Addrs {
+  // Copies addresses from a list that is linked through ai_next, possibly circular.
+  // Without `head`, the list is empty.
+  static const Addrs* New(const addrinfo* head, Time resolved_at) {
+    size_t n = 0;
+    for (const addrinfo* p = head; p; p = p->ai_next == head ? nullptr : p->ai_next) ++n;
+    void* mem = ::operator new(sizeof(Addrs) + n * sizeof(SockAddr));
+    auto* res = new (mem) Addrs{resolved_at, 0};
+    for (const addrinfo* p = head; p; p = p->ai_next == head ? nullptr : p->ai_next) {
+      if (p->ai_family != AF_INET && p->ai_family != AF_INET6) continue;
+      SockAddr& addr = res->data()[res->size++];
+      std::memcpy(&addr, p->ai_addr, std::min<size_t>(p->ai_addrlen, sizeof(addr)));
+      SetPort(addr, 0);
+    }
+    return res;
+  }
+
+  static void Delete(const Addrs* p) { ::operator delete(const_cast<Addrs*>(p)); }
+
+  SockAddr* data() { return reinterpret_cast<SockAddr*>(this + 1); }
+  const SockAddr* data() const { return reinterpret_cast<const SockAddr*>(this + 1); }
+
+  Time resolved_at;
+  size_t size;
+};
+
+struct DnsResolver::Entry {
+  struct Waiter {
+    std::uint16_t port;
+    Time start;
+    Callback cb;
+  };
+
+  Entry(uint64_t hash, std::string_view host, Time now)
+      : hash(hash), host(host), used_at(Ticks(now)) {}
+
+  Time UsedAt() const { return Time(Duration(used_at.load(std::memory_order_relaxed))); }
+
+  void Use(Time now) {
+    if (Ticks(now) - used_at.load(std::memory_order_relaxed) >= kUseResolution.count()) {
+      used_at.store(Ticks(now), std::memory_order_relaxed);
+    }
+  }
+
+  const uint64_t hash;
+  const std::string host;
+  // Null until the first lookup completes. After that it points to the results of the
+  // last successful lookup, or to empty Addrs if there hasn't been one.
+  std::atomic<const Addrs*> addrs{nullptr};
+  // Time::rep of the last call to Resolve() for the host, give or take kUseResolution.
+  std::atomic<int64_t> used_at;
+
+  // The rest is guarded by the mutex of the shard.
+
+  std::vector<Waiter> waiters;
+  // The time of the last lookup, successful or not.
+  Time resolved_at;
+  // The smallest TTL of the DNS records in `addrs`.
+  Duration ttl = Duration::max();
+};
+
+// Open addressing with linear probing. Never more than half full, counting erased slots.
+struct DnsResolver::Table {
+  explicit Table(size_t capacity)
+      : mask(capacity - 1), slots(new std::atomic<Entry*>[capacity]()) {
+    CHECK((capacity & mask) == 0) << capacity;
+  }
+
+  // Marks slots of erased entries so that probing goes on past them.
+  static inline Entry* const kErased = reinterpret_cast<Entry*>(alignof(Entry));
+
+  size_t capacity() const { return mask + 1; }
+
+  // Can be called without a lock on the shard. The entry stays alive as long as the
+  // caller holds EpochGuard.
+  Entry* Find(uint64_t hash, std::string_view host) const {
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Entry* e = slots[i].load(std::memory_order_acquire);
+      if (!e) return nullptr;
+      if (e != kErased && e->hash == hash && e->host == host) return e;
+    }
+  }
+
+  const size_t mask;
+  const std::unique_ptr<std::atomic<Entry*>[]> slots;
+};
+
+struct alignas(64) DnsResolver::Shard {
+  // Requires a lock. `e` must not be in the table.
+  void Insert(Entry* e) {
+    Table* t = table.load(std::memory_order_relaxed);
+    if ((used + 1) * 2 > t->capacity()) t = Rehash();
+    for (size_t i = e->hash & t->mask;; i = (i + 1) & t->mask) {
+      Entry* x = t->slots[i].load(std::memory_order_relaxed);
+      if (x && x != Table::kErased) continue;
+      if (!x) ++used;
+      ++size;
+      t->slots[i].store(e, std::memory_order_release);
+      return;
+    }
+  }
+
+  // Requires a lock. `e` must be in the table. Retires `e`.
+  void Erase(Entry* e) {
+    Table* t = table.load(std::memory_order_relaxed);
+    for (size_t i = e->hash & t->mask;; i = (i + 1) & t->mask) {
+      if (t->slots[i].load(std::memory_order_relaxed) != e) continue;
+      t->slots[i].store(Table::kErased, std::memory_order_release);
+      --size;
+      Retire([e] {
+        if (const Addrs* a = e->addrs.load(std::memory_order_relaxed)) Addrs::Delete(a);
+        delete e;
+      });
+      return;
+    }
+  }
+
+  // Requires a lock. Replaces the table with a new one that has no erased slots and
+  // is at most a quarter full.
+  Table* Rehash() {
+    Table* old = table.load(std::memory_order_relaxed);
+    size_t capacity = kMinTableCapacity;
+    while (capacity < 4 * (size + 1)) capacity *= 2;
+    auto* t = new Table(capacity);
+    for (size_t i = 0; i != old->capacity(); ++i) {
+      Entry* e = old->slots[i].load(std::memory_order_relaxed);
+      if (!e || e == Table::kErased) continue;
+      size_t j = e->hash & t->mask;
+      while (t->slots[j].load(std::memory_order_relaxed)) j = (j + 1) & t->mask;
+      t->slots[j].store(e, std::memory_order_relaxed);
+    }
+    table.store(t, std::memory_order_release);
+    used = size;
+    Retire([old] { delete old; });
+    return t;
+  }
+
+  std::atomic<Table*> table{new Table(kMinTableCapacity)};
+  std::mutex mutex;
+  // The number of entries in the table.
+  size_t size = 0;
+  // The number of entries plus the number of erased slots.
+  size_t used = 0;
+};
+
 DnsResolver::DnsResolver(Options opt)
-    : opt_(std::move(opt)), threads_(opt_.num_dns_resolution_threads) {}
+    : opt_(std::move(opt)),
+      shards_(new Shard[kNumShards]),
+      client_(opt_.dns_backend == Backend::kAsync ? DnsClient::New(opt_) : nullptr),
+      threads_(client_ ? 1 : opt_.num_dns_resolution_threads) {
+  if (opt_.dns_backend == Backend::kAsync && !client_) {
+    LOG(WARN) << "Falling back to getaddrinfo() for DNS resolution";
+  }
+}
 
 void DnsResolver::Resolve(std::string_view host_port, Callback cb) {
   const Time now = Clock::now();
-  std::unique_lock<std::mutex> lock(mutex_);
-  auto it = cache_.find(host_port);
-  if (it == cache_.end()) {
-    CacheData c;
-    c.callbacks.push_back(std::move(cb));
-    it = cache_.insert({std::string(host_port), std::move(c)}).first;
+  char buf[kMaxHostSize];
+  std::string_view host;
+  std::uint16_t port = 0;
+  if (!SplitHostPort(host_port, buf, &host, &port)) {
+    LOG(WARN) << "Malformed host:port: " << host_port;
+    Count(Counter::kResolveErrors);
+    return cb(nullptr);
+  }
+  const uint64_t hash = std::hash<std::string_view>()(host);
+  Shard& shard = GetShard(hash);
+  ServerAddrs addrs;
+  bool hit = false;
+  bool ok = false;
+  {
+    EpochGuard guard;
+    if (Entry* e = shard.table.load(std::memory_order_acquire)->Find(hash, host)) {
+      if (const Addrs* a = e->addrs.load(std::memory_order_acquire)) {
+        hit = true;
+        ok = Fill(*a, port, now, &addrs);
+        e->Use(now);
+      }
+    }
+  }
+  if (hit) {
+    Count(ok ? Counter::kResolved : Counter::kResolveErrors);
+    Record(Histogram::kDnsHit, Clock::now() - now);
+    return cb(ok ? &addrs : nullptr);
+  }
+
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  Entry* e = shard.table.load(std::memory_order_relaxed)->Find(hash, host);
+  if (e && e->addrs.load(std::memory_order_relaxed)) {
+    // The first lookup has completed after we've looked.
     lock.unlock();
-    threads_.Schedule(now, [=] { ProcessCacheEntry(it); });
-    return;
+    return Resolve(host_port, std::move(cb));
   }
-  CacheData& c = it->second;
-  if (!c.callbacks.empty()) {
-    c.callbacks.push_back(std::move(cb));
+  if (e) {
+    e->waiters.push_back({port, now, std::move(cb)});
     return;
   }
-  std::shared_ptr<const addrinfo> addr =
-      c.successfully_resolved_at + opt_.dns_cache_ttl > now ? c.addr : nullptr;
-  c.Use(now);
+  e = new Entry(hash, host, now);
+  e->waiters.push_back({port, now, std::move(cb)});
+  shard.Insert(e);
   lock.unlock();
-  cb(std::move(addr));
+  threads_.Schedule(now, [=] { ProcessCacheEntry(e); });
+}
+
+DnsResolver::Stats DnsResolver::stats() {
+  Stats res = {};
+  for (size_t i = 0; i != kNumShards; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    res.cache_size += shards_[i].size;
+  }
+  res.queue_size = client_ ? client_->num_pending() : threads_.queue_size();
+  return res;
+}
+
+DnsResolver::Shard& DnsResolver::GetShard(uint64_t hash) const {
+  // The low bits pick the slot within the table.
+  return shards_[(hash >> 32) % kNumShards];
 }
 
-void DnsResolver::ProcessCacheEntry(Cache::iterator it) {
-  CacheData& c = it->second;
-  Time now = Clock::now();
-  std::unique_lock<std::mutex> lock(mutex_);
-  if (c.callbacks.empty() && c.used_at + opt_.dns_cache_refresh_duration <= now) {
-    cache_.erase(it);
+bool DnsResolver::Fill(const Addrs& addrs, std::uint16_t port, Time now,
+                       ServerAddrs* out) const {
+  if (addrs.size == 0 || addrs.resolved_at + opt_.dns_cache_ttl <= now) return false;
+  // Spreads connections over the addresses. Per thread, so that it doesn't need atomics.
+  static thread_local size_t rotation = 0;
+  size_t j = rotation++ % addrs.size;
+  out->size = std::min(addrs.size, ServerAddrs::kMaxSize);
+  for (size_t i = 0; i != out->size; ++i) {
+    out->addrs[i] = addrs.data()[j];
+    SetPort(out->addrs[i], port);
+    if (++j == addrs.size) j = 0;
+  }
+  return true;
+}
+
+void DnsResolver::ProcessCacheEntry(Entry* e) {
+  Shard& shard = GetShard(e->hash);
+  const Time now = Clock::now();
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  if (e->waiters.empty() && e->UsedAt() + opt_.dns_cache_refresh_duration <= now) {
+    shard.Erase(e);
     return;
   }
-  if (c.resolved_at + opt_.dns_cache_refresh_period <= now) {
-    lock.unlock();
-    std::shared_ptr<const addrinfo> addr = ResolveSync(it->first);
-    now = Clock::now();
-    lock.lock();
-    c.resolved_at = now;
-    if (addr) {
-      c.addr = addr;
-      c.successfully_resolved_at = now;
-      for (int64_t i = 0; c.use_count; ++i) {
-        --c.use_count;
-        Advance(c.addr);
-        if (c.addr == addr) c.use_count %= i + 1;
-      }
+  const bool refresh = e->resolved_at + RefreshPeriod(*e) <= now;
+  lock.unlock();
+  refresh ? Lookup(e) : Dispatch(e);
+}
+
+void DnsResolver::Lookup(Entry* e) {
+  if (client_) {
+    client_->Resolve(e->host, 0, opt_.dns_address_family,
+                     [this, e](std::shared_ptr<const addrinfo> addr, Duration ttl) {
+                       OnLookup(e, std::move(addr), ttl);
+                     });
+  } else {
+    OnLookup(e, ResolveSync(e->host, opt_.dns_address_family), Duration::max());
+  }
+}
+
+void DnsResolver::OnLookup(Entry* e, std::shared_ptr<const addrinfo> addr, Duration ttl) {
+  Count(Counter::kDnsLookups);
+  if (addr) {
+    LOG(INFO) << "Resolved " << e->host << " as " << Describe(*addr);
+  } else {
+    Count(Counter::kDnsLookupErrors);
+  }
+  const Time now = Clock::now();
+  const Addrs* fresh = addr ? Addrs::New(addr.get(), now) : nullptr;
+  const Addrs* stale = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(GetShard(e->hash).mutex);
+    e->resolved_at = now;
+    if (fresh) {
+      e->ttl = ttl;
+      stale = e->addrs.load(std::memory_order_relaxed);
+      e->addrs.store(fresh, std::memory_order_release);
+    } else if (!e->addrs.load(std::memory_order_relaxed)) {
+      e->addrs.store(Addrs::New(nullptr, now), std::memory_order_release);
     }
   }
-  if (!c.callbacks.empty()) {
-    std::vector<Callback> callbacks = std::exchange(c.callbacks, {});
-    std::shared_ptr<const addrinfo> addr = c.addr;
-    for (size_t i = 0; i != callbacks.size(); ++i) c.Use(now);
-    lock.unlock();
-    for (const auto& f : callbacks) f(Advance(addr));
-    lock.lock();
+  if (stale) Retire([stale] { Addrs::Delete(stale); });
+  Dispatch(e);
+}
+
+void DnsResolver::Dispatch(Entry* e) {
+  Shard& shard = GetShard(e->hash);
+  const Time now = Clock::now();
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  std::vector<Entry::Waiter> waiters = std::exchange(e->waiters, {});
+  std::vector<ServerAddrs> addrs(waiters.size());
+  bool ok = false;
+  if (!waiters.empty()) {
+    // Entries with waiters aren't erased, and their addresses aren't retired while we
+    // hold the lock.
+    const Addrs& a = *e->addrs.load(std::memory_order_relaxed);
+    for (size_t i = 0; i != waiters.size(); ++i) ok = Fill(a, waiters[i].port, now, &addrs[i]);
+    e->Use(now);
   }
-  Time next = std::min(c.resolved_at + opt_.dns_cache_refresh_period,
-                       c.used_at + opt_.dns_cache_refresh_duration);
+  Time next =
+      std::min(e->resolved_at + RefreshPeriod(*e), e->UsedAt() + opt_.dns_cache_refresh_duration);
   lock.unlock();
-  threads_.Schedule(next, [=] { ProcessCacheEntry(it); });
+  if (!waiters.empty()) Count(ok ? Counter::kResolved : Counter::kResolveErrors, waiters.size());
+  for (size_t i = 0; i != waiters.size(); ++i) {
+    Record(Histogram::kDnsMiss, Clock::now() - waiters[i].start);
+    waiters[i].cb(ok ? &addrs[i] : nullptr);
+  }
+  threads_.Schedule(next, [=] { ProcessCacheEntry(e); });
 }
 
-void DnsResolver::CacheData::Use(const Time& now) {
-  ++use_count;
-  Advance(addr);
-  used_at = std::max(used_at, now);
+Duration DnsResolver::RefreshPeriod(const Entry& e) const {
+  return std::clamp<Duration>(e.ttl, std::chrono::seconds(1), opt_.dns_cache_refresh_period);
 }
 
 }  // namespace hcproxy
@@ -16,16 +16,16 @@
 #define ROMKATV_HCPROXY_DNS_H_
 
 #include <netdb.h>
+#include <sys/socket.h>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <functional>
-#include <map>
 #include <memory>
-#include <mutex>
-#include <string>
-#include <tuple>
+#include <string_view>
 
+#include "addr.h"
+#include "dns_client.h"
 #include "thread_pool.h"
 #include "time.h"
 
@@ -33,63 +33,99 @@ namespace hcproxy {
 
 class DnsResolver {
  public:
-  struct Options {
-    // Use this many threads to perform DNS resolution. DNS resolution is done by
-    // means of getaddrinfo(), which is synchronous. This option specifies the
+  enum class Backend {
+    // Resolve with DnsClient: non-blocking queries on a single thread, many lookups in
+    // flight at once, record TTLs honored. Falls back to kGetaddrinfo if the DnsClient
+    // cannot be created.
+    kAsync,
+    // Resolve with getaddrinfo() on num_dns_resolution_threads threads. Consults all
+    // sources configured in nsswitch.conf(5) rather than just the hosts file and DNS.
+    kGetaddrinfo,
+  };
+
+  struct Options : DnsClient::Options {
+    Backend dns_backend = Backend::kAsync;
+    // Used only with Backend::kGetaddrinfo. Use this many threads to perform DNS
+    // resolution. getaddrinfo() is synchronous, so this option specifies the
     // maximum number of concurrent calls to getaddrinfo(). All concurrent calls
-    // are for different addresses. Concurrent calls to DnsResolver::Resolve() for
-    // the same address are collapsed so that just one call to getaddrinfo() is
+    // are for different hosts. Concurrent calls to DnsResolver::Resolve() for
+    // the same host are collapsed so that just one call to getaddrinfo() is
     // made and therefore just one thread is used.
     size_t num_dns_resolution_threads = 8;
-    // Do not use the results of getaddrinfo() that were obtained longer than
-    // this much time ago. If getaddrinfo() starts failing for an address for which
-    // it has worked before, we'll forget the last successful result after this much
-    // time.
+    // Do not use the results of DNS lookups that were obtained longer than this
+    // much time ago. If lookups start failing for a host for which they have
+    // worked before, we'll forget the last successful result after this much time.
     Duration dns_cache_ttl = std::chrono::seconds(300);
-    // Call getaddrinfo() for the addresses we care about this often to obtain
-    // fresh mapping.
+    // Look up the hosts we care about this often to obtain fresh mapping. With
+    // Backend::kAsync, hosts whose DNS records have shorter TTLs are looked up
+    // as often as their TTLs require but no more than once a second.
     Duration dns_cache_refresh_period = std::chrono::seconds(75);
-    // Whenever DnsResolver::Resolve() is called for a given address, keep resolving
-    // the address periodically for this long afterwards. This is meant to keep the
+    // Whenever DnsResolver::Resolve() is called for a given host, keep resolving
+    // the host periodically for this long afterwards. This is meant to keep the
     // cache fresh for addresses we care about.
     Duration dns_cache_refresh_duration = std::chrono::seconds(3600);
+    // Resolve hosts to addresses of this family: AF_INET, AF_INET6 or AF_UNSPEC for both.
+    // Connector races connections to addresses of different families.
+    int dns_address_family = AF_UNSPEC;
   };
 
-  using Callback = std::function<void(std::shared_ptr<const addrinfo>)>;
+  // The argument is null on error. Otherwise it's valid only during the call.
+  using Callback = std::function<void(const ServerAddrs* addrs)>;
 
   explicit DnsResolver(Options opt);
   DnsResolver(DnsResolver&&) = delete;
+  ~DnsResolver() = delete;
 
-  // The callback is called exactly once. It may be called synchronously.
-  // Its argument is null on error.
+  // Calls `cb` exactly once with up to ServerAddrs::kMaxSize addresses of the host, all
+  // with the port from `host_port`. It may be called synchronously. The cache is keyed by
+  // host, so requests for different ports share DNS lookups.
   //
-  // If `host_port` isn't of the form "host_or_ip:port", you'll get an error.
+  // If `host_port` isn't of the form "host_or_ip:port", you'll get an error. IPv6
+  // addresses must be in brackets: "[::1]:443".
   //
-  // Does not block.
+  // Does not block. When the answer is in the cache, doesn't take any locks and doesn't
+  // write to memory shared with other threads.
   void Resolve(std::string_view host_port, Callback cb);
 
- private:
-  struct CacheData {
-    void Use(const Time& now);
-
-    std::vector<Callback> callbacks;
-    std::shared_ptr<const addrinfo> addr;
-    Time used_at;
-    Time resolved_at;
-    Time successfully_resolved_at;
-    int64_t use_count = 0;
+  struct Stats {
+    // The number of hosts in the cache.
+    size_t cache_size;
+    // With Backend::kAsync, the number of DNS lookups in flight. Otherwise see
+    // ThreadPool::queue_size().
+    size_t queue_size;
   };
 
-  // We use std::map rather than std::unordered_map because the former supports
-  // heterogenous lookup. We pass std::string_view to find() despite having
-  // std::string as key type.
-  using Cache = std::map<std::string, CacheData, std::less<>>;
+  // Can be called from any thread.
+  Stats stats();
+
+ private:
+  // The cache is an array of shards, each an open addressing hash table of entries.
+  // Readers find entries and their addresses without locks under EpochGuard. Writers
+  // (cache misses and DNS lookups) lock the shard, publish changes with atomic stores
+  // and pass whatever they've unlinked to Retire().
+  struct Addrs;
+  struct Entry;
+  struct Table;
+  struct Shard;
 
-  void ProcessCacheEntry(Cache::iterator it);
+  Shard& GetShard(uint64_t hash) const;
+  // Copies addresses to `out`, starting from the next one in the rotation of the current
+  // thread. Returns false if there are no usable addresses.
+  bool Fill(const Addrs& addrs, std::uint16_t port, Time now, ServerAddrs* out) const;
+  // Looks up the host if it's time to refresh it. Serves waiting callbacks and schedules
+  // itself to run again unless the entry is no longer needed.
+  void ProcessCacheEntry(Entry* e);
+  void Lookup(Entry* e);
+  void OnLookup(Entry* e, std::shared_ptr<const addrinfo> addr, Duration ttl);
+  void Dispatch(Entry* e);
+  // Requires a lock on the shard.
+  Duration RefreshPeriod(const Entry& e) const;
 
   const Options opt_;
-  std::mutex mutex_;
-  Cache cache_;
+  Shard* const shards_;
+  // Null with Backend::kGetaddrinfo.
+  DnsClient* const client_;
+  // With Backend::kAsync, there is just one thread, which is used only as a timer.
   ThreadPool threads_;
 };
 
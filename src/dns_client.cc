@@ -0,0 +1,638 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dns_client.h"
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include "addr.h"
+#include "check.h"
+#include "logging.h"
+
+namespace hcproxy {
+
+namespace {
+
+constexpr std::uint16_t kTypeA = 1;
+constexpr std::uint16_t kTypeAaaa = 28;
+constexpr std::uint16_t kTypeOpt = 41;
+constexpr std::uint16_t kClassIn = 1;
+
+constexpr std::uint16_t kFlagQr = 1 << 15;
+constexpr std::uint16_t kFlagTc = 1 << 9;
+constexpr std::uint16_t kFlagRd = 1 << 8;
+
+constexpr int kRcodeNoError = 0;
+constexpr int kRcodeNxDomain = 3;
+
+constexpr size_t kHeaderSize = 12;
+// EDNS0 OPT pseudo-record that we append to every query.
+constexpr size_t kOptSize = 11;
+// Advertised in OPT. Large enough for most answers and small enough to avoid IP
+// fragmentation. See https://www.dnsflagday.net/2020/.
+constexpr std::uint16_t kUdpPayloadSize = 1232;
+
+// The number of queries in flight can't exceed the number of distinct message IDs.
+// Stay well below it so that allocating a random ID is cheap.
+constexpr size_t kMaxQueries = 16384;
+
+std::uint16_t Get16(const unsigned char* p) { return p[0] << 8 | p[1]; }
+
+uint32_t Get32(const unsigned char* p) { return uint32_t{Get16(p)} << 16 | Get16(p + 2); }
+
+void Put16(std::string& s, std::uint16_t x) {
+  s.push_back(x >> 8);
+  s.push_back(x & 0xFF);
+}
+
+// Parses an IPv4 or IPv6 address without port. IPv6 addresses may have a scope ("%eth0").
+bool ParseIp(std::string_view s, sockaddr_storage* addr) {
+  std::string ip(s.substr(0, s.find('%')));
+  *addr = {};
+  auto* v4 = reinterpret_cast<sockaddr_in*>(addr);
+  if (inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) == 1) {
+    v4->sin_family = AF_INET;
+    return true;
+  }
+  auto* v6 = reinterpret_cast<sockaddr_in6*>(addr);
+  if (inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) == 1) {
+    v6->sin6_family = AF_INET6;
+    if (ip.size() != s.size()) v6->sin6_scope_id = if_nametoindex(s.data() + ip.size() + 1);
+    return true;
+  }
+  return false;
+}
+
+void SetPort(sockaddr_storage& addr, std::uint16_t port) {
+  if (addr.ss_family == AF_INET) {
+    reinterpret_cast<sockaddr_in&>(addr).sin_port = htons(port);
+  } else {
+    reinterpret_cast<sockaddr_in6&>(addr).sin6_port = htons(port);
+  }
+}
+
+socklen_t AddrLen(const sockaddr_storage& addr) {
+  return addr.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+}
+
+bool HasFamily(const sockaddr_storage& addr, int family) {
+  return family == AF_UNSPEC || addr.ss_family == family;
+}
+
+std::string ToLower(std::string s) {
+  for (char& c : s) c = std::tolower(static_cast<unsigned char>(c));
+  return s;
+}
+
+// Returns the line without comments split into words.
+std::vector<std::string> Words(std::string_view line) {
+  std::istringstream strm(std::string(line.substr(0, line.find_first_of("#;"))));
+  std::vector<std::string> res;
+  for (std::string w; strm >> w;) res.push_back(std::move(w));
+  return res;
+}
+
+// Parses "name:n" into n clamped to [lo, hi]. Returns false if `opt` doesn't start
+// with "name:" or n isn't a number.
+bool ParseOption(std::string_view opt, std::string_view name, size_t lo, size_t hi,
+                 size_t* val) {
+  if (opt.size() <= name.size() || opt.substr(0, name.size()) != name ||
+      opt[name.size()] != ':') {
+    return false;
+  }
+  size_t n = 0;
+  const char* end = opt.data() + opt.size();
+  auto [ptr, ec] = std::from_chars(opt.data() + name.size() + 1, end, n);
+  if (ptr != end || (ec != std::errc() && ec != std::errc::result_out_of_range)) return false;
+  // Values too large for size_t are clamped like any other.
+  *val = ec == std::errc() ? std::clamp(n, lo, hi) : hi;
+  return true;
+}
+
+// Returns the wire format of a query for `host` of the specified type. Requires a valid
+// host name.
+std::string EncodeQuery(std::uint16_t id, std::string_view host, std::uint16_t type) {
+  std::string msg;
+  Put16(msg, id);
+  Put16(msg, kFlagRd);
+  Put16(msg, 1);  // QDCOUNT
+  Put16(msg, 0);  // ANCOUNT
+  Put16(msg, 0);  // NSCOUNT
+  Put16(msg, 1);  // ARCOUNT
+  while (true) {
+    size_t dot = std::min(host.find('.'), host.size());
+    msg.push_back(dot);
+    msg.append(host.data(), dot);
+    if (dot == host.size()) break;
+    host.remove_prefix(dot + 1);
+  }
+  msg.push_back(0);
+  Put16(msg, type);
+  Put16(msg, kClassIn);
+  msg.push_back(0);
+  Put16(msg, kTypeOpt);
+  Put16(msg, kUdpPayloadSize);
+  Put16(msg, 0);  // extended RCODE and version
+  Put16(msg, 0);  // flags
+  Put16(msg, 0);  // RDLEN
+  return msg;
+}
+
+// Can `host` be encoded in a query? Doesn't check which characters it consists of:
+// that's up to nameservers.
+bool IsValidName(std::string_view host) {
+  if (host.empty() || host.size() > 253) return false;
+  while (true) {
+    size_t dot = std::min(host.find('.'), host.size());
+    if (dot == 0 || dot > 63) return false;
+    if (dot == host.size()) return true;
+    host.remove_prefix(dot + 1);
+  }
+}
+
+bool SkipName(const unsigned char* p, size_t n, size_t* off) {
+  while (*off < n) {
+    unsigned char len = p[*off];
+    if ((len & 0xC0) == 0xC0) {
+      *off += 2;
+      return *off <= n;
+    }
+    if (len & 0xC0) return false;
+    *off += 1 + len;
+    if (len == 0) return true;
+  }
+  return false;
+}
+
+struct Reply {
+  bool truncated;
+  int rcode;
+  std::vector<sockaddr_storage> addrs;
+  Duration ttl = Duration::max();
+};
+
+// Returns false if `msg` is malformed or isn't a reply to `query`. The addresses in the
+// reply are ignored if it's truncated.
+bool ParseReply(std::string_view msg, std::string_view query, std::uint16_t type, Reply* r) {
+  auto* p = reinterpret_cast<const unsigned char*>(msg.data());
+  size_t n = msg.size();
+  std::string_view question = query.substr(kHeaderSize, query.size() - kHeaderSize - kOptSize);
+  if (n < kHeaderSize + question.size()) return false;
+  if (msg.substr(0, 2) != query.substr(0, 2)) return false;
+  std::uint16_t flags = Get16(p + 2);
+  if (!(flags & kFlagQr) || Get16(p + 4) != 1) return false;
+  for (size_t i = 0; i != question.size(); ++i) {
+    unsigned char c = question[i];
+    if (std::tolower(p[kHeaderSize + i]) != std::tolower(c)) return false;
+  }
+  r->truncated = flags & kFlagTc;
+  r->rcode = flags & 0xF;
+  if (r->truncated) return true;
+  size_t off = kHeaderSize + question.size();
+  for (std::uint16_t i = 0, ancount = Get16(p + 6); i != ancount; ++i) {
+    if (!SkipName(p, n, &off) || n - off < 10) return false;
+    std::uint16_t rtype = Get16(p + off);
+    std::uint16_t rclass = Get16(p + off + 2);
+    uint32_t ttl = Get32(p + off + 4);
+    std::uint16_t rdlen = Get16(p + off + 8);
+    off += 10;
+    if (n - off < rdlen) return false;
+    if (rclass != kClassIn) {
+      off += rdlen;
+      continue;
+    }
+    // Per RFC 2181, TTLs with the most significant bit set are treated as zero.
+    r->ttl = std::min<Duration>(r->ttl, std::chrono::seconds(ttl >> 31 ? 0 : ttl));
+    sockaddr_storage addr = {};
+    if (rtype == type && type == kTypeA && rdlen == 4) {
+      auto& v4 = reinterpret_cast<sockaddr_in&>(addr);
+      v4.sin_family = AF_INET;
+      std::memcpy(&v4.sin_addr, p + off, 4);
+      r->addrs.push_back(addr);
+    } else if (rtype == type && type == kTypeAaaa && rdlen == 16) {
+      auto& v6 = reinterpret_cast<sockaddr_in6&>(addr);
+      v6.sin6_family = AF_INET6;
+      std::memcpy(&v6.sin6_addr, p + off, 16);
+      r->addrs.push_back(addr);
+    }
+    off += rdlen;
+  }
+  return true;
+}
+
+// A circular list in a single allocation.
+struct AddrList {
+  std::vector<addrinfo> ai;
+  std::vector<sockaddr_storage> addrs;
+};
+
+std::shared_ptr<const addrinfo> MakeList(const std::vector<sockaddr_storage>& addrs,
+                                         std::uint16_t port) {
+  auto list = std::make_shared<AddrList>();
+  list->addrs = addrs;
+  list->ai.resize(addrs.size());
+  for (size_t i = 0; i != addrs.size(); ++i) {
+    sockaddr_storage& addr = list->addrs[i];
+    SetPort(addr, port);
+    addrinfo& ai = list->ai[i];
+    ai.ai_family = addr.ss_family;
+    ai.ai_socktype = SOCK_STREAM;
+    ai.ai_protocol = IPPROTO_TCP;
+    ai.ai_addrlen = AddrLen(addr);
+    ai.ai_addr = reinterpret_cast<sockaddr*>(&addr);
+    ai.ai_next = &list->ai[(i + 1) % addrs.size()];
+  }
+  return std::shared_ptr<const addrinfo>(list, list->ai.data());
+}
+
+bool ReadResolvConf(const std::string& path, std::uint16_t port,
+                    std::vector<sockaddr_storage>* servers, Duration* timeout, size_t* attempts) {
+  std::ifstream file(path);
+  if (!file) return false;
+  for (std::string line; std::getline(file, line);) {
+    std::vector<std::string> words = Words(line);
+    if (words.size() >= 2 && words[0] == "nameserver") {
+      sockaddr_storage addr;
+      if (!ParseIp(words[1], &addr)) {
+        LOG(WARN) << "Invalid nameserver in " << path << ": " << words[1];
+        continue;
+      }
+      SetPort(addr, port);
+      servers->push_back(addr);
+    } else if (!words.empty() && words[0] == "options") {
+      for (size_t i = 1; i != words.size(); ++i) {
+        size_t secs;
+        if (ParseOption(words[i], "timeout", 1, 30, &secs)) *timeout = std::chrono::seconds(secs);
+        ParseOption(words[i], "attempts", 1, 5, attempts);
+      }
+    }
+  }
+  if (servers->empty()) {
+    sockaddr_storage addr;
+    CHECK(ParseIp("127.0.0.1", &addr));
+    SetPort(addr, port);
+    servers->push_back(addr);
+  }
+  return true;
+}
+
+void ReadHosts(const std::string& path,
+               std::unordered_map<std::string, std::vector<sockaddr_storage>>* hosts) {
+  std::ifstream file(path);
+  for (std::string line; std::getline(file, line);) {
+    std::vector<std::string> words = Words(line);
+    sockaddr_storage addr;
+    if (words.size() < 2 || !ParseIp(words[0], &addr)) continue;
+    for (size_t i = 1; i != words.size(); ++i) (*hosts)[ToLower(words[i])].push_back(addr);
+  }
+}
+
+}  // namespace
+
+struct DnsClient::Lookup {
+  std::string host;
+  std::uint16_t port;
+  Callback cb;
+  // Queries that haven't finished yet.
+  size_t num_queries;
+  std::vector<sockaddr_storage> v6;
+  std::vector<sockaddr_storage> v4;
+  Duration ttl = Duration::max();
+  // Why the last failed query has failed.
+  const char* error = nullptr;
+};
+
+struct DnsClient::Query {
+  Lookup* lookup;
+  std::uint16_t type;
+  std::uint16_t id;
+  std::string msg;
+  // Try i goes to nameserver i % servers_.size().
+  size_t tries = 0;
+  // Identifies the current try. Timeouts of earlier tries are ignored.
+  uint64_t serial = 0;
+  // The current try is over TCP. Replies over UDP are ignored.
+  bool tcp = false;
+};
+
+class DnsClient::UdpSocket : public EventHandler {
+ public:
+  UdpSocket(DnsClient* client, size_t idx, int fd, const sockaddr_storage& addr)
+      : EventHandler(fd), client_(client), idx_(idx), addr_(addr) {}
+
+  const sockaddr_storage& addr() const { return addr_; }
+
+  void OnEvent(EventLoop* loop, int events) override {
+    char buf[4 << 10];
+    while (true) {
+      ssize_t n = recv(fd(), buf, sizeof(buf), 0);
+      if (n >= 0) {
+        client_->OnUdpReply(idx_, buf, n);
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else if (errno != ECONNREFUSED) {
+        LOG(WARN) << "recv() from nameserver " << IpPort(addr_) << " failed: " << Errno();
+        return;
+      }
+    }
+  }
+
+  // Never called: sockets are added without a timeout. Queries time out on their own.
+  void OnTimeout(EventLoop* loop) override {}
+
+ private:
+  DnsClient* const client_;
+  const size_t idx_;
+  const sockaddr_storage addr_;
+};
+
+// Sends a query over TCP and reads the reply.
+class DnsClient::TcpQuery : public EventHandler {
+ public:
+  TcpQuery(DnsClient* client, int fd, const Query& q)
+      : EventHandler(fd), client_(client), id_(q.id), serial_(q.serial) {
+    Put16(out_, q.msg.size());
+    out_ += q.msg;
+  }
+
+  ~TcpQuery() override { CHECK(close(fd()) == 0) << Errno(); }
+
+  void OnEvent(EventLoop* loop, int events) override {
+    if (written_ != out_.size()) {
+      if (!Write()) return Fail(loop);
+      if (written_ == out_.size()) loop->Modify(this, EPOLLIN);
+      return;
+    }
+    if (!Read()) return Fail(loop);
+    if (in_.size() < 2 || in_.size() != 2 + Size()) return;
+    client_->OnTcpReply(id_, serial_, in_.data() + 2, in_.size() - 2);
+    loop->Remove(this);
+  }
+
+  void OnTimeout(EventLoop* loop) override { Fail(loop); }
+
+ private:
+  void Fail(EventLoop* loop) {
+    client_->OnTcpError(id_, serial_);
+    loop->Remove(this);
+  }
+
+  // The size of the reply without the length prefix. Requires two bytes in in_.
+  size_t Size() const { return Get16(reinterpret_cast<const unsigned char*>(in_.data())); }
+
+  // Returns false on error.
+  bool Write() {
+    ssize_t n = send(fd(), out_.data() + written_, out_.size() - written_, MSG_NOSIGNAL);
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+    written_ += n;
+    return true;
+  }
+
+  // Returns false on error. Doesn't read past the end of the reply.
+  bool Read() {
+    char buf[4 << 10];
+    while (in_.size() < 2 || in_.size() != 2 + Size()) {
+      size_t want = in_.size() < 2 ? 2 - in_.size() : 2 + Size() - in_.size();
+      ssize_t n = recv(fd(), buf, std::min(want, sizeof(buf)), 0);
+      if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+      if (n == 0) return false;
+      in_.append(buf, n);
+    }
+    return true;
+  }
+
+  DnsClient* const client_;
+  const std::uint16_t id_;
+  const uint64_t serial_;
+  std::string out_;
+  size_t written_ = 0;
+  std::string in_;
+};
+
+DnsClient* DnsClient::New(const Options& opt) {
+  // Defaults from resolv.conf(5).
+  Duration timeout = std::chrono::seconds(5);
+  size_t attempts = 2;
+  std::vector<sockaddr_storage> servers;
+  if (!ReadResolvConf(opt.dns_resolv_conf_path, opt.dns_nameserver_port, &servers, &timeout,
+                      &attempts)) {
+    LOG(WARN) << "Cannot read " << opt.dns_resolv_conf_path;
+    return nullptr;
+  }
+  std::vector<std::pair<int, sockaddr_storage>> sockets;
+  for (const sockaddr_storage& addr : servers) {
+    int fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr*>(&addr), AddrLen(addr)) != 0) {
+      LOG(WARN) << "Cannot use nameserver " << IpPort(addr) << ": " << Errno();
+      if (fd >= 0) CHECK(close(fd) == 0) << Errno();
+      continue;
+    }
+    LOG(INFO) << "Using nameserver " << IpPort(addr);
+    sockets.emplace_back(fd, addr);
+  }
+  if (sockets.empty()) return nullptr;
+
+  auto* client = new DnsClient();
+  client->timeout_ = timeout;
+  client->attempts_ = attempts;
+  for (const auto& [fd, addr] : sockets) {
+    client->servers_.push_back(new UdpSocket(client, client->servers_.size(), fd, addr));
+  }
+  ReadHosts(opt.dns_hosts_path, &client->hosts_);
+  client->rng_.seed(std::random_device()());
+  client->event_loop_ = new EventLoop(timeout);
+  client->event_loop_->Schedule([client]() {
+    for (UdpSocket* s : client->servers_) {
+      client->event_loop_->Add(s, EPOLLIN, EventLoop::kNoTimeout);
+    }
+  });
+  return client;
+}
+
+void DnsClient::Resolve(std::string host, std::uint16_t port, int family, Callback cb) {
+  CHECK(cb);
+  ++num_pending_;
+  event_loop_->ScheduleOrRun([=, host = std::move(host), cb = std::move(cb)]() mutable {
+    Start(std::move(host), port, family, std::move(cb));
+  });
+}
+
+void DnsClient::Start(std::string host, std::uint16_t port, int family, Callback cb) {
+  host = ToLower(std::move(host));
+  if (!host.empty() && host.back() == '.') host.pop_back();
+  std::vector<sockaddr_storage> addrs;
+  sockaddr_storage ip;
+  if (ParseIp(host, &ip)) {
+    if (HasFamily(ip, family)) addrs.push_back(ip);
+    return Done(cb, host, port, "address family mismatch", addrs, Duration::max());
+  }
+  auto it = hosts_.find(host);
+  if (it != hosts_.end()) {
+    for (const sockaddr_storage& addr : it->second) {
+      if (HasFamily(addr, family)) addrs.push_back(addr);
+    }
+    if (!addrs.empty()) return Done(cb, host, port, nullptr, addrs, Duration::max());
+  }
+  if (!IsValidName(host)) return Done(cb, host, port, "invalid host name", {}, Duration::max());
+  auto* lookup = new Lookup{std::move(host), port, std::move(cb), family == AF_UNSPEC ? 2u : 1u};
+  if (family != AF_INET) AddQuery(lookup, kTypeAaaa);
+  if (family != AF_INET6) AddQuery(lookup, kTypeA);
+}
+
+void DnsClient::AddQuery(Lookup* lookup, std::uint16_t type) {
+  if (queries_.size() >= kMaxQueries) {
+    return Complete(lookup, "too many queries in flight", {}, Duration::max());
+  }
+  std::uint16_t id;
+  do {
+    id = rng_();
+  } while (queries_.count(id));
+  auto* q = new Query{lookup, type, id, EncodeQuery(id, lookup->host, type)};
+  queries_.emplace(id, q);
+  Send(q);
+}
+
+void DnsClient::Send(Query* q) {
+  const UdpSocket& s = *servers_[q->tries++ % servers_.size()];
+  q->tcp = false;
+  q->serial = ++last_serial_;
+  if (send(s.fd(), q->msg.data(), q->msg.size(), 0) < 0) {
+    LOG(WARN) << "send() to nameserver " << IpPort(s.addr()) << " failed: " << Errno();
+    return Retry(q, "send error");
+  }
+  event_loop_->ScheduleAt(event_loop_->now() + timeout_,
+                          [this, id = q->id, serial = q->serial]() { OnUdpTimeout(id, serial); });
+}
+
+void DnsClient::SendTcp(Query* q, size_t server) {
+  const sockaddr_storage& addr = servers_[server]->addr();
+  int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG(ERROR) << "socket() failed: " << Errno();
+    return Retry(q, "TCP error");
+  }
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), AddrLen(addr)) != 0 &&
+      errno != EINPROGRESS) {
+    LOG(WARN) << "connect() to nameserver " << IpPort(addr) << " failed: " << Errno();
+    CHECK(close(fd) == 0) << Errno();
+    return Retry(q, "TCP error");
+  }
+  q->tcp = true;
+  q->serial = ++last_serial_;
+  event_loop_->Add(new TcpQuery(this, fd, *q), EPOLLOUT);
+}
+
+void DnsClient::Retry(Query* q, const char* error) {
+  if (q->tries == attempts_ * servers_.size()) return Finish(q, error, {}, Duration::max());
+  Send(q);
+}
+
+void DnsClient::OnUdpTimeout(std::uint16_t id, uint64_t serial) {
+  auto it = queries_.find(id);
+  if (it == queries_.end() || it->second->serial != serial) return;
+  Retry(it->second, "timeout");
+}
+
+void DnsClient::OnUdpReply(size_t server, const char* msg, size_t len) {
+  if (len < 2) return;
+  auto it = queries_.find(Get16(reinterpret_cast<const unsigned char*>(msg)));
+  if (it == queries_.end() || it->second->tcp) return;
+  Query* q = it->second;
+  Reply r;
+  if (!ParseReply(std::string_view(msg, len), q->msg, q->type, &r)) return;
+  if (r.truncated) return SendTcp(q, server);
+  OnReply(q, r.rcode, r.addrs, r.ttl);
+}
+
+void DnsClient::OnTcpReply(std::uint16_t id, uint64_t serial, const char* msg, size_t len) {
+  auto it = queries_.find(id);
+  if (it == queries_.end() || it->second->serial != serial) return;
+  Query* q = it->second;
+  Reply r;
+  if (!ParseReply(std::string_view(msg, len), q->msg, q->type, &r) || r.truncated) {
+    return Retry(q, "malformed reply");
+  }
+  OnReply(q, r.rcode, r.addrs, r.ttl);
+}
+
+void DnsClient::OnTcpError(std::uint16_t id, uint64_t serial) {
+  auto it = queries_.find(id);
+  if (it == queries_.end() || it->second->serial != serial) return;
+  Retry(it->second, "TCP error");
+}
+
+void DnsClient::OnReply(Query* q, int rcode, const std::vector<sockaddr_storage>& addrs,
+                        Duration ttl) {
+  switch (rcode) {
+    case kRcodeNoError:
+      return Finish(q, addrs.empty() ? "no addresses" : nullptr, addrs, ttl);
+    case kRcodeNxDomain:
+      return Finish(q, "NXDOMAIN", {}, Duration::max());
+    default:
+      // SERVFAIL, REFUSED, etc. Another nameserver may do better.
+      return Retry(q, "server failure");
+  }
+}
+
+void DnsClient::Finish(Query* q, const char* error, const std::vector<sockaddr_storage>& addrs,
+                       Duration ttl) {
+  Lookup* lookup = q->lookup;
+  queries_.erase(q->id);
+  delete q;
+  Complete(lookup, error, addrs, ttl);
+}
+
+void DnsClient::Complete(Lookup* lookup, const char* error,
+                         const std::vector<sockaddr_storage>& addrs, Duration ttl) {
+  if (error) lookup->error = error;
+  for (const sockaddr_storage& addr : addrs) {
+    (addr.ss_family == AF_INET6 ? lookup->v6 : lookup->v4).push_back(addr);
+  }
+  lookup->ttl = std::min(lookup->ttl, ttl);
+  if (--lookup->num_queries) return;
+  // Within each family, keep the order in which the nameserver has listed addresses.
+  std::vector<sockaddr_storage> all = std::move(lookup->v6);
+  all.insert(all.end(), lookup->v4.begin(), lookup->v4.end());
+  Done(lookup->cb, lookup->host, lookup->port, lookup->error, all, lookup->ttl);
+  delete lookup;
+}
+
+void DnsClient::Done(Callback& cb, const std::string& host, std::uint16_t port,
+                     const char* error, const std::vector<sockaddr_storage>& addrs,
+                     Duration ttl) {
+  if (addrs.empty()) {
+    LOG(WARN) << "DNS error for '" << host << "': " << error;
+    cb(nullptr, ttl);
+  } else {
+    cb(MakeList(addrs, port), ttl);
+  }
+  --num_pending_;
+}
+
+}  // namespace hcproxy
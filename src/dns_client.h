@@ -0,0 +1,124 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_DNS_CLIENT_H_
+#define ROMKATV_HCPROXY_DNS_CLIENT_H_
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "event_loop.h"
+#include "time.h"
+
+namespace hcproxy {
+
+// A non-blocking stub resolver. Looks up hosts in the hosts file and sends A and AAAA
+// queries to the nameservers listed in resolv.conf. All queries to a nameserver are
+// multiplexed over a single UDP socket. Truncated answers are retried over TCP.
+//
+// Search domains aren't supported: host names are always treated as fully qualified.
+//
+// Thread-safe.
+class DnsClient {
+ public:
+  struct Options {
+    // Read nameservers, `options timeout:n` and `options attempts:n` from this file. If
+    // it has no nameservers, use 127.0.0.1. See resolv.conf(5).
+    std::string dns_resolv_conf_path = "/etc/resolv.conf";
+    // Look up hosts in this file before asking nameservers. The file is read once on
+    // startup. See hosts(5).
+    std::string dns_hosts_path = "/etc/hosts";
+    // Send queries to this port of the nameservers. resolv.conf has no way to specify it.
+    std::uint16_t dns_nameserver_port = 53;
+  };
+
+  // Called from the DnsClient thread. `addr` is a circular list linked through ai_next,
+  // or null on error. `ttl` is the smallest TTL of the records in the answer; it's
+  // Duration::max() for IP literals and hosts from the hosts file.
+  using Callback = std::function<void(std::shared_ptr<const addrinfo> addr, Duration ttl)>;
+
+  // Returns null if dns_resolv_conf_path cannot be read or none of its nameservers
+  // is usable.
+  static DnsClient* New(const Options& opt);
+
+  DnsClient(DnsClient&&) = delete;
+  ~DnsClient() = delete;
+
+  // Resolves `host` to addresses of the specified family (AF_INET, AF_INET6 or
+  // AF_UNSPEC for both) and calls `cb` exactly once with the addresses, which have their
+  // port set to `port`. With AF_UNSPEC, A and AAAA queries are sent in parallel.
+  //
+  // Can be called from any thread. Does not block.
+  void Resolve(std::string host, std::uint16_t port, int family, Callback cb);
+
+  // The number of calls to Resolve() that haven't completed yet. Can be called from
+  // any thread.
+  size_t num_pending() const { return num_pending_.load(std::memory_order_relaxed); }
+
+ private:
+  class UdpSocket;
+  class TcpQuery;
+  struct Lookup;
+  struct Query;
+
+  DnsClient() {}
+
+  // The rest of the methods can be called only from the event loop thread.
+  void Start(std::string host, std::uint16_t port, int family, Callback cb);
+  void AddQuery(Lookup* lookup, std::uint16_t type);
+  void Send(Query* q);
+  void SendTcp(Query* q, size_t server);
+  // `error` is reported if there are no more nameservers to try.
+  void Retry(Query* q, const char* error);
+  void OnUdpTimeout(std::uint16_t id, uint64_t serial);
+  void OnUdpReply(size_t server, const char* msg, size_t len);
+  void OnTcpReply(std::uint16_t id, uint64_t serial, const char* msg, size_t len);
+  void OnTcpError(std::uint16_t id, uint64_t serial);
+  void OnReply(Query* q, int rcode, const std::vector<sockaddr_storage>& addrs, Duration ttl);
+  // Deletes `q`. `error` is null on success.
+  void Finish(Query* q, const char* error, const std::vector<sockaddr_storage>& addrs,
+              Duration ttl);
+  // Deletes `lookup` when all its queries have finished.
+  void Complete(Lookup* lookup, const char* error, const std::vector<sockaddr_storage>& addrs,
+                Duration ttl);
+  void Done(Callback& cb, const std::string& host, std::uint16_t port, const char* error,
+            const std::vector<sockaddr_storage>& addrs, Duration ttl);
+
+  // How long to wait for a reply before retrying with the next nameserver.
+  Duration timeout_;
+  // How many times to try every nameserver.
+  size_t attempts_;
+  std::vector<UdpSocket*> servers_;
+  // Lower-case host name => addresses with zero ports.
+  std::unordered_map<std::string, std::vector<sockaddr_storage>> hosts_;
+  // Queries waiting for a reply, by DNS message ID.
+  std::unordered_map<std::uint16_t, Query*> queries_;
+  std::mt19937 rng_;
+  uint64_t last_serial_ = 0;
+  std::atomic<size_t> num_pending_{0};
+  EventLoop* event_loop_ = nullptr;
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_DNS_CLIENT_H_
@@ -0,0 +1,94 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "epoch.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+
+namespace hcproxy {
+
+namespace internal_epoch {
+
+namespace {
+
+// Threads that create an EpochGuard. In practice these are event loop and thread pool
+// threads, and there are far fewer of them.
+constexpr size_t kMaxThreads = 1024;
+
+Slot g_slots[kMaxThreads];
+std::atomic<size_t> g_num_slots{0};
+
+}  // namespace
+
+std::atomic<uint64_t> g_epoch{1};
+
+Slot& MySlot() {
+  static thread_local Slot* slot = [] {
+    size_t idx = g_num_slots.fetch_add(1, std::memory_order_relaxed);
+    CHECK(idx < kMaxThreads) << "Too many threads";
+    return &g_slots[idx];
+  }();
+  return *slot;
+}
+
+}  // namespace internal_epoch
+
+namespace {
+
+using internal_epoch::g_epoch;
+using internal_epoch::g_num_slots;
+using internal_epoch::g_slots;
+
+struct Retired {
+  // Can be destroyed when all readers are in this epoch or later.
+  uint64_t epoch;
+  std::function<void()> destroy;
+};
+
+std::mutex g_mutex;
+std::vector<Retired>* g_retired = new std::vector<Retired>();
+
+}  // namespace
+
+void Retire(std::function<void()> destroy) {
+  CHECK(destroy);
+  std::vector<Retired> ready;
+  {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    // Readers that enter after this see the new epoch and can't reach the object.
+    g_retired->push_back({g_epoch.fetch_add(1, std::memory_order_seq_cst) + 1,
+                          std::move(destroy)});
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    const size_t n = std::min(g_num_slots.load(std::memory_order_relaxed), std::size(g_slots));
+    for (size_t i = 0; i != n; ++i) {
+      uint64_t epoch = g_slots[i].epoch.load(std::memory_order_seq_cst);
+      if (epoch) oldest = std::min(oldest, epoch);
+    }
+    auto it = std::partition(g_retired->begin(), g_retired->end(),
+                             [&](const Retired& r) { return r.epoch > oldest; });
+    std::move(it, g_retired->end(), std::back_inserter(ready));
+    g_retired->erase(it, g_retired->end());
+  }
+  for (Retired& r : ready) r.destroy();
+}
+
+}  // namespace hcproxy
@@ -0,0 +1,78 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_EPOCH_H_
+#define ROMKATV_HCPROXY_EPOCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+namespace hcproxy {
+
+// Epoch-based reclamation for read-mostly data structures.
+//
+// Readers access shared objects only while they hold an EpochGuard. Writers unlink an
+// object so that new readers can't reach it and then pass its destruction to Retire(),
+// which defers it until every reader that could have seen the object has released its
+// guard.
+//
+// Every thread that creates a guard gets its own slot, like in stats.h. Entering and
+// leaving a read section are plain stores to the slot plus one fence: no atomic
+// read-modify-write operations, no locks and no shared cache lines.
+
+namespace internal_epoch {
+
+constexpr size_t kCacheLineSize = 64;
+
+struct alignas(kCacheLineSize) Slot {
+  // The epoch at which the thread has entered its read section. Zero if the thread isn't
+  // in a read section.
+  std::atomic<uint64_t> epoch{0};
+};
+
+Slot& MySlot();
+
+extern std::atomic<uint64_t> g_epoch;
+
+}  // namespace internal_epoch
+
+// Guards cannot be nested.
+class EpochGuard {
+ public:
+  EpochGuard() : slot_(internal_epoch::MySlot()) {
+    slot_.epoch.store(internal_epoch::g_epoch.load(std::memory_order_acquire),
+                      std::memory_order_relaxed);
+    // Pairs with the fence in Retire(). Either Retire() sees our epoch or we see the
+    // effects of everything that happened before Retire().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  EpochGuard(EpochGuard&&) = delete;
+
+  ~EpochGuard() { slot_.epoch.store(0, std::memory_order_release); }
+
+ private:
+  internal_epoch::Slot& slot_;
+};
+
+// Calls `destroy` once no EpochGuard that was alive before the call remains. It may be
+// called synchronously, or later from another call to Retire() on any thread.
+//
+// Can be called from any thread but not while holding an EpochGuard.
+void Retire(std::function<void()> destroy);
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_EPOCH_H_
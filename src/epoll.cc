@@ -14,6 +14,7 @@
 
 #include "epoll.h"
 
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <algorithm>
 
@@ -24,6 +25,20 @@ namespace hcproxy {
 using ::std::chrono::ceil;
 using ::std::chrono::milliseconds;
 
+namespace {
+
+// From linux/eventpoll.h. Not in the userspace headers of older distros.
+struct EPollParams {
+  std::uint32_t busy_poll_usecs;
+  std::uint16_t busy_poll_budget;
+  std::uint8_t prefer_busy_poll;
+  std::uint8_t pad;
+};
+
+constexpr unsigned long kEPIOCSPARAMS = _IOW(0x8A, 0x01, EPollParams);
+
+}  // namespace
+
 EPoll::EPoll() { CHECK((epoll_ = epoll_create1(0)) >= 0) << Errno(); }
 
 EPoll::~EPoll() { CHECK(close(epoll_) == 0) << Errno(); }
@@ -51,6 +66,16 @@ void EPoll::Modify(int fd, int events, void* data) {
   CHECK(epoll_ctl(epoll_, EPOLL_CTL_MOD, fd, &event) == 0) << Errno();
 }
 
+bool EPoll::SetBusyPoll(std::uint32_t usecs, std::uint16_t budget, bool prefer) {
+  EPollParams params = {};
+  params.busy_poll_usecs = usecs;
+  params.busy_poll_budget = budget;
+  params.prefer_busy_poll = prefer;
+  if (ioctl(epoll_, kEPIOCSPARAMS, &params) == 0) return true;
+  CHECK(errno == ENOTTY || errno == EINVAL || errno == EPERM) << Errno();
+  return false;
+}
+
 void EPoll::Wait(std::optional<Duration> timeout) {
   if (total_events_ > events_.size()) {
     events_.resize(total_events_);
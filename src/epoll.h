@@ -17,6 +17,7 @@
 
 #include <sys/epoll.h>
 #include <cstddef>
+#include <cstdint>
 #include <optional>
 #include <vector>
 
@@ -36,6 +37,10 @@ class EPoll {
   void Modify(int fd, int events, void* data);
   void Wait(std::optional<Duration> timeout);
 
+  // Makes Wait() busy-poll the network devices of the watched sockets for up to
+  // `usecs` before sleeping. Requires Linux 6.9. Returns false if not supported.
+  bool SetBusyPoll(std::uint32_t usecs, std::uint16_t budget, bool prefer);
+
   // The events are invalidated by Wait() and nothing else.
   const epoll_event* begin() const { return events_.data(); }
   const epoll_event* end() const { return begin() + ready_events_; }
@@ -14,52 +14,59 @@
 
 #include "event_loop.h"
 
-#include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
+#include <algorithm>
+#include <memory>
 #include <utility>
 
+#include "caps.h"
 #include "check.h"
+#include "cpu.h"
+#include "logging.h"
+#include "pool.h"
 
 namespace hcproxy {
 
 namespace {
 
-void PopFunc(int pipe) {
-  std::function<void()>* f;
-  int n;
-  CHECK((n = read(pipe, &f, sizeof(f))) == sizeof(f)) << Errno();
-  (*f)();
-  delete f;
-}
-
-void AddFlags(int fd, int flags) {
-  flags |= fcntl(fd, F_GETFL, 0);
-  CHECK(fcntl(fd, F_SETFL, flags) == 0) << Errno();
-}
+// A callback passed to ScheduleAt().
+struct Timer : TimerEntry, Pooled<Timer> {
+  explicit Timer(Task f) : f(std::move(f)) {}
+  Task f;
+};
 
 }  // namespace
 
-EventLoop::EventLoop(Duration timeout) : timeout_(std::move(timeout)) {
+EventLoop::EventLoop(Duration timeout, const LatencyOptions& latency)
+    : now_(Clock::now()),
+      wheel_(now_),
+      timers_(now_),
+      timeout_(std::move(timeout)),
+      spin_(latency.spin) {
   CHECK(timeout_ > Duration::zero());
-  // Passing O_DIRECT to pipe2() doesn't work on WSL.
-  // Setting it via fcntl() doesn't work on Linux.
-  if (pipe2(pipe_, O_DIRECT) != 0) {
-    CHECK(pipe(pipe_) == 0) << Errno();
-    for (int fd : pipe_) AddFlags(fd, O_DIRECT);
+  if (latency.busy_poll > std::chrono::microseconds::zero() && GetCaps().epoll_busy_poll) {
+    if (!epoll_.SetBusyPoll(latency.busy_poll.count(), latency.busy_poll_budget,
+                            latency.prefer_busy_poll)) {
+      LOG(WARN) << "Unable to enable epoll busy poll: " << Errno();
+    }
   }
-  epoll_.Add(pipe_[0], EPOLLIN, nullptr);
+  CHECK((event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0) << Errno();
+  epoll_.Add(event_fd_, EPOLLIN, nullptr);
   loop_ = std::thread(&EventLoop::Loop, this);
+  SetRealtimePriority(loop_.native_handle(), latency.realtime_priority);
 }
 
-void EventLoop::Add(EventHandler* eh, int events) {
+void EventLoop::Add(EventHandler* eh, int events, Duration timeout) {
   CHECK(eh);
   CHECK(!eh->event_loop_);
+  CHECK(timeout > Duration::zero());
   CHECK(std::this_thread::get_id() == loop_.get_id());
   eh->IncRef();
   eh->event_loop_ = this;
-  eh->deadline_ = Clock::now() + timeout_;
-  expire_.AddTail(eh);
+  eh->timeout_ = timeout;
+  if (timeout != kNoTimeout) wheel_.Add(eh, now_ + timeout);
   epoll_.Add(eh->fd_, events, eh);
 }
 
@@ -67,7 +74,7 @@ void EventLoop::Remove(EventHandler* eh) {
   CHECK(eh);
   CHECK(eh->event_loop_ == this);
   CHECK(std::this_thread::get_id() == loop_.get_id());
-  expire_.Erase(eh);
+  wheel_.Remove(eh);
   epoll_.Remove(eh->fd_);
   eh->event_loop_ = nullptr;
   eh->DecRef();
@@ -80,14 +87,24 @@ void EventLoop::Modify(EventHandler* eh, int events) {
   epoll_.Modify(eh->fd_, events, eh);
 }
 
-void EventLoop::Schedule(std::function<void()> f) {
+void EventLoop::Schedule(Task f) {
   CHECK(f);
   CHECK(std::this_thread::get_id() != loop_.get_id());
-  auto* p = new std::function<void()>(std::move(f));
-  CHECK(write(pipe_[1], &p, sizeof(p)) == sizeof(p)) << Errno();
+  if (queue_.Push(std::move(f))) {
+    std::uint64_t one = 1;
+    CHECK(write(event_fd_, &one, sizeof(one)) == sizeof(one)) << Errno();
+  }
 }
 
-void EventLoop::ScheduleOrRun(std::function<void()> f) {
+void EventLoop::RunScheduled() {
+  // Reset the counter before draining the queue. Tasks pushed after the drain will
+  // signal it again.
+  std::uint64_t n;
+  CHECK(read(event_fd_, &n, sizeof(n)) == sizeof(n) || errno == EAGAIN) << Errno();
+  queue_.RunAll();
+}
+
+void EventLoop::ScheduleOrRun(Task f) {
   CHECK(f);
   if (std::this_thread::get_id() == loop_.get_id()) {
     f();
@@ -96,9 +113,27 @@ void EventLoop::ScheduleOrRun(std::function<void()> f) {
   }
 }
 
+void EventLoop::ScheduleAt(Time t, Task f) {
+  CHECK(f);
+  CHECK(std::this_thread::get_id() == loop_.get_id());
+  timers_.Add(new Timer(std::move(f)), t);
+}
+
+void EventLoop::Pin(const std::vector<int>& cpus) { PinThread(loop_.native_handle(), cpus); }
+
 void EventLoop::Loop() {
+  // While Clock::now() < spin_until, poll for events without blocking.
+  Time spin_until;
+  std::optional<Time> wake_at;
   while (true) {
-    epoll_.Wait(timeout_);
+    bool spin = spin_ > Duration::zero() && now_ < spin_until;
+    if (spin || !run_queue_.empty()) {
+      epoll_.Wait(Duration::zero());
+    } else {
+      epoll_.Wait(wake_at ? std::optional<Duration>(*wake_at - now_) : std::nullopt);
+    }
+    now_ = Clock::now();
+    if (spin_ > Duration::zero() && epoll_.begin() != epoll_.end()) spin_until = now_ + spin_;
     for (const epoll_event& ev : epoll_) {
       if (ev.data.ptr != nullptr) {
         static_cast<EventHandler*>(ev.data.ptr)->IncRef();
@@ -106,7 +141,7 @@ void EventLoop::Loop() {
     }
     for (const epoll_event& ev : epoll_) {
       if (ev.data.ptr == nullptr) {
-        PopFunc(pipe_[0]);
+        RunScheduled();
       } else {
         auto* eh = static_cast<EventHandler*>(ev.data.ptr);
         if (eh->event_loop_ == this) {
@@ -115,28 +150,76 @@ void EventLoop::Loop() {
         eh->DecRef();
       }
     }
-    while (true) {
-      auto* eh = static_cast<EventHandler*>(expire_.head());
-      if (!eh || eh->deadline_ > Clock::now()) break;
-      CHECK(eh->event_loop_ == this);
-      eh->IncRef();
-      eh->OnTimeout(this);
-      if (eh->event_loop_ == this) Refresh(eh);
+    // Serve handlers that were requeued before this iteration. Handlers requeued
+    // now will have to wait for the next round.
+    for (size_t n = run_queue_.size(); n != 0; --n) {
+      EventHandler* eh = run_queue_.front();
+      run_queue_.pop_front();
+      int events = std::exchange(eh->pending_events_, 0);
+      if (eh->event_loop_ == this) eh->OnEvent(this, events);
       eh->DecRef();
     }
+    ExpireHandlers();
+    wake_at = RunTimers();
+    if (std::optional<Time> t = wheel_.NextEvent()) {
+      if (!wake_at || *t < *wake_at) wake_at = t;
+    }
   }
 }
 
-void EventLoop::Refresh(EventHandler* eh) {
+void EventLoop::ExpireHandlers() {
+  wheel_.Advance(now_);
+  while (TimerEntry* e = wheel_.PopExpired()) {
+    auto* eh = static_cast<EventHandler*>(e);
+    CHECK(eh->event_loop_ == this);
+    eh->IncRef();
+    eh->OnTimeout(this);
+    if (eh->event_loop_ == this) Refresh(eh);
+    eh->DecRef();
+  }
+}
+
+std::optional<Time> EventLoop::RunTimers() {
+  timers_.Advance(now_);
+  while (TimerEntry* e = timers_.PopExpired()) {
+    std::unique_ptr<Timer> timer(static_cast<Timer*>(e));
+    timer->f();
+  }
+  return timers_.NextEvent();
+}
+
+void EventLoop::Requeue(EventHandler* eh, int events) {
   CHECK(eh);
+  CHECK(events);
   CHECK(eh->event_loop_ == this);
   CHECK(std::this_thread::get_id() == loop_.get_id());
-  eh->deadline_ = Clock::now() + timeout_;
-  if (auto* tail = static_cast<EventHandler*>(expire_.tail())) {
-    CHECK(eh->deadline_ >= tail->deadline_);
+  if (!eh->pending_events_) {
+    eh->IncRef();
+    run_queue_.push_back(eh);
+  }
+  eh->pending_events_ |= events;
+}
+
+void EventLoop::Refresh(EventHandler* eh) {
+  if (eh->timeout_ == kNoTimeout) {
+    CHECK(eh->event_loop_ == this);
+    wheel_.Remove(eh);
+  } else {
+    SetDeadline(eh, now_ + eh->timeout_);
   }
-  expire_.Erase(eh);
-  expire_.AddTail(eh);
+}
+
+void EventLoop::SetTimeout(EventHandler* eh, Duration timeout) {
+  CHECK(timeout > Duration::zero());
+  eh->timeout_ = timeout;
+  Refresh(eh);
+}
+
+void EventLoop::SetDeadline(EventHandler* eh, Time deadline) {
+  CHECK(eh);
+  CHECK(eh->event_loop_ == this);
+  CHECK(std::this_thread::get_id() == loop_.get_id());
+  wheel_.Add(eh, deadline);
 }
 
 }  // namespace hcproxy
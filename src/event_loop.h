@@ -16,19 +16,24 @@
 #define ROMKATV_HCPROXY_EVENT_LOOP_H_
 
 #include <cstdint>
-#include <functional>
+#include <deque>
+#include <optional>
 #include <thread>
+#include <vector>
 
 #include "check.h"
 #include "epoll.h"
-#include "list.h"
+#include "latency.h"
+#include "task.h"
+#include "task_queue.h"
 #include "time.h"
+#include "timer_wheel.h"
 
 namespace hcproxy {
 
 class EventLoop;
 
-class EventHandler : private Node {
+class EventHandler : private TimerEntry {
  public:
   explicit EventHandler(int fd) : fd_(fd) { CHECK(fd_ >= 0); }
   EventHandler(EventHandler&&) = delete;
@@ -62,21 +67,36 @@ class EventHandler : private Node {
   friend class EventLoop;
 
   const int fd_;
-  Time deadline_;
+  // OnTimeout() fires after this much time without Refresh().
+  Duration timeout_;
+  // Non-zero iff this event handler is in the run queue of its event loop.
+  int pending_events_ = 0;
   // Null iff this event handler isn't registered in an event loop.
   const EventLoop* event_loop_ = nullptr;
   int64_t ref_count_ = 0;
 };
 
 // A wrapper around a thread + epoll.
+//
+// Every event handler has its own timeout. Deadlines are kept in a timing wheel, so
+// adding, refreshing and expiring them is O(1), and epoll_wait() sleeps until the
+// nearest deadline.
 class EventLoop {
  public:
-  explicit EventLoop(Duration timeout);
+  // Pass this as the timeout of a handler to disable OnTimeout().
+  static constexpr Duration kNoTimeout = Duration::max();
+
+  // `timeout` is the default timeout of event handlers.
+  explicit EventLoop(Duration timeout, const LatencyOptions& latency = {});
   EventLoop(EventLoop&&) = delete;
   ~EventLoop() = delete;
 
   // Can be called only from the Loop() thread.
-  void Add(EventHandler* eh, int events);
+  void Add(EventHandler* eh, int events) { Add(eh, events, timeout_); }
+
+  // Can be called only from the Loop() thread.
+  // OnTimeout() fires after `timeout` without Refresh(), never if it's kNoTimeout.
+  void Add(EventHandler* eh, int events, Duration timeout);
 
   // Can be called only from the Loop() thread.
   // OnEvent() and OnTimeout() won't fire until Add() is called again.
@@ -86,23 +106,69 @@ class EventLoop {
   void Modify(EventHandler* eh, int events);
 
   // Can be called only from the Loop() thread.
+  // Pushes the deadline of the handler to now() plus its timeout.
   void Refresh(EventHandler* eh);
 
+  // Can be called only from the Loop() thread.
+  // Changes the timeout of the handler and pushes its deadline to now() plus `timeout`.
+  void SetTimeout(EventHandler* eh, Duration timeout);
+
+  // Can be called only from the Loop() thread.
+  // Makes OnTimeout() fire at `deadline` or a bit later unless Refresh() or SetDeadline()
+  // is called before that.
+  void SetDeadline(EventHandler* eh, Time deadline);
+
+  // Can be called only from the Loop() thread.
+  // Returns the time at which the current iteration of the loop has started. Cheaper
+  // than Clock::now() and accurate enough for timeouts.
+  Time now() const { return now_; }
+
+  // Can be called only from the Loop() thread.
+  // Calls eh->OnEvent(events) after all handlers that are ready now have had their turn
+  // and before blocking for new events. Handlers that have more work than they should do
+  // in one go call this to let others run.
+  void Requeue(EventHandler* eh, int events);
+
   // Cannot be called from the Loop() thread. Can be called concurrently.
-  void Schedule(std::function<void()> f);
+  // Invokes `f` from the Loop() thread. Doesn't make a syscall unless the loop has
+  // already picked up everything scheduled before.
+  void Schedule(Task f);
+
+  // Can be called only from the Loop() thread.
+  // Invokes `f` from the Loop() thread at `t` or a bit later (up to 1ms). Timers are
+  // pooled, so this doesn't allocate in steady state unless `f` is too big for Task.
+  void ScheduleAt(Time t, Task f);
 
   // When called from the Loop() thread, invokes `f` synchronously.
   // Otherwise calls Schedule(f).
-  void ScheduleOrRun(std::function<void()> f);
+  void ScheduleOrRun(Task f);
+
+  // Restricts the Loop() thread to the specified CPUs. Does nothing if `cpus` is empty.
+  // Can be called from any thread.
+  void Pin(const std::vector<int>& cpus);
 
  private:
   void Loop();
-
-  int pipe_[2];
+  // Runs the tasks passed to Schedule().
+  void RunScheduled();
+  // Calls OnTimeout() on all expired handlers.
+  void ExpireHandlers();
+  // Runs all timers that are due. Returns the time when the next one is due.
+  std::optional<Time> RunTimers();
+
+  // Signalled when queue_ becomes non-empty.
+  int event_fd_;
+  TaskQueue queue_;
   EPoll epoll_;
-  // Event handlers sorted by expiration time. The head is the first to expire.
-  List expire_;
+  Time now_;
+  // Deadlines of event handlers.
+  TimerWheel wheel_;
+  // Event handlers passed to Requeue(). Served in FIFO order.
+  std::deque<EventHandler*> run_queue_;
+  // Callbacks passed to ScheduleAt() that haven't fired yet.
+  TimerWheel timers_;
   Duration timeout_;
+  Duration spin_;
   std::thread loop_;
 };
 
@@ -15,26 +15,213 @@
 #include "forwarder.h"
 
 #include <fcntl.h>
+#include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <limits>
+#include <memory>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <utility>
 
 #include "bits.h"
+#include "caps.h"
 #include "check.h"
 #include "event_loop.h"
 #include "logging.h"
+#include "pipe_pool.h"
+#include "pool.h"
+#include "slab.h"
 #include "sock.h"
+#include "stats.h"
+#include "uring_forwarder.h"
 
 namespace hcproxy {
 
+namespace internal_forwarder {
+
+constexpr size_t kChunksPerSlab = 64;
+
+struct Shard {
+  Shard(const Forwarder::Options& opt, const LatencyOptions& latency, bool use_io_uring)
+      : Shard(opt) {
+    if (use_io_uring) {
+      uring = UringForwarder::New({opt.read_write_timeout, opt.pipe_pool_idle_timeout,
+                                   &client_to_server_pipes, &server_to_client_pipes,
+                                   &num_tunnels});
+    }
+    if (!uring) {
+      event_loop = new EventLoop(opt.read_write_timeout, latency);
+      event_loop->ScheduleOrRun([this]() { TrimPipes(); });
+    }
+  }
+
+  Shard(const Forwarder::Options& opt, EventLoop* loop) : Shard(opt) {
+    CHECK(loop);
+    event_loop = loop;
+    event_loop->ScheduleOrRun([this]() { TrimPipes(); });
+  }
+
+  // Sets neither event_loop nor uring.
+  explicit Shard(const Forwarder::Options& opt)
+      : opt(opt),
+        client_to_server_pipes({opt.client_to_server_buffer_size_bytes, opt.pipe_pool_min_size,
+                                opt.pipe_pool_max_size, opt.pipe_pool_idle_timeout}),
+        server_to_client_pipes({opt.server_to_client_buffer_size_bytes, opt.pipe_pool_min_size,
+                                opt.pipe_pool_max_size, opt.pipe_pool_idle_timeout}),
+        client_to_server_chunks(opt.client_to_server_buffer_size_bytes, kChunksPerSlab),
+        server_to_client_chunks(opt.server_to_client_buffer_size_bytes, kChunksPerSlab) {
+    // The pools are filled before the shard is used. From then on they are used only
+    // by the forwarding thread.
+    client_to_server_pipes.Fill();
+    server_to_client_pipes.Fill();
+  }
+
+  // Trims the pipe pools every pipe_pool_idle_timeout, so that pipes left over from a
+  // burst are closed even if no tunnels are open. Must be called from the loop thread.
+  void TrimPipes() {
+    event_loop->ScheduleAt(event_loop->now() + opt.pipe_pool_idle_timeout, [this]() {
+      client_to_server_pipes.Trim();
+      server_to_client_pipes.Trim();
+      TrimPipes();
+    });
+  }
+
+  const Forwarder::Options& opt;
+  // Exactly one of these is not null.
+  EventLoop* event_loop = nullptr;
+  UringForwarder* uring = nullptr;
+  // Can be used only from the forwarding thread.
+  PipePool client_to_server_pipes;
+  // Can be used only from the forwarding thread.
+  PipePool server_to_client_pipes;
+  // Memory for buffers in userspace mode. Can be used only from the event loop thread.
+  SlabAllocator client_to_server_chunks;
+  SlabAllocator server_to_client_chunks;
+  // Incremented by Forward() before the tunnel is handed over to the event loop.
+  // Decremented by the event loop thread when both links of the tunnel are closed.
+  std::atomic<int64_t> num_tunnels{0};
+  // The number of bytes in the buffers of all tunnels. Written only by the event loop
+  // thread. Always zero with io_uring.
+  std::atomic<int64_t> buffered_bytes{0};
+  // Final buffer sizes of recently closed tunnels: destination => {client-to-server size,
+  // server-to-client size}. The key is the raw sockaddr of the server. Can be used only
+  // from the event loop thread.
+  std::unordered_map<std::string, std::pair<int, int>> buffer_size_history;
+};
+
+// Bandwidth limits of a tunnel. Shared by its two links.
+class Throttle {
+ public:
+  // Null `tunnel` means that the tunnel itself isn't throttled.
+  Throttle(const RateLimit* tunnel, std::shared_ptr<TokenBucket> client, TokenBucket* global)
+      : client_(std::move(client)), global_(global) {
+    if (tunnel) tunnel_.emplace(*tunnel);
+  }
+
+  // Returns the number of bytes the tunnel may transfer right now. Returns zero
+  // rather than a handful of bytes to avoid spinning on tiny reads.
+  int64_t Allowance(Time now) {
+    int64_t res = std::numeric_limits<int64_t>::max();
+    for (TokenBucket* b : buckets()) {
+      if (!b) continue;
+      int64_t n = b->Available(now);
+      if (n < std::min(kMinAllowance, b->burst())) return 0;
+      res = std::min(res, n);
+    }
+    return res;
+  }
+
+  void Consume(int64_t n) {
+    for (TokenBucket* b : buckets()) {
+      if (b) b->Consume(n);
+    }
+  }
+
+  // Returns how long to wait after running out of tokens before Allowance() becomes
+  // positive.
+  Duration Delay(Time now) {
+    Duration res = Duration::zero();
+    for (TokenBucket* b : buckets()) {
+      if (b) res = std::max(res, b->TimeUntil(kMinAllowance, now));
+    }
+    return res;
+  }
+
+ private:
+  static constexpr int64_t kMinAllowance = 16 << 10;
+
+  std::array<TokenBucket*, 3> buckets() {
+    return {tunnel_ ? &*tunnel_ : nullptr, client_.get(), global_};
+  }
+
+  std::optional<TokenBucket> tunnel_;
+  const std::shared_ptr<TokenBucket> client_;
+  TokenBucket* const global_;
+};
+
+}  // namespace internal_forwarder
+
+using internal_forwarder::Shard;
+using internal_forwarder::Throttle;
+
 namespace {
 
 constexpr std::string_view kResponse = "HTTP/1.1 200 OK\r\n\r\n";
 
+// Grow a buffer after this many consecutive reads from the socket that fill it completely.
+constexpr int kGrowAfterFullReads = 2;
+// Shrink a buffer after this many consecutive reads from the socket that leave it at
+// most a quarter full.
+constexpr int kShrinkAfterLightReads = 64;
+
+constexpr int64_t kUnlimited = std::numeric_limits<int64_t>::max();
+
+// Returns the raw IP address of the peer (without port) or an empty string on error.
+std::string PeerIp(int fd) {
+  sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) return "";
+  switch (addr.ss_family) {
+    case AF_INET: {
+      const auto& a = reinterpret_cast<const sockaddr_in&>(addr).sin_addr;
+      return std::string(reinterpret_cast<const char*>(&a), sizeof(a));
+    }
+    case AF_INET6: {
+      const auto& a = reinterpret_cast<const sockaddr_in6&>(addr).sin6_addr;
+      return std::string(reinterpret_cast<const char*>(&a), sizeof(a));
+    }
+  }
+  return "";
+}
+
+// Limits the rate at which the kernel sends data over the socket.
+void SetPacingRate(int fd, uint64_t bytes_per_sec) {
+  if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &bytes_per_sec, sizeof(bytes_per_sec)) == 0) {
+    return;
+  }
+  // Kernels before 4.20 accept only 32 bits.
+  uint32_t rate = std::min<uint64_t>(bytes_per_sec, std::numeric_limits<uint32_t>::max());
+  if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) != 0) {
+    LOG(WARN) << "[" << fd << "] unable to set SO_MAX_PACING_RATE: " << Errno();
+  }
+}
+
+// Returns the raw sockaddr of the peer or an empty string on error.
+std::string PeerAddr(int fd) {
+  sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) return "";
+  return std::string(reinterpret_cast<const char*>(&addr), std::min<size_t>(len, sizeof(addr)));
+}
+
 enum class IoStatus {
   kData,
   kEof,
@@ -42,30 +229,61 @@ enum class IoStatus {
   kNoOp,
 };
 
+// A buffer for data flowing in one direction. It's either a pipe (splice mode) or a
+// chunk of memory (userspace mode).
 class Buffer {
  public:
   Buffer() {}
   Buffer(Buffer&&) = delete;
 
-  bool Init(size_t size_bytes) {
-    CHECK(size_bytes > 0 && size_bytes < std::numeric_limits<int>::max());
-    if (pipe(pipe_) != 0) {
-      LOG(ERROR) << "pipe() failed: " << Errno();
-      CHECK(errno == EMFILE || errno == ENFILE) << Errno();
-      for (int& fd : pipe_) fd = -1;
-      return false;
-    }
-    CHECK((capacity_ = fcntl(pipe_[0], F_SETPIPE_SZ, size_bytes)) > 0) << Errno();
-    for (int fd : pipe_) {
-      CHECK(fd >= 0);
-      CHECK(fcntl(fd, F_GETPIPE_SZ) == capacity_);
+  // Splice mode. Takes a pipe from the pool. The buffer can grow up to `max_capacity`. If
+  // `initial_capacity` is positive, it's used instead of the capacity of pipes in the pool.
+  // The number of bytes in the buffer is added to `*buffered_bytes`.
+  bool Init(PipePool* pool, size_t max_capacity, int initial_capacity,
+            std::atomic<int64_t>* buffered_bytes) {
+    CHECK(pool);
+    CHECK(!pool_ && !slab_);
+    if (!pool->Acquire(&pipe_)) return false;
+    buffered_bytes_ = buffered_bytes;
+    pool_ = pool;
+    splice_clears_pipe_ = !GetCaps().splice_keeps_pipe_on_eagain;
+    capacity_ = pipe_.capacity;
+    min_capacity_ = capacity_;
+    max_capacity_ = std::max<size_t>(
+        min_capacity_, std::min<size_t>({max_capacity, GetCaps().max_pipe_size,
+                                         static_cast<size_t>(std::numeric_limits<int>::max())}));
+    if (initial_capacity > 0 && initial_capacity != capacity_) {
+      Resize(std::min(initial_capacity, max_capacity_));
     }
     return true;
   }
 
+  // Userspace mode. Memory is taken from the slab only while the buffer isn't empty.
+  void Init(SlabAllocator* slab, std::atomic<int64_t>* buffered_bytes) {
+    CHECK(slab);
+    CHECK(!pool_ && !slab_);
+    buffered_bytes_ = buffered_bytes;
+    CHECK(slab->chunk_size() <= static_cast<size_t>(std::numeric_limits<int>::max()));
+    slab_ = slab;
+    capacity_ = slab->chunk_size();
+    min_capacity_ = capacity_;
+    max_capacity_ = capacity_;
+  }
+
   ~Buffer() {
-    for (int fd : pipe_) {
-      if (fd >= 0) CHECK(close(fd) == 0) << Errno();
+    AddSize(-size_);
+    if (slab_) {
+      if (data_) slab_->Free(data_);
+      return;
+    }
+    if (!pool_) return;
+    // A pipe can be reused only if it's empty and hasn't been broken by splice().
+    // It must go back to the pool with the same capacity it came with.
+    if (size_ == 0 && !error_ && (capacity_ == min_capacity_ || Resize(min_capacity_))) {
+      pool_->Release(pipe_);
+    } else {
+      CHECK(close(pipe_.read_fd) == 0) << Errno();
+      CHECK(close(pipe_.write_fd) == 0) << Errno();
     }
   }
 
@@ -73,89 +291,243 @@ class Buffer {
     CHECK(size_ >= 0);
     CHECK(size_ <= capacity_);
     CHECK(data.size() <= static_cast<size_t>(capacity_ - size_));
-    CHECK(pipe_[1] >= 0);
-    CHECK(write(pipe_[1], data.data(), data.size()) == static_cast<ssize_t>(data.size()))
-        << Errno();
-    size_ += data.size();
+    CHECK(writable_);
+    if (slab_) {
+      if (!data_) data_ = slab_->Allocate();
+      Compact();
+      std::memcpy(data_ + size_, data.data(), data.size());
+    } else {
+      CHECK(write(pipe_.write_fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()))
+          << Errno();
+    }
+    AddSize(data.size());
     CHECK(size_ >= 0);
     CHECK(size_ <= capacity_);
   }
 
-  IoStatus WriteFrom(int fd) {
-    CHECK(pipe_[1] >= 0);
+  // Moves at most `limit` bytes from the socket into the buffer.
+  IoStatus WriteFrom(int fd, int64_t limit) {
+    CHECK(writable_);
     CHECK(size_ >= 0);
     CHECK(size_ <= capacity_);
+    CHECK(limit > 0);
     if (size_ == capacity_) return IoStatus::kNoOp;
-    ssize_t ret = splice(fd, nullptr, pipe_[1], nullptr, capacity_ - size_,
-                         SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+    size_t len = std::min<int64_t>(capacity_ - size_, limit);
+    ssize_t ret = slab_ ? Recv(fd, len)
+                        : splice(fd, nullptr, pipe_.write_fd, nullptr, len,
+                                 SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
     if (ret < 0) {
       if (errno == EAGAIN) return IoStatus::kNoOp;
-      CHECK(close(pipe_[1]) == 0) << Errno();
-      pipe_[1] = -1;
+      writable_ = false;
+      error_ = true;
       return IoStatus::kError;
     }
     if (ret == 0) {
-      CHECK(close(pipe_[1]) == 0) << Errno();
-      pipe_[1] = -1;
+      writable_ = false;
       return IoStatus::kEof;
     }
-    size_ += ret;
+    AddSize(ret);
     CHECK(size_ >= 0);
     CHECK(size_ <= capacity_);
+    Adapt();
     return IoStatus::kData;
   }
 
+  // Moves data from the buffer into the socket.
   IoStatus ReadTo(int fd) {
-    CHECK(pipe_[0] >= 0);
+    CHECK(readable_);
     CHECK(size_ >= 0);
     if (size_ == 0) {
-      if (pipe_[1] >= 0) return IoStatus::kNoOp;
-      CHECK(close(pipe_[0]) == 0) << Errno();
-      pipe_[0] = -1;
+      if (writable_) return IoStatus::kNoOp;
+      readable_ = false;
       return IoStatus::kEof;
     }
+    if (slab_) return Send(fd);
     // There is a bug in splice() in WSL that makes it clear the pipe upon returning an error, be it
     // EAGAIN or something else. To work around it, we do two things. First, we issue a zero-byte
     // write to check whether the socket is writable and thus to reduce the chance splice() will
     // return EAGAIN. Second, we terminate the connection if we trigger the bug in splice().
-    if (write(fd, "", 0) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // Kernels without the bug get neither the extra syscall nor the check.
+    if (splice_clears_pipe_ && write(fd, "", 0) == -1 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK)) {
       return IoStatus::kNoOp;
     }
-    ssize_t ret = splice(pipe_[0], nullptr, fd, nullptr, size_, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+    ssize_t ret =
+        splice(pipe_.read_fd, nullptr, fd, nullptr, size_, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
     CHECK(ret != 0);
     if (ret < 0) {
+      if (errno == EAGAIN && !splice_clears_pipe_) return IoStatus::kNoOp;
       if (errno == EAGAIN) {
         int len = 0;
-        CHECK(ioctl(pipe_[0], FIONREAD, &len) == 0) << Errno();
+        CHECK(ioctl(pipe_.read_fd, FIONREAD, &len) == 0) << Errno();
         if (len == size_) return IoStatus::kNoOp;
       }
-      CHECK(close(pipe_[0]) == 0) << Errno();
-      pipe_[0] = -1;
+      readable_ = false;
+      error_ = true;
       return IoStatus::kError;
     }
-    size_ -= ret;
+    AddSize(-ret);
     CHECK(size_ >= 0);
     CHECK(size_ <= capacity_);
     return IoStatus::kData;
   }
 
+  int size() const { return size_; }
+  int capacity() const { return capacity_; }
+
  private:
-  int capacity_;
+  // Userspace mode. Like read() but with the buffer as destination. Frees the memory
+  // chunk if the buffer stays empty.
+  ssize_t Recv(int fd, size_t len) {
+    if (!data_) data_ = slab_->Allocate();
+    Compact();
+    ssize_t ret = recv(fd, data_ + size_, len, 0);
+    if (ret <= 0 && size_ == 0) {
+      int err = errno;
+      slab_->Free(std::exchange(data_, nullptr));
+      errno = err;
+    }
+    return ret;
+  }
+
+  // Userspace mode. Frees the memory chunk if the buffer becomes empty.
+  IoStatus Send(int fd) {
+    CHECK(data_);
+    ssize_t ret = send(fd, data_ + begin_, size_, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return IoStatus::kNoOp;
+      readable_ = false;
+      return IoStatus::kError;
+    }
+    CHECK(ret > 0 && ret <= size_);
+    begin_ += ret;
+    AddSize(-ret);
+    if (size_ == 0) {
+      begin_ = 0;
+      slab_->Free(std::exchange(data_, nullptr));
+    }
+    return IoStatus::kData;
+  }
+
+  // Changes size_ and keeps *buffered_bytes_ in sync with it.
+  void AddSize(int delta) {
+    size_ += delta;
+    // Only the forwarding thread writes to this counter, so load + store is fine.
+    if (buffered_bytes_) {
+      buffered_bytes_->store(buffered_bytes_->load(std::memory_order_relaxed) + delta,
+                             std::memory_order_relaxed);
+    }
+  }
+
+  // Userspace mode. Moves data to the start of the memory chunk.
+  void Compact() {
+    if (begin_ == 0) return;
+    std::memmove(data_, data_ + begin_, size_);
+    begin_ = 0;
+  }
+
+  // Called after every read from the socket. Grows or shrinks the pipe based on how full
+  // it gets.
+  void Adapt() {
+    if (min_capacity_ == max_capacity_) return;
+    if (size_ == capacity_) {
+      light_reads_ = 0;
+      if (++full_reads_ == kGrowAfterFullReads) {
+        full_reads_ = 0;
+        if (capacity_ < max_capacity_) {
+          Resize(std::min<int64_t>(2 * int64_t{capacity_}, max_capacity_));
+        }
+      }
+    } else if (size_ <= capacity_ / 4) {
+      full_reads_ = 0;
+      if (++light_reads_ == kShrinkAfterLightReads) {
+        light_reads_ = 0;
+        if (capacity_ > min_capacity_) {
+          Resize(std::max(capacity_ / 2, std::max(min_capacity_, size_)));
+        }
+      }
+    } else {
+      full_reads_ = 0;
+      light_reads_ = 0;
+    }
+  }
+
+  // Splice mode. Changes the capacity of the pipe. Returns false on failure, in which
+  // case the capacity stays unchanged.
+  bool Resize(int capacity) {
+    CHECK(capacity >= size_);
+    int ret = fcntl(pipe_.write_fd, F_SETPIPE_SZ, capacity);
+    if (ret < 0) {
+      // EPERM: The per-user limit on pipe memory has been reached.
+      CHECK(errno == EPERM || errno == EBUSY || errno == ENOMEM) << Errno();
+      return false;
+    }
+    CHECK(ret >= size_);
+    pipe_.capacity = ret;
+    capacity_ = ret;
+    return true;
+  }
+
+  // Splice mode: not null iff Init() has succeeded.
+  PipePool* pool_ = nullptr;
+  Pipe pipe_;
+  // Userspace mode: not null iff Init() has been called.
+  SlabAllocator* slab_ = nullptr;
+  // Userspace mode: not null iff size_ is positive. Data occupies [begin_, begin_ + size_).
+  char* data_ = nullptr;
+  int begin_ = 0;
   int size_ = 0;
-  int pipe_[2] = {-1, -1};
+  std::atomic<int64_t>* buffered_bytes_ = nullptr;
+  int capacity_ = 0;
+  int min_capacity_ = 0;
+  int max_capacity_ = 0;
+  int full_reads_ = 0;
+  int light_reads_ = 0;
+  // False after WriteFrom() has returned anything other than kData or kNoOp.
+  bool writable_ = true;
+  // False after ReadTo() has returned anything other than kData or kNoOp.
+  bool readable_ = true;
+  bool error_ = false;
+  // Splice mode: see the comment in ReadTo().
+  bool splice_clears_pipe_ = false;
 };
 
-class LinkEventHandler : public EventHandler {
+class LinkEventHandler : public EventHandler, public Pooled<LinkEventHandler> {
  public:
-  static void New(EventLoop* loop, int client_fd, int server_fd, const Forwarder::Options& opt) {
+  // `start` is the time when Forward() was called.
+  static void New(Shard* shard, int client_fd, int server_fd, Forwarder::Mode mode,
+                  bool send_response, std::shared_ptr<Throttle> throttle, Time start) {
     LOG(INFO) << "Forwarding traffic: "
               << "[" << client_fd << "] (client)"
               << " <=> "
-              << "[" << server_fd << "] (server)";
-    auto* client = new LinkEventHandler(client_fd, "client");
-    auto* server = new LinkEventHandler(server_fd, "server");
-    if (!client->out_.Init(opt.server_to_client_buffer_size_bytes) ||
-        !server->out_.Init(opt.client_to_server_buffer_size_bytes)) {
+              << "[" << server_fd << "] (server)"
+              << (mode == Forwarder::Mode::kUserspace ? " in userspace mode" : "");
+    EventLoop* loop = shard->event_loop;
+    const Forwarder::Options& opt = shard->opt;
+    auto* client = new LinkEventHandler(client_fd, "client", shard);
+    auto* server = new LinkEventHandler(server_fd, "server", shard);
+    client->throttle_ = throttle;
+    server->throttle_ = std::move(throttle);
+    client->bytes_counter_ = Counter::kBytesServerToClient;
+    server->bytes_counter_ = Counter::kBytesClientToServer;
+    client->start_ = start;
+    server->start_ = start;
+    if (mode == Forwarder::Mode::kUserspace) {
+      client->out_.Init(&shard->server_to_client_chunks, &shard->buffered_bytes);
+      server->out_.Init(&shard->client_to_server_chunks, &shard->buffered_bytes);
+      Start(loop, client, server, send_response);
+      return;
+    }
+    std::pair<int, int> sizes = {0, 0};
+    if (opt.buffer_size_history_size > 0) {
+      server->destination_ = PeerAddr(server_fd);
+      auto it = shard->buffer_size_history.find(server->destination_);
+      if (it != shard->buffer_size_history.end()) sizes = it->second;
+    }
+    if (!client->out_.Init(&shard->server_to_client_pipes, opt.max_buffer_size_bytes,
+                           sizes.second, &shard->buffered_bytes) ||
+        !server->out_.Init(&shard->client_to_server_pipes, opt.max_buffer_size_bytes,
+                           sizes.first, &shard->buffered_bytes)) {
       for (auto* p : {client, server}) {
         LOG(INFO) << "[" << p->fd() << "] (" << p->name_ << ") close";
         CHECK(close(p->fd()) == 0) << Errno();
@@ -163,15 +535,23 @@ class LinkEventHandler : public EventHandler {
         p->writable_ = false;
         delete p;
       }
+      shard->num_tunnels.fetch_sub(1, std::memory_order_relaxed);
       return;
     }
+    Start(loop, client, server, send_response);
+  }
+
+  static void Start(EventLoop* loop, LinkEventHandler* client, LinkEventHandler* server,
+                    bool send_response) {
     client->other_ = server;
     server->other_ = client;
     client->IncRef();
     server->IncRef();
-    loop->Add(client, EPOLLIN | EPOLLOUT | EPOLLET);
-    loop->Add(server, EPOLLIN | EPOLLOUT | EPOLLET);
-    client->out_.Write(kResponse);
+    Count(Counter::kTunnelsOpened);
+    const Duration timeout = client->shard_->opt.read_write_timeout;
+    loop->Add(client, EPOLLIN | EPOLLOUT | EPOLLET, timeout);
+    loop->Add(server, EPOLLIN | EPOLLOUT | EPOLLET, timeout);
+    if (send_response) client->out_.Write(kResponse);
   }
 
   void OnEvent(EventLoop* loop, int events) override {
@@ -180,6 +560,7 @@ class LinkEventHandler : public EventHandler {
       if (HasBits(events, EPOLLERR)) {
         LOG(INFO) << "[" << fd() << "] (" << name_ << ") "
                   << "connection broke: " << Errno(SockError(fd()));
+        Count(Counter::kForwardErrors);
         Terminate(loop);
         return false;
       }
@@ -196,25 +577,40 @@ class LinkEventHandler : public EventHandler {
 
   void OnTimeout(EventLoop* loop) override {
     LOG(INFO) << "[" << fd() << "] (" << name_ << ") timed out waiting for IO";
+    Count(Counter::kForwardTimeouts);
     other_->IncRef();
     Terminate(loop);
     other_->DecRef();
   }
 
  private:
-  LinkEventHandler(int fd, const char* name) : EventHandler(fd), name_(name) {}
+  LinkEventHandler(int fd, const char* name, Shard* shard)
+      : EventHandler(fd), name_(name), shard_(shard) {}
 
   ~LinkEventHandler() override { CHECK(!readable_ && !writable_); }
 
   // Forwards as much data as possible from the other link to this.
   // Returns true if some data has been transferred and the link isn't broken.
   bool ForwardFromOther(EventLoop* loop) {
+    const size_t budget = shard_->opt.max_bytes_per_event;
+    size_t bytes = 0;
     bool res = false;
     while (true) {
+      if (budget && bytes >= budget) {
+        // Let other tunnels run. OnEvent() with EPOLLOUT calls ForwardFromOther() on us.
+        loop->Requeue(this, EPOLLOUT);
+        return res;
+      }
       bool io = false;
-      if (other_->readable_) {
-        switch (out_.WriteFrom(other_->fd())) {
+      int64_t limit = other_->readable_ ? ReadLimit(loop) : 0;
+      if (limit > 0) {
+        int size = out_.size();
+        switch (out_.WriteFrom(other_->fd(), limit)) {
           case IoStatus::kData:
+            bytes += out_.size() - size;
+            Count(bytes_counter_, out_.size() - size);
+            if (start_) RecordFirstByte();
+            if (throttle_) throttle_->Consume(out_.size() - size);
             io = true;
             break;
           case IoStatus::kEof:
@@ -224,6 +620,7 @@ class LinkEventHandler : public EventHandler {
             break;
           case IoStatus::kError:
             LOG(INFO) << "[" << other_->fd() << "] (" << other_->name_ << ") read error";
+            Count(Counter::kForwardErrors);
             Terminate(loop);
             return false;
           case IoStatus::kNoOp:
@@ -242,6 +639,7 @@ class LinkEventHandler : public EventHandler {
             break;
           case IoStatus::kError:
             LOG(INFO) << "[" << fd() << "] (" << name_ << ") write error";
+            Count(Counter::kForwardErrors);
             Terminate(loop);
             return false;
           case IoStatus::kNoOp:
@@ -256,6 +654,42 @@ class LinkEventHandler : public EventHandler {
     }
   }
 
+  // Called when the tunnel forwards data for the first time.
+  void RecordFirstByte() {
+    Record(Histogram::kFirstByte, Clock::now() - *start_);
+    start_.reset();
+    other_->start_.reset();
+  }
+
+  // Returns the max number of bytes that may be read from the other link right now.
+  // If zero, ForwardFromOther() will be called once the tunnel has tokens again.
+  int64_t ReadLimit(EventLoop* loop) {
+    if (!throttle_) return kUnlimited;
+    int64_t res = throttle_->Allowance(loop->now());
+    if (res > 0) return res;
+    WaitForTokens(loop);
+    return 0;
+  }
+
+  void WaitForTokens(EventLoop* loop) {
+    if (waiting_for_tokens_) return;
+    waiting_for_tokens_ = true;
+    IncRef();
+    Time now = loop->now();
+    loop->ScheduleAt(now + throttle_->Delay(now), [this, loop]() {
+      waiting_for_tokens_ = false;
+      if (readable_ || writable_) {
+        other_->IncRef();
+        if (ForwardFromOther(loop)) {
+          Refresh(loop);
+          other_->Refresh(loop);
+        }
+        other_->DecRef();
+      }
+      DecRef();
+    });
+  }
+
   void CloseForReading(EventLoop* loop) {
     CHECK(readable_);
     if (writable_) {
@@ -286,6 +720,12 @@ class LinkEventHandler : public EventHandler {
       LOG(INFO) << "[" << fd() << "] (" << name_ << ") close";
       readable_ = false;
       writable_ = false;
+      if (!other_->readable_ && !other_->writable_) {
+        shard_->num_tunnels.fetch_sub(1, std::memory_order_relaxed);
+        Count(Counter::kTunnelsClosed);
+        LinkEventHandler* server = destination_.empty() ? other_ : this;
+        if (!server->destination_.empty()) server->RememberBufferSizes();
+      }
       other_->DecRef();
       loop->Remove(this);
       CHECK(close(fd()) == 0) << Errno();
@@ -298,12 +738,34 @@ class LinkEventHandler : public EventHandler {
     other_->Close(loop);
   }
 
+  // Called on the server link when the tunnel is closed.
+  void RememberBufferSizes() {
+    auto& history = shard_->buffer_size_history;
+    if (!history.count(destination_) && history.size() >= shard_->opt.buffer_size_history_size) {
+      history.erase(history.begin());
+    }
+    history[destination_] = {out_.capacity(), other_->out_.capacity()};
+  }
+
   void Refresh(EventLoop* loop) {
     if (readable_ || writable_) loop->Refresh(this);
   }
 
   const char* name_;
+  Shard* const shard_;
+  // Raw sockaddr of the server. Empty unless this is the server link and
+  // buffer_size_history_size is positive.
+  std::string destination_;
   Buffer out_;
+  // Bytes flowing into this link are counted here.
+  Counter bytes_counter_ = Counter::kBytesClientToServer;
+  // Null if the tunnel isn't throttled.
+  std::shared_ptr<Throttle> throttle_;
+  // The time when Forward() was called. Reset when either link of the tunnel reads data
+  // for the first time.
+  std::optional<Time> start_;
+  // True if there is a pending WaitForTokens() callback.
+  bool waiting_for_tokens_ = false;
   bool readable_ = true;
   bool writable_ = true;
   LinkEventHandler* other_ = nullptr;
@@ -311,14 +773,126 @@ class LinkEventHandler : public EventHandler {
 
 }  // namespace
 
-Forwarder::Forwarder(Options opt)
-    : opt_(std::move(opt)), event_loop_(*new EventLoop(opt_.read_write_timeout)) {}
+Forwarder::Forwarder(Options opt, const LatencyOptions& latency, EventLoop* loop)
+    : opt_(std::move(opt)) {
+  CHECK(opt_.num_forwarder_threads > 0);
+  if (opt_.global_rate_limit.bytes_per_sec) {
+    global_bucket_ = new TokenBucket(opt_.global_rate_limit);
+  }
+  if (loop) {
+    shards_.push_back(new Shard(opt_, loop));
+    return;
+  }
+  for (size_t i = 0; i != opt_.num_forwarder_threads; ++i) {
+    // If io_uring doesn't work for the first shard, don't try it for the rest.
+    bool use_io_uring =
+        opt_.use_io_uring && GetCaps().io_uring && (shards_.empty() || shards_.front()->uring);
+    auto* shard = new Shard(opt_, latency, use_io_uring);
+    if (i == 0 && opt_.use_io_uring) {
+      if (shard->uring) {
+        LOG(INFO) << "Forwarding with io_uring";
+      } else {
+        LOG(WARN) << "io_uring is unavailable; forwarding with epoll";
+      }
+    }
+    shards_.push_back(shard);
+    if (!opt_.forwarder_cpu_sets.empty()) {
+      Pin(shard, opt_.forwarder_cpu_sets[i % opt_.forwarder_cpu_sets.size()]);
+    }
+  }
+}
 
 void Forwarder::Forward(int client_fd, int server_fd) {
+  Forward(client_fd, server_fd, opt_.forwarding_mode);
+}
+
+void Forwarder::Forward(int client_fd, int server_fd, Mode mode, bool send_response) {
   CHECK(client_fd >= 0);
   CHECK(server_fd >= 0);
-  event_loop_.ScheduleOrRun(
-      [=]() { LinkEventHandler::New(&event_loop_, client_fd, server_fd, opt_); });
+  Shard* shard = shards_.front();
+  for (Shard* s : shards_) {
+    if (s->num_tunnels.load(std::memory_order_relaxed) <
+        shard->num_tunnels.load(std::memory_order_relaxed)) {
+      shard = s;
+    }
+  }
+  shard->num_tunnels.fetch_add(1, std::memory_order_relaxed);
+  Time start = Clock::now();
+  if (shard->uring) {
+    shard->uring->Forward(client_fd, server_fd, send_response, start);
+  } else {
+    std::shared_ptr<Throttle> throttle = NewThrottle(client_fd, server_fd);
+    shard->event_loop->ScheduleOrRun([=]() {
+      LinkEventHandler::New(shard, client_fd, server_fd, mode, send_response, std::move(throttle),
+                            start);
+    });
+  }
+}
+
+bool Forwarder::SendResponse(int client_fd) {
+  // A fresh socket always has room for the response, so partial writes mean an error.
+  ssize_t n = send(client_fd, kResponse.data(), kResponse.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n == static_cast<ssize_t>(kResponse.size())) return true;
+  LOG(WARN) << "[" << client_fd << "] (client) error sending response: "
+            << Errno(n < 0 ? errno : EAGAIN);
+  return false;
+}
+
+std::shared_ptr<Throttle> Forwarder::NewThrottle(int client_fd, int server_fd) {
+  const RateLimit* tunnel = nullptr;
+  if (opt_.tunnel_rate_limit.bytes_per_sec) {
+    if (opt_.tunnel_rate_limit_with_pacing) {
+      SetPacingRate(client_fd, opt_.tunnel_rate_limit.bytes_per_sec);
+      SetPacingRate(server_fd, opt_.tunnel_rate_limit.bytes_per_sec);
+    } else {
+      tunnel = &opt_.tunnel_rate_limit;
+    }
+  }
+  std::shared_ptr<TokenBucket> client;
+  if (opt_.client_rate_limit.bytes_per_sec) {
+    std::string ip = PeerIp(client_fd);
+    std::lock_guard<std::mutex> lock(client_buckets_mutex_);
+    std::weak_ptr<TokenBucket>& bucket = client_buckets_[ip];
+    client = bucket.lock();
+    if (!client) {
+      client = std::allocate_shared<TokenBucket>(PoolAllocator<TokenBucket>(),
+                                                 opt_.client_rate_limit);
+      bucket = client;
+    }
+    if (client_buckets_.size() >= client_buckets_sweep_size_) {
+      for (auto it = client_buckets_.begin(); it != client_buckets_.end();) {
+        it = it->second.expired() ? client_buckets_.erase(it) : std::next(it);
+      }
+      client_buckets_sweep_size_ = std::max<size_t>(1024, 2 * client_buckets_.size());
+    }
+  }
+  if (!tunnel && !client && !global_bucket_) return nullptr;
+  // Pooled, like the rest of the per-tunnel state.
+  return std::allocate_shared<Throttle>(PoolAllocator<Throttle>(), tunnel, std::move(client),
+                                        global_bucket_);
+}
+
+void Forwarder::Pin(const std::vector<int>& cpus) {
+  for (Shard* shard : shards_) Pin(shard, cpus);
+}
+
+std::vector<Forwarder::ThreadStats> Forwarder::stats() const {
+  std::vector<ThreadStats> res;
+  res.reserve(shards_.size());
+  for (const Shard* shard : shards_) {
+    res.push_back({shard->num_tunnels.load(std::memory_order_relaxed),
+                   shard->buffered_bytes.load(std::memory_order_relaxed),
+                   shard->client_to_server_pipes.stats(), shard->server_to_client_pipes.stats()});
+  }
+  return res;
+}
+
+void Forwarder::Pin(Shard* shard, const std::vector<int>& cpus) {
+  if (shard->uring) {
+    shard->uring->Pin(cpus);
+  } else {
+    shard->event_loop->Pin(cpus);
+  }
 }
 
 }  // namespace hcproxy
@@ -17,14 +17,39 @@
 
 #include <stddef.h>
 #include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "event_loop.h"
+#include "latency.h"
+#include "pipe_pool.h"
 #include "time.h"
+#include "token_bucket.h"
 
 namespace hcproxy {
 
+namespace internal_forwarder {
+
+struct Shard;
+class Throttle;
+
+}  // namespace internal_forwarder
+
 class Forwarder {
  public:
+  enum class Mode {
+    // Move data through pipes with splice(). Zero copy but uses 6 file descriptors
+    // per connection: 2 sockets + 2 pipes.
+    kSplice,
+    // Move data through userspace buffers with recv() and send(). Uses 2 file
+    // descriptors per connection. Buffer memory is held only while there is data
+    // in flight, so idle connections are cheap.
+    kUserspace,
+  };
+
   struct Options {
     // Size of the buffer that holds data flowing from client to server.
     // Each connection has its own buffer of this kind.
@@ -32,24 +57,114 @@ class Forwarder {
     // Size of the buffer that holds data flowing from server to client.
     // Each connection has its own buffer of this kind.
     size_t server_to_client_buffer_size_bytes = 8 << 10;
+    // Buffers start at the sizes specified above and grow on demand up to this size.
+    // A buffer doubles when reading from the socket keeps filling it completely and
+    // halves after it has stayed mostly empty for a while. If this isn't greater than
+    // the initial size of a buffer, the buffer has fixed size.
+    size_t max_buffer_size_bytes = 1 << 20;
+    // If positive, every forwarder thread remembers final buffer sizes for up to this
+    // many destinations (IP and port) and uses them as initial buffer sizes for new
+    // connections to the same destination.
+    size_t buffer_size_history_size = 0;
+    // Forward traffic with linked io_uring splice operations instead of epoll and
+    // direct splice() calls. Falls back to epoll if io_uring isn't available.
+    // Buffers have fixed size with io_uring: max_buffer_size_bytes and
+    // buffer_size_history_size are ignored, and so are LatencyOptions.
+    bool use_io_uring = false;
+    // The mode used by Forward() when it's not specified explicitly. Ignored when
+    // forwarding with io_uring, which always uses splice mode.
+    Mode forwarding_mode = Mode::kSplice;
+    // Every forwarder thread keeps two pools of empty pipes, one for each kind of
+    // buffer. Pipes of closed connections go back to the pools and get reused by new
+    // connections. On startup each pool is filled with this many pipes.
+    size_t pipe_pool_min_size = 16;
+    // Never keep more than this many idle pipes in a pool.
+    size_t pipe_pool_max_size = 1024;
+    // Close pipes that have stayed in a pool unused for this long, unless the pool would
+    // shrink below pipe_pool_min_size.
+    Duration pipe_pool_idle_timeout = std::chrono::seconds(60);
     // If nothing gets received from or sent to a socket (either client
     // or server), close the connection.
     Duration read_write_timeout = std::chrono::seconds(600);
+    // Bandwidth limits. Each limit counts bytes flowing in both directions. When a
+    // tunnel runs out of tokens, it stops reading from its sockets until the tokens
+    // refill. Ignored when forwarding with io_uring.
+    //
+    // Limit for every tunnel.
+    RateLimit tunnel_rate_limit = {};
+    // Limit for all tunnels from the same client IP address combined.
+    RateLimit client_rate_limit = {};
+    // Limit for all tunnels combined.
+    RateLimit global_rate_limit = {};
+    // If true, tunnel_rate_limit is enforced by the kernel via SO_MAX_PACING_RATE
+    // on both sockets instead of a token bucket. This is cheaper but limits each
+    // direction separately and leaves burst handling to the kernel.
+    bool tunnel_rate_limit_with_pacing = false;
+    // When a tunnel has transferred this many bytes in one direction in one go while
+    // more data is ready, it yields to other tunnels on the same thread and continues
+    // after they've had their turn. Bounds the latency that bulk transfers inflict on
+    // interactive tunnels. Zero means no limit. Ignored when forwarding with io_uring.
+    size_t max_bytes_per_event = 256 << 10;
+    // Forward traffic on this many threads. Each new tunnel is placed on the thread
+    // with the fewest active tunnels and stays there until it's closed.
+    size_t num_forwarder_threads = 1;
+    // If not empty, forwarder thread i is pinned to the CPUs listed in
+    // forwarder_cpu_sets[i % forwarder_cpu_sets.size()].
+    std::vector<std::vector<int>> forwarder_cpu_sets = {};
   };
 
-  explicit Forwarder(Options opt);
+  // If `loop` is not null, forwards on it instead of threads of its own. use_io_uring,
+  // num_forwarder_threads and forwarder_cpu_sets are ignored in this case.
+  explicit Forwarder(Options opt, const LatencyOptions& latency = {}, EventLoop* loop = nullptr);
   Forwarder(Forwarder&&) = delete;
   ~Forwarder();
 
-  // First sends HTTP 200 response to the client. Then bidirectionally proxies
-  // raw bytes between the two sockets.
+  // First sends HTTP 200 response to the client unless `send_response` is false. Then
+  // bidirectionally proxies raw bytes between the two sockets.
   //
   // Does not block.
   void Forward(int client_fd, int server_fd);
+  void Forward(int client_fd, int server_fd, Mode mode, bool send_response = true);
+
+  // Sends HTTP 200 response to the client without waiting for the tunnel. Returns false
+  // on error. Pass `send_response = false` to Forward() afterwards.
+  //
+  // Does not block.
+  static bool SendResponse(int client_fd);
+
+  // Restricts all forwarder threads to the specified CPUs. Overrides forwarder_cpu_sets.
+  // Can be called from any thread.
+  void Pin(const std::vector<int>& cpus);
+
+  struct ThreadStats {
+    // The number of open tunnels.
+    int64_t num_tunnels;
+    // The number of bytes received from one socket and not yet sent to the other,
+    // summed over all tunnels. Always zero when forwarding with io_uring.
+    int64_t buffered_bytes;
+    // Pools of pipes that carry data in splice mode, one per direction.
+    PipePool::Stats client_to_server_pipes;
+    PipePool::Stats server_to_client_pipes;
+  };
+
+  // Returns stats of every forwarder thread. Can be called from any thread.
+  std::vector<ThreadStats> stats() const;
 
  private:
+  static void Pin(internal_forwarder::Shard* shard, const std::vector<int>& cpus);
+
+  // Returns null if the tunnel doesn't need throttling.
+  std::shared_ptr<internal_forwarder::Throttle> NewThrottle(int client_fd, int server_fd);
+
   const Options opt_;
-  EventLoop& event_loop_;
+  std::vector<internal_forwarder::Shard*> shards_;
+  // Null if global_rate_limit is unlimited.
+  TokenBucket* global_bucket_ = nullptr;
+  std::mutex client_buckets_mutex_;
+  // Key: client IP address as raw bytes. Buckets are kept alive by tunnels.
+  std::unordered_map<std::string, std::weak_ptr<TokenBucket>> client_buckets_;
+  // Drop expired entries from client_buckets_ when it grows to this size.
+  size_t client_buckets_sweep_size_ = 1024;
 };
 
 }  // namespace hcproxy
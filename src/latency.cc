@@ -0,0 +1,45 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "latency.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "caps.h"
+#include "check.h"
+#include "logging.h"
+
+namespace hcproxy {
+
+namespace {
+
+void SetIntSockOpt(int fd, int optname, const char* name, int val) {
+  if (setsockopt(fd, SOL_SOCKET, optname, &val, sizeof(val)) != 0) {
+    LOG(WARN) << "[" << fd << "] unable to set " << name << ": " << Errno();
+  }
+}
+
+}  // namespace
+
+void SetBusyPoll(int fd, const LatencyOptions& opt) {
+  if (opt.busy_poll <= std::chrono::microseconds::zero() || !GetCaps().socket_busy_poll) return;
+  SetIntSockOpt(fd, SO_BUSY_POLL, "SO_BUSY_POLL", opt.busy_poll.count());
+  if (opt.busy_poll_budget) {
+    SetIntSockOpt(fd, SO_BUSY_POLL_BUDGET, "SO_BUSY_POLL_BUDGET", opt.busy_poll_budget);
+  }
+  if (opt.prefer_busy_poll) SetIntSockOpt(fd, SO_PREFER_BUSY_POLL, "SO_PREFER_BUSY_POLL", 1);
+}
+
+}  // namespace hcproxy
@@ -0,0 +1,52 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_LATENCY_H_
+#define ROMKATV_HCPROXY_LATENCY_H_
+
+#include <chrono>
+#include <cstdint>
+
+#include "time.h"
+
+namespace hcproxy {
+
+// Knobs that trade CPU time for lower latency. Everything is off by default.
+struct LatencyOptions {
+  // If positive, a socket read with no data spins on the device receive queue
+  // for up to this long before giving up (SO_BUSY_POLL), and so does epoll_wait()
+  // in event loops. Values above net.core.busy_read require CAP_NET_ADMIN.
+  std::chrono::microseconds busy_poll = std::chrono::microseconds(0);
+  // Max number of packets to process per busy poll. Zero means kernel default.
+  // Requires busy_poll. Values above the default require CAP_NET_ADMIN.
+  std::uint16_t busy_poll_budget = 0;
+  // Prefer busy polling over softirq processing (SO_PREFER_BUSY_POLL).
+  // Requires busy_poll.
+  bool prefer_busy_poll = false;
+  // If positive, event loops poll for events without blocking for this long after
+  // handling an event before going to sleep in epoll_wait(). Each event loop thread
+  // burns a full CPU while spinning.
+  Duration spin = Duration::zero();
+  // If positive, event loop threads run under SCHED_FIFO with this priority
+  // (from 1 to 99). Requires CAP_SYS_NICE.
+  int realtime_priority = 0;
+};
+
+// Applies the socket options from `opt` to the socket. Does nothing if the kernel
+// doesn't support busy polling. Failures are logged and otherwise ignored.
+void SetBusyPoll(int fd, const LatencyOptions& opt);
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_LATENCY_H_
@@ -0,0 +1,162 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics.h"
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "stats.h"
+
+namespace hcproxy {
+
+namespace {
+
+// Returns the number of open file descriptors of the process or -1 on error.
+int64_t NumOpenFiles() {
+  DIR* dir = opendir("/proc/self/fd");
+  if (!dir) return -1;
+  int64_t res = 0;
+  while (const dirent* ent = readdir(dir)) {
+    if (ent->d_name[0] != '.') ++res;
+  }
+  CHECK(closedir(dir) == 0) << Errno();
+  // Don't count the descriptor of `dir`.
+  return res - 1;
+}
+
+std::uint64_t HistogramCount(const StatsSnapshot& stats, Histogram h) {
+  std::uint64_t res = 0;
+  for (std::uint64_t n : stats.histograms[static_cast<size_t>(h)]) res += n;
+  return res;
+}
+
+void Header(std::ostream& strm, const char* name, const char* type, const char* help) {
+  strm << "# HELP " << name << ' ' << help << '\n' << "# TYPE " << name << ' ' << type << '\n';
+}
+
+}  // namespace
+
+std::string RenderMetrics(const MetricSources& src) {
+  std::ostringstream strm;
+
+  auto stats = std::make_unique<StatsSnapshot>();
+  ReadStats(stats.get());
+  for (size_t i = 0; i != kNumCounters; ++i) {
+    std::string name = std::string("hcproxy_") + kCounterNames[i] + "_total";
+    strm << "# TYPE " << name << " counter\n" << name << ' ' << stats->counters[i] << '\n';
+  }
+
+  Header(strm, "hcproxy_setup_latency_seconds", "summary",
+         "Latency of connection setup stages. Quantiles are accurate to within 12.5%.");
+  for (size_t h = 0; h != kNumHistograms; ++h) {
+    const std::uint64_t(&buckets)[kHistogramBuckets] = stats->histograms[h];
+    std::uint64_t count = 0;
+    for (std::uint64_t n : buckets) count += n;
+    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+      strm << "hcproxy_setup_latency_seconds{stage=\"" << kHistogramNames[h] << "\",quantile=\""
+           << q << "\"} " << HistogramQuantile(buckets, q) / 1e6 << '\n';
+    }
+    strm << "hcproxy_setup_latency_seconds_sum{stage=\"" << kHistogramNames[h] << "\"} "
+         << stats->histogram_sums[h] / 1e6 << '\n';
+    strm << "hcproxy_setup_latency_seconds_count{stage=\"" << kHistogramNames[h] << "\"} "
+         << count << '\n';
+  }
+
+  std::map<std::uint16_t, std::uint64_t> accepted;
+  for (const Acceptor* acceptor : src.acceptors) {
+    for (const auto& [port, n] : acceptor->num_accepted()) accepted[port] += n;
+  }
+  Header(strm, "hcproxy_accepted_by_port_total", "counter",
+         "Connections accepted on the listening port.");
+  for (const auto& [port, n] : accepted) {
+    strm << "hcproxy_accepted_by_port_total{port=\"" << port << "\"} " << n << '\n';
+  }
+
+  std::vector<std::vector<Forwarder::ThreadStats>> forwarders;
+  for (const Forwarder* forwarder : src.forwarders) forwarders.push_back(forwarder->stats());
+  Header(strm, "hcproxy_tunnels", "gauge", "Open tunnels per forwarder thread.");
+  for (size_t w = 0; w != forwarders.size(); ++w) {
+    for (size_t t = 0; t != forwarders[w].size(); ++t) {
+      strm << "hcproxy_tunnels{forwarder=\"" << w << "\",thread=\"" << t << "\"} "
+           << forwarders[w][t].num_tunnels << '\n';
+    }
+  }
+  Header(strm, "hcproxy_buffered_bytes", "gauge",
+         "Bytes in flight in tunnel buffers per forwarder thread.");
+  for (size_t w = 0; w != forwarders.size(); ++w) {
+    for (size_t t = 0; t != forwarders[w].size(); ++t) {
+      strm << "hcproxy_buffered_bytes{forwarder=\"" << w << "\",thread=\"" << t << "\"} "
+           << forwarders[w][t].buffered_bytes << '\n';
+    }
+  }
+  // Calls `f(labels, pool_stats)` for every pipe pool.
+  auto ForEachPipePool = [&](auto&& f) {
+    for (size_t w = 0; w != forwarders.size(); ++w) {
+      for (size_t t = 0; t != forwarders[w].size(); ++t) {
+        std::string labels =
+            "forwarder=\"" + std::to_string(w) + "\",thread=\"" + std::to_string(t) + "\"";
+        f(labels + ",direction=\"client_to_server\"", forwarders[w][t].client_to_server_pipes);
+        f(labels + ",direction=\"server_to_client\"", forwarders[w][t].server_to_client_pipes);
+      }
+    }
+  };
+  Header(strm, "hcproxy_pipe_pool_size", "gauge", "Idle pipes in the pool per forwarder thread.");
+  ForEachPipePool([&](const std::string& labels, const PipePool::Stats& pool) {
+    strm << "hcproxy_pipe_pool_size{" << labels << "} " << pool.size << '\n';
+  });
+  Header(strm, "hcproxy_pipe_pool_acquired_total", "counter",
+         "Pipes taken from the pool (hit) or created because it was empty (miss) per "
+         "forwarder thread.");
+  ForEachPipePool([&](const std::string& labels, const PipePool::Stats& pool) {
+    strm << "hcproxy_pipe_pool_acquired_total{" << labels << ",result=\"hit\"} " << pool.hits
+         << '\n';
+    strm << "hcproxy_pipe_pool_acquired_total{" << labels << ",result=\"miss\"} "
+         << pool.misses << '\n';
+  });
+
+  if (src.dns_resolver) {
+    DnsResolver::Stats dns = src.dns_resolver->stats();
+    Header(strm, "hcproxy_dns_cache_size", "gauge", "Hosts in the DNS cache.");
+    strm << "hcproxy_dns_cache_size " << dns.cache_size << '\n';
+    // Every request records its latency in one of these histograms.
+    Header(strm, "hcproxy_dns_cache_hits_total", "counter", "DNS requests served from cache.");
+    strm << "hcproxy_dns_cache_hits_total " << HistogramCount(*stats, Histogram::kDnsHit) << '\n';
+    Header(strm, "hcproxy_dns_cache_misses_total", "counter",
+           "DNS requests that waited for a lookup.");
+    strm << "hcproxy_dns_cache_misses_total " << HistogramCount(*stats, Histogram::kDnsMiss)
+         << '\n';
+    Header(strm, "hcproxy_dns_queue_size", "gauge",
+           "DNS lookups in flight or waiting for a thread.");
+    strm << "hcproxy_dns_queue_size " << dns.queue_size << '\n';
+  }
+
+  Header(strm, "hcproxy_open_files", "gauge", "Open file descriptors.");
+  strm << "hcproxy_open_files " << NumOpenFiles() << '\n';
+  struct rlimit lim;
+  CHECK(getrlimit(RLIMIT_NOFILE, &lim) == 0) << Errno();
+  Header(strm, "hcproxy_max_open_files", "gauge", "The limit on open file descriptors.");
+  strm << "hcproxy_max_open_files " << lim.rlim_cur << '\n';
+
+  return strm.str();
+}
+
+}  // namespace hcproxy
@@ -0,0 +1,41 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_METRICS_H_
+#define ROMKATV_HCPROXY_METRICS_H_
+
+#include <string>
+#include <vector>
+
+#include "acceptor.h"
+#include "dns.h"
+#include "forwarder.h"
+
+namespace hcproxy {
+
+// Proxy components whose state is exported as metrics. In shared-nothing mode there is
+// one acceptor and one forwarder per worker.
+struct MetricSources {
+  std::vector<const Acceptor*> acceptors;
+  DnsResolver* dns_resolver = nullptr;
+  std::vector<const Forwarder*> forwarders;
+};
+
+// Renders counters (see stats.h) and the current state of the components in Prometheus
+// text exposition format. Can be called from any thread.
+std::string RenderMetrics(const MetricSources& src);
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_METRICS_H_
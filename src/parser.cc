@@ -16,13 +16,19 @@
 
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <algorithm>
 #include <utility>
 
 #include "bits.h"
 #include "check.h"
 #include "event_loop.h"
+#include "latency.h"
 #include "logging.h"
+#include "pool.h"
+#include "scan.h"
+#include "stats.h"
 #include "sock.h"
 
 namespace hcproxy {
@@ -31,26 +37,98 @@ namespace {
 
 constexpr std::string_view kConnectPrefix = "CONNECT ";
 
-bool EndsWith(std::string_view s, std::string_view suffix) {
-  return s.size() >= suffix.size() &&
-         memcmp(s.data() + s.size() - suffix.size(), suffix.data(), suffix.size()) == 0;
+// Peeks at the data in the socket and parses the HTTP CONNECT request in it.
+//
+// Valid requests are at most `capacity` bytes in length and match the following regular
+// expression: "CONNECT ([^ \r]*).*?\r\n\r\n". The capture is host_port.
+//
+// The request stays in the socket receive buffer until it's complete, so it can be read
+// piecemeal through a scratch buffer shared by all pending requests. `scanned` is the
+// number of bytes at the front of the socket receive buffer that have already been
+// searched for the end of the request; it's updated on every call. `eof` means that the
+// client has shut down its side of the connection.
+//
+// Returns:
+//
+//   nullopt: Incomplete request. Must wait for more data from the socket.
+//   ""     : Malformed HTTP CONNECT request. Must close the socket. Must not call again.
+//   else:  : host_port of the HTTP CONNECT request. Points into `scratch`, so it's valid
+//            only until the scratch buffer is reused. Must not call again.
+std::optional<std::string_view> PeekRequest(int fd, char* scratch, size_t capacity,
+                                            size_t* scanned, bool eof) {
+  ssize_t ret = recv(fd, scratch, capacity, MSG_PEEK | MSG_DONTWAIT);
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return std::nullopt;
+    LOG(WARN) << "[" << fd << "] error reading request: " << Errno();
+    return "";
+  }
+  const size_t size = ret;
+  // Verify that the request starts with kConnectPrefix.
+  if (memcmp(scratch, kConnectPrefix.data(), std::min(size, kConnectPrefix.size())) != 0) {
+    LOG(WARN) << "[" << fd << "] invalid request prefix";
+    return "";
+  }
+  // The data before `scanned` has been searched already. The terminator may straddle it.
+  const size_t from = *scanned < 3 ? 0 : *scanned - 3;
+  const size_t end = from + FindHeaderEnd(scratch + from, size - from);
+  if (end == size) {
+    if (eof || size == 0) {
+      LOG(WARN) << "[" << fd << "] incomplete request";
+      return "";
+    }
+    if (size == capacity) {
+      LOG(WARN) << "[" << fd << "] request too big";
+      return "";
+    }
+    *scanned = size;
+    return std::nullopt;
+  }
+  const char* host = scratch + std::min(size, kConnectPrefix.size());
+  std::string_view host_port(host, FindTokenEnd(host, scratch + end - host));
+  // Consume just the request. Whatever the client has sent after it (usually TLS
+  // ClientHello) stays in the socket and becomes the first data of the tunnel.
+  const ssize_t consume = end + 4;
+  CHECK(recv(fd, nullptr, consume, MSG_TRUNC | MSG_DONTWAIT) == consume) << Errno();
+  if (host_port.empty()) {
+    LOG(WARN) << "[" << fd << "] empty host:port in the request";
+  } else {
+    LOG(INFO) << "[" << fd << "] CONNECT " << host_port;
+  }
+  return host_port;
 }
 
-// Handler for an incoming HTTP CONNECT request.
-//
-// Valid requests are at most Options::max_request_size_bytes in length and match the
-// following regular expression: "CONNECT ([^ \r]*).*\r\n\r\n". The capture is host_port.
-class ParseEventHandler : public EventHandler {
+void Done(const Parser::Callback& cb, std::string_view host_port, Time start) {
+  if (host_port.empty()) {
+    Count(Counter::kParseErrors);
+  } else {
+    Count(Counter::kParsed);
+    Record(Histogram::kParse, Clock::now() - start);
+  }
+  cb(host_port);
+}
+
+// Handler for an incoming HTTP CONNECT request. On every event it peeks at the request
+// through the scratch buffer shared by all handlers of the event loop, so a pending request
+// costs just the handler itself no matter how slowly it arrives.
+class ParseEventHandler : public EventHandler, public Pooled<ParseEventHandler> {
  public:
-  ParseEventHandler(const Parser::Options& opt, int fd, Parser::Callback cb)
-      : EventHandler(fd), cb_(std::move(cb)), content_(opt.max_request_size_bytes) {}
+  // `scratch` must have room for Options::max_request_size_bytes. It's used only from the
+  // event loop thread.
+  ParseEventHandler(const Parser::Options& opt, char* scratch, int fd, Parser::Callback cb,
+                    Time start)
+      : EventHandler(fd),
+        cb_(std::move(cb)),
+        start_(start),
+        capacity_(opt.max_request_size_bytes),
+        scratch_(scratch) {}
 
   void OnEvent(EventLoop* loop, int events) override {
     if (HasBits(events, EPOLLERR)) {
       LOG(WARN) << "[" << fd() << "] error reading request data: " << Errno(SockError(fd()));
       Finish(loop, "");
-    } else if (HasBits(events, EPOLLIN)) {
-      if (std::optional<std::string_view> host_port = Read()) {
+    } else if (HasBits(events, EPOLLIN) || HasBits(events, EPOLLRDHUP)) {
+      if (std::optional<std::string_view> host_port =
+              PeekRequest(fd(), scratch_, capacity_, &scanned_, HasBits(events, EPOLLRDHUP))) {
         Finish(loop, *host_port);
       }
     }
@@ -58,75 +136,52 @@ class ParseEventHandler : public EventHandler {
 
   void OnTimeout(EventLoop* loop) override {
     LOG(WARN) << "[" << fd() << "] timed out waiting for request data";
+    Count(Counter::kParseTimeouts);
     Finish(loop, "");
   }
 
  private:
   void Finish(EventLoop* loop, std::string_view host_port) {
     loop->Remove(this);
-    cb_(host_port);
-  }
-
-  // Reads data from the socket. Returns:
-  //
-  //   nullopt: Incomplete request. Must wait for more data from the socket.
-  //   ""     : Malformed HTTP CONNECT request. Must close the socket. Must not call Read() again.
-  //   else:  : host_port of the HTTP CONNECT request. Must not call Read() again.
-  std::optional<std::string_view> Read() {
-    CHECK(size_ < content_.size());
-    while (true) {
-      int ret = read(fd(), content_.data() + size_, content_.size() - size_);
-      if (ret < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) return std::nullopt;
-        LOG(WARN) << "[" << fd() << "] error reading request: " << Errno();
-        return "";
-      }
-      // Verify that the request starts with kConnectPrefix.
-      if (size_ < kConnectPrefix.size()) {
-        size_t n = std::min<size_t>(ret, kConnectPrefix.size() - size_);
-        if (memcmp(content_.data() + size_, kConnectPrefix.data() + size_, n) != 0) {
-          LOG(WARN) << "[" << fd() << "] invalid request prefix";
-          return "";
-        }
-      }
-      size_ += ret;
-      std::string_view req(content_.data(), size_);
-      if (EndsWith(req, "\r\n\r\n")) {
-        size_t start = kConnectPrefix.size();
-        std::string_view host_port = req.substr(start, req.find_first_of(" \r", start) - start);
-        if (host_port.empty()) {
-          LOG(WARN) << "[" << fd() << "] empty host:port in the request";
-        } else {
-          LOG(INFO) << "[" << fd() << "] CONNECT " << host_port;
-        }
-        return host_port;
-      }
-      if (ret == 0) {
-        LOG(WARN) << "[" << fd() << "] incomplete request";
-        return "";
-      }
-      if (size_ == content_.size()) {
-        LOG(WARN) << "[" << fd() << "] request too big";
-        return "";
-      }
-    }
+    Done(cb_, host_port, start_);
   }
 
   const Parser::Callback cb_;
-  std::vector<char> content_;
-  size_t size_ = 0;
+  const Time start_;
+  const size_t capacity_;
+  char* const scratch_;
+  // See PeekRequest().
+  size_t scanned_ = 0;
 };
 
 }  // namespace
 
-Parser::Parser(Options opt)
-    : opt_(std::move(opt)), event_loop_(*new EventLoop(opt_.accept_timeout)) {}
+Parser::Parser(Options opt, const LatencyOptions& latency, EventLoop* loop)
+    : opt_(std::move(opt)),
+      scratch_(opt_.max_request_size_bytes),
+      event_loop_(loop ? *loop : *new EventLoop(opt_.accept_timeout, latency)) {}
 
 void Parser::ParseRequest(int fd, Callback cb) {
   CHECK(fd >= 0);
   CHECK(cb);
-  auto* eh = new ParseEventHandler(opt_, fd, std::move(cb));
-  event_loop_.ScheduleOrRun([this, eh]() { event_loop_.Add(eh, EPOLLIN); });
+  const Time start = Clock::now();
+  if (opt_.parse_inline) {
+    // Inline parsing may run on several threads, so it can't use scratch_.
+    thread_local std::vector<char> scratch;
+    if (scratch.size() < opt_.max_request_size_bytes) scratch.resize(opt_.max_request_size_bytes);
+    size_t scanned = 0;
+    if (std::optional<std::string_view> host_port =
+            PeekRequest(fd, scratch.data(), opt_.max_request_size_bytes, &scanned, false)) {
+      Done(cb, *host_port, start);
+      return;
+    }
+  }
+  event_loop_.ScheduleOrRun([this, fd, cb = std::move(cb), start]() mutable {
+    event_loop_.Add(new ParseEventHandler(opt_, scratch_.data(), fd, std::move(cb), start),
+                    EPOLLIN | EPOLLRDHUP | EPOLLET, opt_.accept_timeout);
+  });
 }
 
+void Parser::Pin(const std::vector<int>& cpus) { event_loop_.Pin(cpus); }
+
 }  // namespace hcproxy
@@ -20,7 +20,9 @@
 #include <functional>
 #include <optional>
 #include <string>
+#include <vector>
 
+#include "latency.h"
 #include "time.h"
 
 namespace hcproxy {
@@ -35,23 +37,38 @@ class Parser {
     // Close the incoming connection if unable to read the full HTTP CONNECT request
     // within this time.
     Duration accept_timeout = std::chrono::seconds(5);
+    // Try to parse the request on the thread that calls ParseRequest() before handing
+    // the connection over to the parser thread. This saves a thread hop and a round of
+    // epoll_ctl() calls when the request has already arrived, which is usually the case
+    // when Acceptor::Options::defer_accept_timeout is positive. Without it, it's mostly
+    // a wasted syscall.
+    bool parse_inline = false;
   };
 
   using Callback = std::function<void(std::string_view)>;
 
-  explicit Parser(Options opt);
+  // If `loop` is not null, runs on it instead of a thread of its own.
+  explicit Parser(Options opt, const LatencyOptions& latency = {}, EventLoop* loop = nullptr);
   Parser(Parser&&) = delete;
   ~Parser() = delete;
 
   // Reads and parses an HTTP CONNECT request from the specified socket file descriptor.
   // On success, calls `cb` with host_port from the request as the argument. On error,
-  // calls `cb` with empty string as the argument.
+  // calls `cb` with empty string as the argument. The argument is valid only until `cb`
+  // returns. Data that the client has sent after the request is left in the socket.
+  //
+  // With parse_inline, `cb` may be called before ParseRequest() returns.
   //
   // Does not block.
   void ParseRequest(int fd, Callback cb);
 
+  // Restricts the parser thread to the specified CPUs. Can be called from any thread.
+  void Pin(const std::vector<int>& cpus);
+
  private:
   const Options opt_;
+  // Shared by all pending requests. Can be used only from the event loop thread.
+  std::vector<char> scratch_;
   EventLoop& event_loop_;
 };
 
@@ -0,0 +1,121 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pipe_pool.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
+
+#include "check.h"
+#include "logging.h"
+#include "stats.h"
+
+namespace hcproxy {
+
+namespace {
+
+bool CreatePipe(size_t size_bytes, Pipe* pipe) {
+  int fds[2];
+  if (::pipe(fds) != 0) {
+    LOG(ERROR) << "pipe() failed: " << Errno();
+    CHECK(errno == EMFILE || errno == ENFILE) << Errno();
+    return false;
+  }
+  pipe->read_fd = fds[0];
+  pipe->write_fd = fds[1];
+  CHECK((pipe->capacity = fcntl(fds[0], F_SETPIPE_SZ, size_bytes)) > 0) << Errno();
+  for (int fd : fds) CHECK(fcntl(fd, F_GETPIPE_SZ) == pipe->capacity);
+  return true;
+}
+
+void ClosePipe(const Pipe& pipe) {
+  CHECK(close(pipe.read_fd) == 0) << Errno();
+  CHECK(close(pipe.write_fd) == 0) << Errno();
+}
+
+}  // namespace
+
+PipePool::PipePool(const Options& opt) : opt_(opt) {
+  CHECK(opt_.pipe_size_bytes > 0 && opt_.pipe_size_bytes < std::numeric_limits<int>::max());
+  CHECK(opt_.min_size <= opt_.max_size);
+  CHECK(opt_.idle_timeout > Duration::zero());
+}
+
+PipePool::~PipePool() {
+  for (const Pipe& pipe : pipes_) ClosePipe(pipe);
+}
+
+void PipePool::Fill() {
+  while (pipes_.size() < opt_.min_size) {
+    Pipe pipe;
+    if (!CreatePipe(opt_.pipe_size_bytes, &pipe)) break;
+    pipes_.push_back(pipe);
+    Count(Counter::kPipesPooled);
+  }
+  low_watermark_ = pipes_.size();
+  size_.store(pipes_.size(), std::memory_order_relaxed);
+}
+
+bool PipePool::Acquire(Pipe* pipe) {
+  CHECK(pipe);
+  if (pipes_.empty()) {
+    misses_.store(misses_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    Count(Counter::kPipePoolMisses);
+    return CreatePipe(opt_.pipe_size_bytes, pipe);
+  }
+  hits_.store(hits_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  Count(Counter::kPipePoolHits);
+  Count(Counter::kPipesUnpooled);
+  *pipe = pipes_.back();
+  pipes_.pop_back();
+  low_watermark_ = std::min(low_watermark_, pipes_.size());
+  size_.store(pipes_.size(), std::memory_order_relaxed);
+  return true;
+}
+
+void PipePool::Release(Pipe pipe) {
+  CHECK(pipe.read_fd >= 0 && pipe.write_fd >= 0);
+  if (pipes_.size() >= opt_.max_size) {
+    ClosePipe(pipe);
+    return;
+  }
+  pipes_.push_back(pipe);
+  Count(Counter::kPipesPooled);
+  size_.store(pipes_.size(), std::memory_order_relaxed);
+}
+
+PipePool::Stats PipePool::stats() const {
+  return {size_.load(std::memory_order_relaxed), hits_.load(std::memory_order_relaxed),
+          misses_.load(std::memory_order_relaxed)};
+}
+
+void PipePool::Trim() {
+  size_t n = std::min(low_watermark_, pipes_.size() - std::min(pipes_.size(), opt_.min_size));
+  for (size_t i = 0; i != n; ++i) {
+    ClosePipe(pipes_.back());
+    pipes_.pop_back();
+  }
+  Count(Counter::kPipesUnpooled, n);
+  low_watermark_ = pipes_.size();
+  size_.store(pipes_.size(), std::memory_order_relaxed);
+  if (n == 0) return;
+  Stats s = stats();
+  LOG(INFO) << "Pipe pool (" << opt_.pipe_size_bytes << " bytes): "
+            << "closed " << n << " idle pipes, size = " << s.size << ", hits = " << s.hits
+            << ", misses = " << s.misses;
+}
+
+}  // namespace hcproxy
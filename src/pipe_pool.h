@@ -0,0 +1,100 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_PIPE_POOL_H_
+#define ROMKATV_HCPROXY_PIPE_POOL_H_
+
+#include <stddef.h>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "time.h"
+
+namespace hcproxy {
+
+// An empty pipe with both ends open.
+struct Pipe {
+  int read_fd = -1;
+  int write_fd = -1;
+  // As reported by F_GETPIPE_SZ.
+  int capacity = 0;
+};
+
+// A pool of empty pipes of the same capacity.
+//
+// Thread-compatible. NOT thread-safe. The only exception is stats(), which can be
+// called from any thread.
+class PipePool {
+ public:
+  struct Options {
+    // Requested capacity of every pipe in the pool.
+    size_t pipe_size_bytes;
+    // Fill() creates this many pipes. Idle pipes aren't closed if that would
+    // shrink the pool below this size.
+    size_t min_size;
+    // Never keep more than this many pipes in the pool.
+    size_t max_size;
+    // Close pipes that have stayed in the pool unused for this long. The owner of the
+    // pool is responsible for calling Trim() this often.
+    Duration idle_timeout;
+  };
+
+  struct Stats {
+    // Number of pipes in the pool.
+    int64_t size;
+    // Number of Acquire() calls that were served from the pool.
+    int64_t hits;
+    // Number of Acquire() calls that had to create a new pipe.
+    int64_t misses;
+  };
+
+  explicit PipePool(const Options& opt);
+  PipePool(PipePool&&) = delete;
+  ~PipePool();
+
+  // Creates pipes until the pool has min_size of them or pipe creation fails.
+  void Fill();
+
+  // Takes a pipe from the pool or creates a new one if the pool is empty.
+  // Returns false if unable to create a pipe due to the file descriptor limit.
+  bool Acquire(Pipe* pipe);
+
+  // Returns a pipe to the pool. The pipe must be empty and have both ends open,
+  // and its capacity must be the same as it was when it was acquired.
+  void Release(Pipe pipe);
+
+  // Closes pipes that have stayed in the pool unused since the previous call, keeping
+  // at least min_size of them. Should be called every idle_timeout, whether the pool is
+  // in use or not.
+  void Trim();
+
+  // Can be called from any thread.
+  Stats stats() const;
+
+ private:
+  const Options opt_;
+  std::vector<Pipe> pipes_;
+  // The smallest size of the pool since the last call to Trim(). This many pipes
+  // have stayed unused for the whole time.
+  size_t low_watermark_ = 0;
+  // Written only by the owning thread.
+  std::atomic<int64_t> size_{0};
+  std::atomic<int64_t> hits_{0};
+  std::atomic<int64_t> misses_{0};
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_PIPE_POOL_H_
@@ -0,0 +1,93 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pool.h"
+
+#include <sys/mman.h>
+#include <algorithm>
+
+#include "logging.h"
+
+namespace hcproxy {
+
+namespace {
+
+// Slabs are the size of a huge page on x86-64.
+constexpr size_t kSlabSize = 2 << 20;
+// The number of chunks Take() carves from a slab at once.
+constexpr size_t kBatchSize = 32;
+
+std::atomic<bool> g_huge_pages{false};
+
+char* NewSlab() {
+  void* p = MAP_FAILED;
+  if (g_huge_pages.load(std::memory_order_relaxed)) {
+    p = mmap(nullptr, kSlabSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      p = mmap(nullptr, kSlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      CHECK(p != MAP_FAILED) << Errno();
+      if (madvise(p, kSlabSize, MADV_HUGEPAGE) != 0) {
+        LOG(WARN) << "Unable to use huge pages: " << Errno();
+      }
+    }
+  } else {
+    p = mmap(nullptr, kSlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  CHECK(p != MAP_FAILED) << Errno();
+  return static_cast<char*>(p);
+}
+
+}  // namespace
+
+void UsePoolHugePages(bool enable) { g_huge_pages.store(enable, std::memory_order_relaxed); }
+
+namespace internal_pool {
+
+ChunkPool::ChunkPool(size_t chunk_size)
+    : chunk_size_((std::max(chunk_size, sizeof(FreeChunk)) + alignof(std::max_align_t) - 1) /
+                  alignof(std::max_align_t) * alignof(std::max_align_t)) {
+  CHECK(chunk_size_ <= kSlabSize);
+}
+
+FreeChunk* ChunkPool::Take() {
+  if (FreeChunk* res = free_.exchange(nullptr, std::memory_order_acquire)) return res;
+  std::lock_guard<std::mutex> lock(mutex_);
+  FreeChunk* res = nullptr;
+  for (size_t i = 0; i != kBatchSize; ++i) {
+    if (slab_left_ < chunk_size_) {
+      slab_ = NewSlab();
+      slab_left_ = kSlabSize;
+    }
+    auto* chunk = reinterpret_cast<FreeChunk*>(slab_);
+    slab_ += chunk_size_;
+    slab_left_ -= chunk_size_;
+    chunk->next = res;
+    res = chunk;
+  }
+  return res;
+}
+
+void ChunkPool::Free(void* p) {
+  auto* chunk = static_cast<FreeChunk*>(p);
+  chunk->next = free_.load(std::memory_order_relaxed);
+  // Chunks are taken from free_ only all at once, so there is no ABA problem.
+  while (!free_.compare_exchange_weak(chunk->next, chunk, std::memory_order_release,
+                                      std::memory_order_relaxed)) {
+  }
+}
+
+}  // namespace internal_pool
+
+}  // namespace hcproxy
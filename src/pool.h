@@ -0,0 +1,122 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_POOL_H_
+#define ROMKATV_HCPROXY_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+
+#include "check.h"
+
+namespace hcproxy {
+
+// Backs pools with huge pages from now on. Falls back to transparent huge pages if
+// MAP_HUGETLB fails. Should be called on startup, before any pooled objects are created.
+void UsePoolHugePages(bool enable);
+
+namespace internal_pool {
+
+struct FreeChunk {
+  FreeChunk* next;
+};
+
+// Process-wide source of fixed-size memory chunks. Memory is obtained from the system in
+// slabs of many chunks and is never returned.
+//
+// Thread-safe.
+class ChunkPool {
+ public:
+  explicit ChunkPool(size_t chunk_size);
+  ChunkPool(ChunkPool&&) = delete;
+  ~ChunkPool() = delete;
+
+  // Returns a non-empty list of chunks. Takes all chunks that have been freed so far or,
+  // if there are none, carves a batch of new chunks from the current slab. Lock-free
+  // unless new chunks are needed.
+  FreeChunk* Take();
+
+  // Lock-free.
+  void Free(void* p);
+
+ private:
+  const size_t chunk_size_;
+  std::atomic<FreeChunk*> free_{nullptr};
+  std::mutex mutex_;
+  char* slab_ = nullptr;
+  size_t slab_left_ = 0;
+};
+
+}  // namespace internal_pool
+
+// Inherit from Pooled<T> to make `new T` and `delete` of T use a pool of chunks of
+// sizeof(T) bytes instead of malloc. Every thread allocates from its own list of chunks
+// and refills it from chunks freed by all threads, so objects can be freed on a thread
+// other than the one that created them. In steady state neither malloc nor locks are
+// involved.
+template <class T>
+class Pooled {
+ public:
+  static void* operator new(size_t size) {
+    static_assert(alignof(T) <= alignof(std::max_align_t));
+    CHECK(size == sizeof(T));
+    if (!t_free_) t_free_ = Pool().Take();
+    return std::exchange(t_free_, t_free_->next);
+  }
+
+  static void operator delete(void* p) {
+    if (p) Pool().Free(p);
+  }
+
+ private:
+  static internal_pool::ChunkPool& Pool() {
+    static internal_pool::ChunkPool* pool = new internal_pool::ChunkPool(sizeof(T));
+    return *pool;
+  }
+
+  static inline thread_local internal_pool::FreeChunk* t_free_ = nullptr;
+};
+
+// An allocator backed by the same pools as Pooled<T>. For objects that the standard
+// library allocates on our behalf, such as control blocks of std::allocate_shared().
+template <class T>
+struct PoolAllocator {
+  using value_type = T;
+
+  PoolAllocator() = default;
+  template <class U>
+  PoolAllocator(const PoolAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    CHECK(n == 1);
+    return static_cast<T*>(Pooled<T>::operator new(sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t) { Pooled<T>::operator delete(p); }
+
+  template <class U>
+  bool operator==(const PoolAllocator<U>&) const {
+    return true;
+  }
+  template <class U>
+  bool operator!=(const PoolAllocator<U>&) const {
+    return false;
+  }
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_POOL_H_
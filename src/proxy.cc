@@ -0,0 +1,194 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "proxy.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "addr.h"
+#include "caps.h"
+#include "check.h"
+#include "event_loop.h"
+#include "logging.h"
+#include "metrics.h"
+#include "pool.h"
+#include "stats.h"
+
+namespace hcproxy {
+
+namespace {
+
+bool IsAllowedPort(const Options& opt, std::string_view host_port) {
+  auto sep = host_port.rfind(':');
+  if (sep == std::string_view::npos) return false;
+  std::string_view port = host_port.substr(sep + 1);
+  return opt.allowed_ports.empty() || opt.allowed_ports.count(port);
+}
+
+Forwarder::Mode ForwardingMode(const Options& opt, std::uint16_t listen_port) {
+  auto it = opt.forwarding_mode_by_listen_port.find(listen_port);
+  return it == opt.forwarding_mode_by_listen_port.end() ? opt.forwarding_mode : it->second;
+}
+
+struct Components {
+  const Options& opt;
+  Parser& parser;
+  DnsResolver& dns_resolver;
+  Connector& connector;
+  Forwarder& forwarder;
+};
+
+// An incoming connection on its way from accept to forwarding. Every stage moves the same
+// object forward, so the callbacks capture just a pointer to it and don't allocate.
+class Session : public Pooled<Session> {
+ public:
+  Session(const Components& c, int client_fd, Forwarder::Mode mode)
+      : c_(c), client_fd_(client_fd), mode_(mode) {}
+
+  // Deletes `this` when done.
+  void Start() {
+    c_.parser.ParseRequest(client_fd_,
+                           [this](std::string_view host_port) { OnRequest(host_port); });
+  }
+
+ private:
+  // Longer host:port can't be valid: DNS names are at most 253 characters long.
+  static constexpr size_t kMaxHostPortSize = 260;
+
+  void OnRequest(std::string_view host_port) {
+    if (host_port.empty() || !IsAllowedPort(c_.opt, host_port)) return Fail();
+    if (host_port.size() > sizeof(host_port_)) {
+      LOG(WARN) << "[" << client_fd_ << "] host:port too long";
+      return Fail();
+    }
+    std::memcpy(host_port_, host_port.data(), host_port.size());
+    host_port_size_ = host_port.size();
+    if (c_.opt.optimistic_response && !Forwarder::SendResponse(client_fd_)) return Fail();
+    c_.dns_resolver.Resolve(this->host_port(),
+                            [this](const ServerAddrs* addrs) { OnResolved(addrs); });
+  }
+
+  void OnResolved(const ServerAddrs* addrs) {
+    if (!addrs) {
+      LOG(WARN) << "[" << client_fd_ << "] DNS error: " << host_port();
+      return Fail();
+    }
+    LOG(INFO) << "[" << client_fd_ << "] tunnel to " << IpPort(addrs->addrs[0]);
+    c_.connector.Connect(*addrs, client_fd_, [this](int server_fd) { OnConnected(server_fd); });
+  }
+
+  void OnConnected(int server_fd) {
+    if (server_fd < 0) return Fail();
+    c_.forwarder.Forward(client_fd_, server_fd, mode_, !c_.opt.optimistic_response);
+    delete this;
+  }
+
+  void Fail() {
+    CHECK(close(client_fd_) == 0) << Errno();
+    delete this;
+  }
+
+  std::string_view host_port() const { return std::string_view(host_port_, host_port_size_); }
+
+  const Components& c_;
+  const int client_fd_;
+  const Forwarder::Mode mode_;
+  char host_port_[kMaxHostPortSize];
+  size_t host_port_size_ = 0;
+};
+
+void Serve(const Options& opt, Acceptor& acceptor, Parser& parser, DnsResolver& dns_resolver,
+           Connector& connector, Forwarder& forwarder) {
+  const Components c = {opt, parser, dns_resolver, connector, forwarder};
+  while (true) {
+    std::uint16_t listen_port;
+    int client_fd = acceptor.Accept(&listen_port);
+    (new Session(c, client_fd, ForwardingMode(opt, listen_port)))->Start();
+  }
+}
+
+// Starts the admin server if it's enabled.
+void ServeMetrics(const Options& opt, MetricSources src) {
+  if (opt.admin_listen_port == 0) return;
+  new AdminServer(opt, [src = std::move(src)]() { return RenderMetrics(src); });
+}
+
+}  // namespace
+
+void RunProxy(const Options& opt) {
+  signal(SIGPIPE, SIG_IGN);
+
+  if (opt.max_num_open_files > 0) {
+    struct rlimit lim;
+    CHECK(getrlimit(RLIMIT_NOFILE, &lim) == 0) << Errno();
+    lim.rlim_cur = opt.max_num_open_files;
+    // It'll fail if opt.max_num_open_files is greater than lim.rlim_max.
+    CHECK(setrlimit(RLIMIT_NOFILE, &lim) == 0) << Errno();
+  }
+
+  // Probe the kernel and log the results before anything else gets going.
+  GetCaps();
+  InitStats(opt.stats_path);
+
+  if (opt.lock_memory) CHECK(mlockall(MCL_CURRENT | MCL_FUTURE) == 0) << Errno();
+  UsePoolHugePages(opt.huge_pages);
+
+  if (opt.num_workers == 0) {
+    auto& acceptor = *new Acceptor(opt, opt);
+    auto& parser = *new Parser(opt, opt);
+    auto& dns_resolver = *new DnsResolver(opt);
+    auto& connector = *new Connector(opt, opt);
+    auto& forwarder = *new Forwarder(opt, opt);
+    ServeMetrics(opt, {{&acceptor}, &dns_resolver, {&forwarder}});
+    Serve(opt, acceptor, parser, dns_resolver, connector, forwarder);
+  }
+
+  Options worker_opt = opt;
+  worker_opt.listen_reuse_port = true;
+  auto& dns_resolver = *new DnsResolver(opt);
+  MetricSources metric_sources = {{}, &dns_resolver, {}};
+  for (size_t i = 0; i != opt.num_workers; ++i) {
+    // Every handler on the loop has its own timeout, so the default doesn't matter.
+    auto* loop = new EventLoop(opt.read_write_timeout, opt);
+    auto& acceptor = *new Acceptor(worker_opt, opt);
+    auto& parser = *new Parser(opt, opt, loop);
+    auto& connector = *new Connector(opt, opt, loop);
+    auto& forwarder = *new Forwarder(opt, opt, loop);
+    metric_sources.acceptors.push_back(&acceptor);
+    metric_sources.forwarders.push_back(&forwarder);
+    auto* c = new Components{opt, parser, dns_resolver, connector, forwarder};
+    loop->Schedule([c, loop, &acceptor]() {
+      acceptor.Start(loop, [c](int client_fd, std::uint16_t listen_port) {
+        (new Session(*c, client_fd, ForwardingMode(c->opt, listen_port)))->Start();
+      });
+    });
+    if (!opt.worker_cpu_sets.empty()) {
+      loop->Pin(opt.worker_cpu_sets[i % opt.worker_cpu_sets.size()]);
+    }
+  }
+  if (opt.use_io_uring) LOG(WARN) << "io_uring isn't used with num_workers > 0";
+  ServeMetrics(opt, std::move(metric_sources));
+  // The workers run on their own threads.
+  while (true) pause();
+}
+
+}  // namespace hcproxy
@@ -0,0 +1,89 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_PROXY_H_
+#define ROMKATV_HCPROXY_PROXY_H_
+
+#include <sys/resource.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "acceptor.h"
+#include "admin.h"
+#include "connector.h"
+#include "dns.h"
+#include "forwarder.h"
+#include "latency.h"
+#include "parser.h"
+
+namespace hcproxy {
+
+struct Options : Acceptor::Options,
+                 Parser::Options,
+                 DnsResolver::Options,
+                 Connector::Options,
+                 Forwarder::Options,
+                 AdminServer::Options,
+                 LatencyOptions {
+  // Refuse to connect to any port other than these. If empty, allow connections
+  // to any port.
+  std::unordered_set<std::string_view> allowed_ports = {};
+  // Connections accepted on these listening ports (listen_port or any of
+  // extra_listen_ports) are forwarded in the specified mode rather than
+  // forwarding_mode.
+  std::unordered_map<std::uint16_t, Forwarder::Mode> forwarding_mode_by_listen_port = {};
+  // If positive, set the maximum number of open file descriptors (NOFILE)
+  // to this value on startup. The proxy uses 6 file descriptors per client
+  // connection: 2 sockets + 2 pipes (each pipe is 2 file descriptors). In
+  // userspace forwarding mode it's just the 2 sockets.
+  // Idle pipes in forwarder pipe pools count towards the limit, too.
+  // When the open file descriptor limit is reached, the proxy will stop
+  // accepting new connections.
+  rlim_t max_num_open_files = 0;
+  // Lock all current and future memory pages of the process into RAM on startup
+  // so that page faults don't add latency. Usually combined with LatencyOptions.
+  bool lock_memory = false;
+  // Reply with HTTP 200 as soon as the request is parsed instead of waiting until the
+  // connection to the server is established. The client can then send its first bytes
+  // (usually TLS ClientHello) while DNS resolution and connecting are in progress, which
+  // saves a round trip to the server. If resolution or connecting fails, the client
+  // connection is closed after it has already seen the 200 response.
+  bool optimistic_response = false;
+  // Allocate per-connection objects from huge pages.
+  bool huge_pages = false;
+  // Publish counters in a shared memory file at this path. Read them with
+  // hcproxy-stats. If empty, the counters aren't published.
+  std::string stats_path = "/dev/shm/hcproxy-stats";
+  // If positive, run in shared-nothing mode with this many workers. Each worker is a
+  // single thread with its own listening socket (with SO_REUSEPORT) that accepts, parses,
+  // connects and forwards on one event loop. Only DNS lookups that miss the cache leave
+  // the worker thread: they go to the resolver shared by all workers. use_io_uring,
+  // num_forwarder_threads and forwarder_cpu_sets are ignored.
+  size_t num_workers = 0;
+  // If not empty, the thread of worker i is pinned to the CPUs listed in
+  // worker_cpu_sets[i % worker_cpu_sets.size()].
+  std::vector<std::vector<int>> worker_cpu_sets = {};
+};
+
+// Runs the proxy. Never returns.
+void RunProxy(const Options& opt);
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_PROXY_H_
@@ -0,0 +1,142 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "scan.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace hcproxy {
+
+namespace internal_scan {
+
+size_t FindHeaderEndScalar(const char* p, size_t n) {
+  for (size_t i = 0; i + 4 <= n; ++i) {
+    if (std::memcmp(p + i, "\r\n\r\n", 4) == 0) return i;
+  }
+  return n;
+}
+
+size_t FindTokenEndScalar(const char* p, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    if (p[i] == ' ' || p[i] == '\r') return i;
+  }
+  return n;
+}
+
+#if defined(__x86_64__)
+
+namespace {
+
+// Bit j of the result is set iff "\r\n\r\n" starts at p + j. Reads p[0, 19).
+inline unsigned HeaderEndMask16(const char* p) {
+  auto eq = [&](size_t k, char c) {
+    return _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + k)),
+                          _mm_set1_epi8(c));
+  };
+  __m128i m = _mm_and_si128(eq(0, '\r'), eq(1, '\n'));
+  m = _mm_and_si128(m, _mm_and_si128(eq(2, '\r'), eq(3, '\n')));
+  return _mm_movemask_epi8(m);
+}
+
+}  // namespace
+
+size_t FindHeaderEndSse2(const char* p, size_t n) {
+  size_t i = 0;
+  for (; i + 16 + 3 <= n; i += 16) {
+    if (unsigned mask = HeaderEndMask16(p + i)) return i + __builtin_ctz(mask);
+  }
+  size_t res = FindHeaderEndScalar(p + i, n - i);
+  return res == n - i ? n : i + res;
+}
+
+size_t FindTokenEndSse2(const char* p, size_t n) {
+  const __m128i sp = _mm_set1_epi8(' ');
+  const __m128i cr = _mm_set1_epi8('\r');
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, cr));
+    if (unsigned mask = _mm_movemask_epi8(m)) return i + __builtin_ctz(mask);
+  }
+  return i + FindTokenEndScalar(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) size_t FindHeaderEndAvx2(const char* p, size_t n) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 32 + 3 <= n; i += 32) {
+    const __m256i* v = reinterpret_cast<const __m256i*>(p + i);
+    __m256i m = _mm256_cmpeq_epi8(_mm256_loadu_si256(v), cr);
+    v = reinterpret_cast<const __m256i*>(p + i + 1);
+    m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256(v), lf));
+    v = reinterpret_cast<const __m256i*>(p + i + 2);
+    m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256(v), cr));
+    v = reinterpret_cast<const __m256i*>(p + i + 3);
+    m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256(v), lf));
+    if (unsigned mask = _mm256_movemask_epi8(m)) return i + __builtin_ctz(mask);
+  }
+  // The tail is scanned by non-VEX SSE code, which is slow while the upper halves of YMM
+  // registers are dirty. GCC doesn't clear them before the call.
+  _mm256_zeroupper();
+  size_t res = FindHeaderEndSse2(p + i, n - i);
+  return res == n - i ? n : i + res;
+}
+
+__attribute__((target("avx2"))) size_t FindTokenEndAvx2(const char* p, size_t n) {
+  const __m256i sp = _mm256_set1_epi8(' ');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, cr));
+    if (unsigned mask = _mm256_movemask_epi8(m)) return i + __builtin_ctz(mask);
+  }
+  // See FindHeaderEndAvx2().
+  _mm256_zeroupper();
+  return i + FindTokenEndSse2(p + i, n - i);
+}
+
+bool HasAvx2() {
+  static const bool res = __builtin_cpu_supports("avx2");
+  return res;
+}
+
+#endif  // defined(__x86_64__)
+
+}  // namespace internal_scan
+
+size_t FindHeaderEnd(const char* p, size_t n) {
+#if defined(__x86_64__)
+  using namespace internal_scan;
+  return HasAvx2() ? FindHeaderEndAvx2(p, n) : FindHeaderEndSse2(p, n);
+#else
+  return internal_scan::FindHeaderEndScalar(p, n);
+#endif
+}
+
+size_t FindTokenEnd(const char* p, size_t n) {
+#if defined(__x86_64__)
+  using namespace internal_scan;
+  return HasAvx2() ? FindTokenEndAvx2(p, n) : FindTokenEndSse2(p, n);
+#else
+  return internal_scan::FindTokenEndScalar(p, n);
+#endif
+}
+
+}  // namespace hcproxy
@@ -0,0 +1,54 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_SCAN_H_
+#define ROMKATV_HCPROXY_SCAN_H_
+
+#include <cstddef>
+
+namespace hcproxy {
+
+// Vectorized searches used by the request parser. On x86-64 they use AVX2 if the CPU
+// supports it and SSE2 otherwise. The choice is made once on the first call.
+
+// Returns the offset of the first "\r\n\r\n" in [p, p + n) or n if there is none.
+size_t FindHeaderEnd(const char* p, size_t n);
+
+// Returns the offset of the first ' ' or '\r' in [p, p + n) or n if there is none.
+size_t FindTokenEnd(const char* p, size_t n);
+
+namespace internal_scan {
+
+// Implementations between which the functions above choose. Exposed for tests and
+// benchmarks. All variants return the same results.
+
+size_t FindHeaderEndScalar(const char* p, size_t n);
+size_t FindTokenEndScalar(const char* p, size_t n);
+
+#if defined(__x86_64__)
+size_t FindHeaderEndSse2(const char* p, size_t n);
+size_t FindTokenEndSse2(const char* p, size_t n);
+
+// Require HasAvx2().
+size_t FindHeaderEndAvx2(const char* p, size_t n);
+size_t FindTokenEndAvx2(const char* p, size_t n);
+
+bool HasAvx2();
+#endif  // defined(__x86_64__)
+
+}  // namespace internal_scan
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_SCAN_H_
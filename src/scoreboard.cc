@@ -0,0 +1,103 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "scoreboard.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <cstring>
+#include <iterator>
+#include <tuple>
+
+#include "check.h"
+
+namespace hcproxy {
+
+namespace {
+
+// Weight of the latest sample in the moving average of latency is 1 / 2^kEwmaShift.
+constexpr int kEwmaShift = 2;
+
+}  // namespace
+
+ServerIp GetServerIp(const sockaddr& addr) {
+  ServerIp res = {};
+  if (addr.sa_family == AF_INET) {
+    const auto& a = reinterpret_cast<const sockaddr_in&>(addr).sin_addr;
+    std::memcpy(res.data(), &a, sizeof(a));
+  } else {
+    CHECK(addr.sa_family == AF_INET6) << addr.sa_family;
+    const auto& a = reinterpret_cast<const sockaddr_in6&>(addr).sin6_addr;
+    std::memcpy(res.data(), &a, sizeof(a));
+  }
+  return res;
+}
+
+bool Scoreboard::Rank::operator<(const Rank& other) const {
+  return std::tie(broken, failing, latency) <
+         std::tie(other.broken, other.failing, other.latency);
+}
+
+Scoreboard::Rank Scoreboard::GetRank(const ServerIp& ip, Time now) const {
+  auto it = scores_.find(ip);
+  if (it == scores_.end()) return {false, false, 0};
+  const Score& s = it->second;
+  int latency = 0;
+  for (int64_t us = s.latency_us; us > 1; us >>= 1) ++latency;
+  return {s.broken_until > now, s.consecutive_failures > 0, latency};
+}
+
+void Scoreboard::RecordSuccess(const ServerIp& ip, Duration latency, Time now) {
+  Score* s = Get(ip, now);
+  if (!s) return;
+  int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+  if (us <= 0) us = 1;
+  s->latency_us = s->latency_us ? s->latency_us + ((us - s->latency_us) >> kEwmaShift) : us;
+  s->consecutive_failures = 0;
+  s->broken_until = Time();
+}
+
+bool Scoreboard::RecordFailure(const ServerIp& ip, Time now) {
+  Score* s = Get(ip, now);
+  if (!s) return false;
+  ++s->consecutive_failures;
+  if (opt_.circuit_breaker_failures == 0 ||
+      s->consecutive_failures < opt_.circuit_breaker_failures) {
+    return false;
+  }
+  // Every failure past the threshold (such as a failed probe after the cooldown)
+  // opens the breaker again.
+  bool res = s->broken_until <= now;
+  s->broken_until = now + opt_.circuit_breaker_cooldown;
+  return res;
+}
+
+Scoreboard::Score* Scoreboard::Get(const ServerIp& ip, Time now) {
+  auto it = scores_.find(ip);
+  if (it == scores_.end()) {
+    if (scores_.size() >= opt_.scoreboard_size) {
+      for (auto i = scores_.begin(); i != scores_.end();) {
+        bool expired = i->second.updated_at + opt_.scoreboard_ttl <= now &&
+                       i->second.broken_until <= now;
+        i = expired ? scores_.erase(i) : std::next(i);
+      }
+      if (scores_.size() >= opt_.scoreboard_size) return nullptr;
+    }
+    it = scores_.emplace(ip, Score()).first;
+  }
+  it->second.updated_at = now;
+  return &it->second;
+}
+
+}  // namespace hcproxy
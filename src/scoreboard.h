@@ -0,0 +1,102 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_SCOREBOARD_H_
+#define ROMKATV_HCPROXY_SCOREBOARD_H_
+
+#include <sys/socket.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <unordered_map>
+
+#include "time.h"
+
+namespace hcproxy {
+
+// Raw IP address of a server. IPv4 addresses take the first 4 bytes; the rest is zero.
+using ServerIp = std::array<char, 16>;
+
+struct ServerIpHash {
+  size_t operator()(const ServerIp& ip) const {
+    return std::hash<std::string_view>()(std::string_view(ip.data(), ip.size()));
+  }
+};
+
+// Requires AF_INET or AF_INET6.
+ServerIp GetServerIp(const sockaddr& addr);
+
+// Connection outcomes per server IP.
+//
+// Thread-compatible. NOT thread-safe.
+class Scoreboard {
+ public:
+  struct Options {
+    // After this many consecutive failures to connect to an IP, it's considered broken
+    // for circuit_breaker_cooldown. Zero means never.
+    size_t circuit_breaker_failures = 3;
+    Duration circuit_breaker_cooldown = std::chrono::seconds(30);
+    // Forget IPs that haven't been connected to for this long.
+    Duration scoreboard_ttl = std::chrono::minutes(10);
+    // Keep track of at most this many IPs. When full, outcomes for new IPs aren't
+    // recorded until old entries expire.
+    size_t scoreboard_size = 16384;
+  };
+
+  // Addresses with lower rank should be tried first.
+  struct Rank {
+    // The circuit breaker is open.
+    bool broken;
+    // The last attempt has failed.
+    bool failing;
+    // Log2 of the average connect latency in microseconds. Zero if unknown. IPs whose
+    // latencies are within a factor of two of each other get the same value, so
+    // address selection doesn't herd all connections to the single fastest one.
+    int latency;
+
+    bool operator<(const Rank& other) const;
+  };
+
+  explicit Scoreboard(const Options& opt) : opt_(opt) {}
+  Scoreboard(Scoreboard&&) = delete;
+
+  Rank GetRank(const ServerIp& ip, Time now) const;
+
+  void RecordSuccess(const ServerIp& ip, Duration latency, Time now);
+
+  // Returns true if the circuit breaker has opened.
+  bool RecordFailure(const ServerIp& ip, Time now);
+
+ private:
+  struct Score {
+    // Exponentially weighted moving average of connect latency. Zero if unknown.
+    int64_t latency_us = 0;
+    size_t consecutive_failures = 0;
+    // The circuit breaker is open until this time.
+    Time broken_until;
+    Time updated_at;
+  };
+
+  // Returns null if the scoreboard is full.
+  Score* Get(const ServerIp& ip, Time now);
+
+  const Options opt_;
+  std::unordered_map<ServerIp, Score, ServerIpHash> scores_;
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_SCOREBOARD_H_
@@ -0,0 +1,58 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "slab.h"
+
+#include <sys/mman.h>
+
+#include "check.h"
+
+namespace hcproxy {
+
+SlabAllocator::SlabAllocator(size_t chunk_size, size_t chunks_per_slab)
+    : chunk_size_((chunk_size + alignof(FreeChunk) - 1) / alignof(FreeChunk) * alignof(FreeChunk)),
+      chunks_per_slab_(chunks_per_slab) {
+  CHECK(chunk_size_ >= sizeof(FreeChunk));
+  CHECK(chunks_per_slab_ > 0);
+}
+
+SlabAllocator::~SlabAllocator() {
+  for (void* slab : slabs_) CHECK(munmap(slab, chunk_size_ * chunks_per_slab_) == 0) << Errno();
+}
+
+char* SlabAllocator::Allocate() {
+  if (!free_) {
+    const size_t size = chunk_size_ * chunks_per_slab_;
+    void* slab = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(slab != MAP_FAILED) << Errno();
+    slabs_.push_back(slab);
+    for (size_t i = chunks_per_slab_; i != 0; --i) {
+      auto* chunk = reinterpret_cast<FreeChunk*>(static_cast<char*>(slab) + (i - 1) * chunk_size_);
+      chunk->next = free_;
+      free_ = chunk;
+    }
+  }
+  FreeChunk* res = free_;
+  free_ = res->next;
+  return reinterpret_cast<char*>(res);
+}
+
+void SlabAllocator::Free(char* p) {
+  CHECK(p);
+  auto* chunk = reinterpret_cast<FreeChunk*>(p);
+  chunk->next = free_;
+  free_ = chunk;
+}
+
+}  // namespace hcproxy
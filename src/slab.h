@@ -0,0 +1,55 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_SLAB_H_
+#define ROMKATV_HCPROXY_SLAB_H_
+
+#include <stddef.h>
+#include <vector>
+
+namespace hcproxy {
+
+// Allocator of fixed-size memory chunks. Memory is obtained from the system in slabs
+// of many chunks and returned only on destruction.
+//
+// Thread-compatible. NOT thread-safe.
+class SlabAllocator {
+ public:
+  SlabAllocator(size_t chunk_size, size_t chunks_per_slab);
+  SlabAllocator(SlabAllocator&&) = delete;
+  // All chunks become invalid.
+  ~SlabAllocator();
+
+  size_t chunk_size() const { return chunk_size_; }
+
+  // Never returns null.
+  char* Allocate();
+
+  // `p` must have been returned by Allocate().
+  void Free(char* p);
+
+ private:
+  struct FreeChunk {
+    FreeChunk* next;
+  };
+
+  const size_t chunk_size_;
+  const size_t chunks_per_slab_;
+  FreeChunk* free_ = nullptr;
+  std::vector<void*> slabs_;
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_SLAB_H_
@@ -0,0 +1,150 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stats.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <memory>
+#include <new>
+
+#include "check.h"
+#include "logging.h"
+
+namespace hcproxy {
+
+using internal_stats::Segment;
+using internal_stats::Slot;
+
+namespace {
+
+std::string* g_path = nullptr;
+
+// Returns a shared mapping of the file or null on error.
+void* MapFile(const std::string& path) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG(WARN) << "Unable to create " << path << ": " << Errno();
+    return nullptr;
+  }
+  void* res = nullptr;
+  if (ftruncate(fd, sizeof(Segment)) != 0) {
+    LOG(WARN) << "Unable to resize " << path << ": " << Errno();
+  } else {
+    res = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (res == MAP_FAILED) {
+      LOG(WARN) << "Unable to map " << path << ": " << Errno();
+      res = nullptr;
+    }
+  }
+  CHECK(close(fd) == 0) << Errno();
+  return res;
+}
+
+Segment* NewSegment() {
+  void* mem = g_path && !g_path->empty() ? MapFile(*g_path) : nullptr;
+  if (mem) {
+    LOG(INFO) << "Publishing stats in " << *g_path;
+  } else {
+    mem = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+    CHECK(mem != MAP_FAILED) << Errno();
+  }
+  // The memory is zeroed.
+  auto* segment = new (mem) Segment;
+  segment->header.magic = internal_stats::kMagic;
+  segment->header.version = internal_stats::kVersion;
+  segment->header.num_counters = kNumCounters;
+  segment->header.num_histograms = kNumHistograms;
+  segment->header.histogram_buckets = kHistogramBuckets;
+  segment->header.max_threads = internal_stats::kMaxThreads;
+  return segment;
+}
+
+Segment& GetSegment() {
+  static Segment* segment = NewSegment();
+  return *segment;
+}
+
+Slot* NewSlot() {
+  Segment& segment = GetSegment();
+  std::uint32_t idx = segment.header.num_threads.fetch_add(1, std::memory_order_relaxed);
+  Slot* slot;
+  if (idx < internal_stats::kMaxThreads) {
+    slot = &segment.slots[idx];
+  } else {
+    LOG(WARN) << "Too many threads; stats of this thread won't be published";
+    slot = new Slot();
+  }
+  slot->tid = gettid();
+  return slot;
+}
+
+// Adds `n` to every value. All values must be in the slot of the current thread.
+template <size_t N>
+void Add(Slot* slot, std::uint64_t* const (&values)[N], const std::uint64_t (&n)[N]) {
+  // These compile to plain stores. The fence prevents the compiler and the CPU from
+  // reordering value stores before the first seq store.
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i != N; ++i) __atomic_store_n(values[i], *values[i] + n[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+Slot* MySlot() {
+  static thread_local Slot* slot = NewSlot();
+  return slot;
+}
+
+}  // namespace
+
+void InitStats(const std::string& path) {
+  CHECK(!g_path);
+  g_path = new std::string(path);
+  GetSegment();
+}
+
+void Count(Counter c, std::uint64_t n) {
+  Slot* slot = MySlot();
+  Add(slot, {&slot->data.counters[static_cast<size_t>(c)]}, {n});
+}
+
+void Record(Histogram h, std::chrono::nanoseconds d) {
+  std::uint64_t micros = d.count() > 0 ? d.count() / 1000 : 0;
+  Slot* slot = MySlot();
+  size_t idx = static_cast<size_t>(h);
+  Add(slot,
+      {&slot->data.histograms[idx][HistogramBucket(micros)], &slot->data.histogram_sums[idx]},
+      {1, micros});
+}
+
+void ReadStats(StatsSnapshot* res) {
+  constexpr size_t kWords = sizeof(StatsSnapshot) / sizeof(std::uint64_t);
+  const Segment& segment = GetSegment();
+  std::uint32_t num_threads = segment.header.num_threads.load(std::memory_order_relaxed);
+  if (num_threads > internal_stats::kMaxThreads) num_threads = internal_stats::kMaxThreads;
+  *res = {};
+  auto* dst = reinterpret_cast<std::uint64_t*>(res);
+  auto slot = std::make_unique<StatsSnapshot>();
+  for (std::uint32_t t = 0; t != num_threads; ++t) {
+    internal_stats::ReadSlot(segment.slots[t], slot.get());
+    const auto* src = reinterpret_cast<const std::uint64_t*>(slot.get());
+    for (size_t i = 0; i != kWords; ++i) dst[i] += src[i];
+  }
+}
+
+}  // namespace hcproxy
@@ -0,0 +1,247 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_STATS_H_
+#define ROMKATV_HCPROXY_STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Counters and latency histograms published in a shared memory segment.
+//
+// Every thread that bumps a counter or records a latency gets its own slot in the segment
+// and is the only writer of that slot. Writes are plain stores wrapped in a seqlock: no atomic
+// read-modify-write operations, no locks and no shared cache lines. Readers (see
+// tools/hcproxy-stats.cc) sum up all slots.
+//
+// This header is shared with the reader and must stay self-contained.
+
+namespace hcproxy {
+
+enum class Counter : std::uint32_t {
+  kAccepted,
+  kAcceptErrors,
+  kParsed,
+  kParseErrors,
+  kParseTimeouts,
+  kResolved,
+  kResolveErrors,
+  kDnsLookups,
+  kDnsLookupErrors,
+  kConnected,
+  kConnectErrors,
+  kConnectTimeouts,
+  kTcpFastOpenAccepted,
+  kTcpFastOpenRejected,
+  kTcpFastOpenFailed,
+  kCircuitBreakerTrips,
+  kTunnelsOpened,
+  kTunnelsClosed,
+  kBytesClientToServer,
+  kBytesServerToClient,
+  kForwardTimeouts,
+  kForwardErrors,
+  // Pipes taken from a pipe pool and created because the pool was empty.
+  kPipePoolHits,
+  kPipePoolMisses,
+  // Pipes put into and taken out of pipe pools, including closed idle pipes. The
+  // difference is the number of pipes in all pools.
+  kPipesPooled,
+  kPipesUnpooled,
+  kNumCounters,
+};
+
+constexpr size_t kNumCounters = static_cast<size_t>(Counter::kNumCounters);
+
+constexpr const char* kCounterNames[kNumCounters] = {
+    "accepted",
+    "accept_errors",
+    "parsed",
+    "parse_errors",
+    "parse_timeouts",
+    "resolved",
+    "resolve_errors",
+    "dns_lookups",
+    "dns_lookup_errors",
+    "connected",
+    "connect_errors",
+    "connect_timeouts",
+    "tcp_fastopen_accepted",
+    "tcp_fastopen_rejected",
+    "tcp_fastopen_failed",
+    "circuit_breaker_trips",
+    "tunnels_opened",
+    "tunnels_closed",
+    "bytes_client_to_server",
+    "bytes_server_to_client",
+    "forward_timeouts",
+    "forward_errors",
+    "pipe_pool_hits",
+    "pipe_pool_misses",
+    "pipes_pooled",
+    "pipes_unpooled",
+};
+
+// Latencies of connection setup stages.
+enum class Histogram : std::uint32_t {
+  // From accept to a fully parsed request.
+  kParse,
+  // From a parsed request to a DNS answer when the answer comes from the cache.
+  kDnsHit,
+  // From a parsed request to a DNS answer when the answer requires a lookup.
+  kDnsMiss,
+  // From a DNS answer to an established connection to the server, by the address family
+  // of the connection that won the race.
+  kConnectIpv4,
+  kConnectIpv6,
+  // From an established connection to the first byte forwarded through the tunnel.
+  kFirstByte,
+  kNumHistograms,
+};
+
+constexpr size_t kNumHistograms = static_cast<size_t>(Histogram::kNumHistograms);
+
+constexpr const char* kHistogramNames[kNumHistograms] = {
+    "parse",
+    "dns_hit",
+    "dns_miss",
+    "connect_ipv4",
+    "connect_ipv6",
+    "first_byte",
+};
+
+// Histograms are log-linear, as in HdrHistogram. Values are in microseconds. Every power
+// of two range is split into 2^kHistogramSubBucketBits buckets, so the relative error is
+// at most 12.5%. Values from 2^kHistogramMaxBits microseconds (over an hour) up go to the
+// last bucket.
+constexpr size_t kHistogramSubBucketBits = 3;
+constexpr size_t kHistogramMaxBits = 32;
+constexpr size_t kHistogramBuckets =
+    (kHistogramMaxBits - kHistogramSubBucketBits + 1) << kHistogramSubBucketBits;
+
+// Returns the index of the bucket for a value in microseconds.
+inline size_t HistogramBucket(std::uint64_t micros) {
+  constexpr std::uint64_t kSub = std::uint64_t{1} << kHistogramSubBucketBits;
+  constexpr std::uint64_t kMax = (std::uint64_t{1} << kHistogramMaxBits) - 1;
+  if (micros > kMax) micros = kMax;
+  if (micros < kSub) return micros;
+  size_t shift = 63 - __builtin_clzll(micros) - kHistogramSubBucketBits;
+  return ((shift + 1) << kHistogramSubBucketBits) + ((micros >> shift) & (kSub - 1));
+}
+
+// Returns the smallest value in microseconds that is greater than all values in the
+// bucket.
+inline std::uint64_t HistogramBucketLimit(size_t bucket) {
+  constexpr size_t kSub = size_t{1} << kHistogramSubBucketBits;
+  if (bucket < kSub) return bucket + 1;
+  size_t shift = (bucket >> kHistogramSubBucketBits) - 1;
+  return (kSub + bucket % kSub + 1) << shift;
+}
+
+// Counter values and histograms.
+struct StatsSnapshot {
+  std::uint64_t counters[kNumCounters];
+  std::uint64_t histograms[kNumHistograms][kHistogramBuckets];
+  // The sum of all values recorded in the histogram, in microseconds.
+  std::uint64_t histogram_sums[kNumHistograms];
+};
+
+// Returns the value in microseconds below which the specified fraction of recorded
+// latencies fall, rounded up to the bucket limit. Returns zero if the histogram is empty.
+inline std::uint64_t HistogramQuantile(const std::uint64_t (&buckets)[kHistogramBuckets],
+                                       double q) {
+  std::uint64_t total = 0;
+  for (std::uint64_t n : buckets) total += n;
+  if (total == 0) return 0;
+  std::uint64_t rank = q * total;
+  if (rank < 1) rank = 1;
+  if (rank > total) rank = total;
+  std::uint64_t sum = 0;
+  for (size_t i = 0; i != kHistogramBuckets; ++i) {
+    sum += buckets[i];
+    if (sum >= rank) return HistogramBucketLimit(i);
+  }
+  return HistogramBucketLimit(kHistogramBuckets - 1);
+}
+
+namespace internal_stats {
+
+constexpr std::uint64_t kMagic = 0x5354415458504348;  // "HCPXTATS"
+// Bump when the layout of Segment changes.
+constexpr std::uint32_t kVersion = 2;
+constexpr size_t kMaxThreads = 256;
+constexpr size_t kCacheLineSize = 64;
+
+struct Header {
+  std::uint64_t magic;
+  std::uint32_t version;
+  std::uint32_t num_counters;
+  std::uint32_t num_histograms;
+  std::uint32_t histogram_buckets;
+  std::uint32_t max_threads;
+  // The number of slots handed out to threads. Can exceed max_threads; extra threads
+  // don't publish their counters.
+  std::atomic<std::uint32_t> num_threads;
+};
+
+// Written by a single thread. The value of `seq` is odd while a write is in progress.
+struct alignas(kCacheLineSize) Slot {
+  std::uint64_t seq;
+  std::int32_t tid;
+  StatsSnapshot data;
+};
+
+struct Segment {
+  alignas(kCacheLineSize) Header header;
+  Slot slots[kMaxThreads];
+};
+
+// Reads a consistent snapshot of the slot. Can be called from any thread or process.
+inline void ReadSlot(const Slot& slot, StatsSnapshot* data) {
+  constexpr size_t kWords = sizeof(StatsSnapshot) / sizeof(std::uint64_t);
+  const auto* src = reinterpret_cast<const std::uint64_t*>(&slot.data);
+  auto* dst = reinterpret_cast<std::uint64_t*>(data);
+  while (true) {
+    std::uint64_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+    if (seq % 2 == 0) {
+      for (size_t i = 0; i != kWords; ++i) dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (__atomic_load_n(&slot.seq, __ATOMIC_RELAXED) == seq) return;
+    }
+  }
+}
+
+}  // namespace internal_stats
+
+// Creates the stats segment at the specified path, usually under /dev/shm. If `path` is
+// empty or the file cannot be created, counters are kept in private memory. Must be
+// called before any counters are bumped, if at all.
+void InitStats(const std::string& path);
+
+// Adds `n` to the specified counter of the current thread.
+void Count(Counter c, std::uint64_t n = 1);
+
+// Adds `d` to the specified histogram of the current thread.
+void Record(Histogram h, std::chrono::nanoseconds d);
+
+// Stores the sums of counters and histograms over all published threads in `res`. Can
+// be called from any thread.
+void ReadStats(StatsSnapshot* res);
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_STATS_H_
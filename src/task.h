@@ -0,0 +1,118 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_TASK_H_
+#define ROMKATV_HCPROXY_TASK_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "check.h"
+
+namespace hcproxy {
+
+// A move-only `void()` callable, like std::function<void()> but with room for 64 bytes
+// of captures inline. Smaller callables don't allocate.
+class Task {
+ public:
+  Task() = default;
+
+  template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+  Task(F&& f) {
+    using T = std::decay_t<F>;
+    if constexpr (kIsInline<T>) {
+      new (buf_) T(std::forward<F>(f));
+      ops_ = &InlineOps<T>::kOps;
+    } else {
+      *reinterpret_cast<T**>(buf_) = new T(std::forward<F>(f));
+      ops_ = &HeapOps<T>::kOps;
+    }
+  }
+
+  Task(Task&& other) { MoveFrom(other); }
+
+  Task& operator=(Task&& other) {
+    if (this != &other) {
+      Reset();
+      MoveFrom(other);
+    }
+    return *this;
+  }
+
+  ~Task() { Reset(); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  void operator()() {
+    CHECK(ops_);
+    ops_->invoke(buf_);
+  }
+
+  void Reset() {
+    if (ops_) {
+      ops_->destroy(buf_);
+      ops_ = nullptr;
+    }
+  }
+
+ private:
+  static constexpr size_t kInlineSize = 64;
+
+  struct Ops {
+    void (*invoke)(void* f);
+    // Moves `from` to uninitialized `to` and destroys `from`.
+    void (*relocate)(void* from, void* to);
+    void (*destroy)(void* f);
+  };
+
+  template <class T>
+  static constexpr bool kIsInline = sizeof(T) <= kInlineSize &&
+                                    alignof(T) <= alignof(std::max_align_t) &&
+                                    std::is_nothrow_move_constructible_v<T>;
+
+  template <class T>
+  struct InlineOps {
+    static void Invoke(void* f) { (*static_cast<T*>(f))(); }
+    static void Relocate(void* from, void* to) {
+      new (to) T(std::move(*static_cast<T*>(from)));
+      static_cast<T*>(from)->~T();
+    }
+    static void Destroy(void* f) { static_cast<T*>(f)->~T(); }
+    static constexpr Ops kOps = {&Invoke, &Relocate, &Destroy};
+  };
+
+  template <class T>
+  struct HeapOps {
+    static void Invoke(void* f) { (**static_cast<T**>(f))(); }
+    static void Relocate(void* from, void* to) { *static_cast<T**>(to) = *static_cast<T**>(from); }
+    static void Destroy(void* f) { delete *static_cast<T**>(f); }
+    static constexpr Ops kOps = {&Invoke, &Relocate, &Destroy};
+  };
+
+  void MoveFrom(Task& other) {
+    if (other.ops_) {
+      other.ops_->relocate(other.buf_, buf_);
+      ops_ = std::exchange(other.ops_, nullptr);
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char buf_[kInlineSize];
+  const Ops* ops_ = nullptr;
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_TASK_H_
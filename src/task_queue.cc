@@ -0,0 +1,74 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "task_queue.h"
+
+#include <utility>
+
+#include "check.h"
+#include "pool.h"
+
+namespace hcproxy {
+
+namespace internal_task_queue {
+
+struct Node : Pooled<Node> {
+  Node* next = nullptr;
+  Task task;
+};
+
+}  // namespace internal_task_queue
+
+namespace {
+
+using internal_task_queue::Node;
+
+// Returns the previous head of the stack. The node may already be gone by then.
+Node* PushNode(std::atomic<Node*>& stack, Node* node) {
+  Node* head = stack.load(std::memory_order_relaxed);
+  do {
+    node->next = head;
+  } while (!stack.compare_exchange_weak(head, node, std::memory_order_release,
+                                        std::memory_order_relaxed));
+  return head;
+}
+
+}  // namespace
+
+bool TaskQueue::Push(Task task) {
+  CHECK(task);
+  auto* node = new Node;
+  node->task = std::move(task);
+  return PushNode(head_, node) == nullptr;
+}
+
+void TaskQueue::RunAll() {
+  Node* node = head_.exchange(nullptr, std::memory_order_acquire);
+  // The stack is in LIFO order. Reverse it.
+  Node* fifo = nullptr;
+  while (node) {
+    Node* next = node->next;
+    node->next = fifo;
+    fifo = node;
+    node = next;
+  }
+  while (fifo) {
+    Node* next = fifo->next;
+    fifo->task();
+    delete fifo;
+    fifo = next;
+  }
+}
+
+}  // namespace hcproxy
@@ -0,0 +1,54 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_TASK_QUEUE_H_
+#define ROMKATV_HCPROXY_TASK_QUEUE_H_
+
+#include <atomic>
+
+#include "task.h"
+
+namespace hcproxy {
+
+namespace internal_task_queue {
+
+struct Node;
+
+}  // namespace internal_task_queue
+
+// Lock-free multi-producer single-consumer queue of tasks.
+//
+// Producers push onto an intrusive stack with a single CAS. The consumer takes the whole
+// stack with one exchange and runs it in FIFO order. Queue nodes are pooled, so in steady
+// state pushing doesn't allocate.
+class TaskQueue {
+ public:
+  TaskQueue() = default;
+  TaskQueue(TaskQueue&&) = delete;
+
+  // Can be called from any thread. Returns true if the queue was empty, in which case the
+  // consumer needs to be woken up.
+  bool Push(Task task);
+
+  // Runs all tasks that are in the queue. Tasks pushed while they are running are left for
+  // the next call. Can be called only from one thread at a time.
+  void RunAll();
+
+ private:
+  std::atomic<internal_task_queue::Node*> head_{nullptr};
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_TASK_QUEUE_H_
@@ -47,6 +47,11 @@ void ThreadPool::Schedule(Time t, std::function<void()> f) {
   if (wake) wake->notify_one();
 }
 
+size_t ThreadPool::queue_size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return work_.size();
+}
+
 void ThreadPool::Loop(size_t tid) {
   auto Next = [&]() -> std::function<void()> {
     std::unique_lock<std::mutex> lock(mutex_);
@@ -43,6 +43,10 @@ class ThreadPool {
   // Does not block.
   void Schedule(Time t, std::function<void()> f);
 
+  // Returns the number of functions that haven't started running yet, including
+  // those scheduled for the future. Can be called from any thread.
+  size_t queue_size();
+
  private:
   struct Work {
     bool operator<(const Work& w) const { return std::tie(w.t, w.idx) < std::tie(t, idx); }
@@ -0,0 +1,153 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "check.h"
+
+namespace hcproxy {
+
+namespace {
+
+using std::chrono::milliseconds;
+
+// Rotates bits to the right.
+std::uint64_t RotR(std::uint64_t x, int n) { return n ? x >> n | x << (64 - n) : x; }
+
+}  // namespace
+
+std::uint64_t TimerWheel::CeilTick(Time t) const {
+  return t <= start_ ? 0 : std::chrono::ceil<milliseconds>(t - start_).count();
+}
+
+std::uint64_t TimerWheel::FloorTick(Time t) const {
+  return t <= start_ ? 0 : std::chrono::floor<milliseconds>(t - start_).count();
+}
+
+void TimerWheel::Add(TimerEntry* e, Time deadline) {
+  CHECK(e);
+  const std::uint64_t tick = std::max(CeilTick(deadline), now_tick_ + 1);
+  // Handlers are refreshed on every event, often many times per tick.
+  if (e->scheduled() && e->level_ != kNumLevels && e->tick_ == tick) return;
+  Remove(e);
+  e->tick_ = tick;
+  Place(e);
+}
+
+void TimerWheel::Remove(TimerEntry* e) {
+  CHECK(e);
+  if (!e->scheduled()) return;
+  if (e->level_ == kNumLevels) {
+    expired_.Erase(e);
+  } else {
+    List& slot = slots_[e->level_][e->slot_];
+    slot.Erase(e);
+    if (!slot.head()) occupied_[e->level_] &= ~(std::uint64_t{1} << e->slot_);
+    --size_[e->level_];
+  }
+  e->level_ = -1;
+}
+
+void TimerWheel::Place(TimerEntry* e) {
+  CHECK(!e->scheduled());
+  if (e->tick_ <= now_tick_) {
+    e->level_ = kNumLevels;
+    expired_.AddTail(e);
+    return;
+  }
+  // The lowest level whose current slot covers the tick. Slots of lower levels are
+  // spread out before their ticks come.
+  const std::uint64_t diff = e->tick_ ^ now_tick_;
+  int level = 0;
+  while (level != kNumLevels - 1 && diff >> (kSlotBits * (level + 1))) ++level;
+  int slot = SlotIndex(e->tick_, level);
+  if (level == kNumLevels - 1) {
+    // Top-level slots wrap around. If the tick is a full round or more ahead, park the
+    // entry in the slot that comes up last.
+    const int shift = kSlotBits * level;
+    if ((e->tick_ >> shift) - (now_tick_ >> shift) >= kNumSlots) {
+      slot = (SlotIndex(now_tick_, level) + kNumSlots - 1) % kNumSlots;
+    }
+  }
+  e->level_ = level;
+  e->slot_ = slot;
+  slots_[level][slot].AddTail(e);
+  occupied_[level] |= std::uint64_t{1} << slot;
+  ++size_[level];
+}
+
+void TimerWheel::Cascade(int level) {
+  List& slot = slots_[level][SlotIndex(now_tick_, level)];
+  while (Node* node = slot.head()) {
+    auto* e = static_cast<TimerEntry*>(node);
+    Remove(e);
+    Place(e);
+  }
+}
+
+void TimerWheel::Advance(Time now) {
+  const std::uint64_t target = FloorTick(now);
+  while (now_tick_ < target) {
+    if (size_[0] == 0) {
+      size_t total = 0;
+      for (size_t n : size_) total += n;
+      if (total == 0) {
+        now_tick_ = target;
+        break;
+      }
+      // Nothing can expire before the next round of level 0.
+      now_tick_ = std::min(target, now_tick_ | (kNumSlots - 1));
+      if (now_tick_ == target) break;
+    }
+    ++now_tick_;
+    for (int level = kNumLevels - 1; level != 0; --level) {
+      if ((now_tick_ & ((std::uint64_t{1} << (kSlotBits * level)) - 1)) == 0) Cascade(level);
+    }
+    List& slot = slots_[0][SlotIndex(now_tick_, 0)];
+    while (Node* node = slot.head()) {
+      auto* e = static_cast<TimerEntry*>(node);
+      Remove(e);
+      Place(e);
+    }
+  }
+}
+
+TimerEntry* TimerWheel::PopExpired() {
+  Node* node = expired_.head();
+  if (!node) return nullptr;
+  auto* e = static_cast<TimerEntry*>(node);
+  Remove(e);
+  return e;
+}
+
+std::optional<Time> TimerWheel::NextEvent() const {
+  if (expired_.head()) return start_ + milliseconds(now_tick_);
+  std::optional<std::uint64_t> res;
+  for (int level = 0; level != kNumLevels; ++level) {
+    if (!occupied_[level]) continue;
+    // The number of slots between the current one and the next occupied one.
+    const int cur = SlotIndex(now_tick_, level);
+    const int k = __builtin_ctzll(RotR(occupied_[level], (cur + 1) % kNumSlots)) + 1;
+    // The tick at which the slot expires (level 0) or cascades (other levels).
+    std::uint64_t tick = ((now_tick_ >> (kSlotBits * level)) + k) << (kSlotBits * level);
+    if (!res || tick < *res) res = tick;
+  }
+  if (!res) return std::nullopt;
+  return start_ + milliseconds(*res);
+}
+
+}  // namespace hcproxy
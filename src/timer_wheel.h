@@ -0,0 +1,105 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_TIMER_WHEEL_H_
+#define ROMKATV_HCPROXY_TIMER_WHEEL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "list.h"
+#include "time.h"
+
+namespace hcproxy {
+
+class TimerWheel;
+
+class TimerEntry : private Node {
+ public:
+  // True iff the entry is in a wheel.
+  bool scheduled() const { return level_ >= 0; }
+
+ private:
+  friend class TimerWheel;
+
+  // The tick at which the entry expires.
+  std::uint64_t tick_ = 0;
+  // Position in the wheel. Level kNumLevels means the list of expired entries.
+  int level_ = -1;
+  int slot_ = 0;
+};
+
+// Hierarchical timing wheel with 1ms resolution. Adding, removing and expiring an entry
+// are O(1). Entries never expire early but may expire up to 1ms late.
+//
+// There are kNumLevels levels of kNumSlots slots. A slot of level L covers kNumSlots^L
+// ticks. Entries that expire a full round of the top level (~4.6 hours) or more into
+// the future are parked in the last slot and placed again when it comes up.
+//
+// Thread-compatible. NOT thread-safe.
+class TimerWheel {
+ public:
+  explicit TimerWheel(Time now) : start_(now) {}
+  TimerWheel(TimerWheel&&) = delete;
+
+  // Makes the entry expire at `deadline` or a bit later. If it's already in the wheel,
+  // it's moved.
+  void Add(TimerEntry* e, Time deadline);
+
+  // Removes the entry from the wheel. Does nothing if it's not there.
+  void Remove(TimerEntry* e);
+
+  // Moves the current time of the wheel forward.
+  void Advance(Time now);
+
+  // Returns an entry that has expired at or before the time passed to Advance() and
+  // removes it from the wheel. Returns null if there are no such entries.
+  TimerEntry* PopExpired();
+
+  // Returns the earliest time when Advance() may have to do work, or nullopt if the
+  // wheel is empty. This is the expiration time of the earliest entry or the time when
+  // an upper-level slot with the earliest entry gets spread over the lower levels.
+  std::optional<Time> NextEvent() const;
+
+ private:
+  static constexpr int kSlotBits = 6;
+  static constexpr int kNumSlots = 1 << kSlotBits;
+  static constexpr int kNumLevels = 4;
+
+  static std::uint64_t SlotIndex(std::uint64_t tick, int level) {
+    return (tick >> (kSlotBits * level)) & (kNumSlots - 1);
+  }
+
+  // Returns the first tick at or after `t`.
+  std::uint64_t CeilTick(Time t) const;
+  // Returns the last tick at or before `t`.
+  std::uint64_t FloorTick(Time t) const;
+  void Place(TimerEntry* e);
+  void Cascade(int level);
+
+  const Time start_;
+  // All ticks up to and including this one have been processed.
+  std::uint64_t now_tick_ = 0;
+  // The number of entries in each level.
+  size_t size_[kNumLevels] = {};
+  // Bit i is set iff slot i is not empty.
+  std::uint64_t occupied_[kNumLevels] = {};
+  List slots_[kNumLevels][kNumSlots];
+  List expired_;
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_TIMER_WHEEL_H_
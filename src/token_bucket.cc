@@ -0,0 +1,59 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "token_bucket.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "check.h"
+
+namespace hcproxy {
+
+TokenBucket::TokenBucket(const RateLimit& limit)
+    : rate_(limit.bytes_per_sec),
+      burst_(limit.burst_bytes ? limit.burst_bytes : limit.bytes_per_sec),
+      tokens_(burst_),
+      last_refill_(Clock::now()) {
+  CHECK(limit.bytes_per_sec > 0);
+}
+
+std::int64_t TokenBucket::Available(Time now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Refill(now);
+  return std::floor(tokens_);
+}
+
+void TokenBucket::Consume(std::int64_t n) {
+  CHECK(n >= 0);
+  std::lock_guard<std::mutex> lock(mutex_);
+  tokens_ -= n;
+}
+
+Duration TokenBucket::TimeUntil(std::int64_t n, Time now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Refill(now);
+  double deficit = std::min<double>(n, burst_) - tokens_;
+  if (deficit <= 0) return Duration::zero();
+  return std::chrono::ceil<Duration>(std::chrono::duration<double>(deficit / rate_));
+}
+
+void TokenBucket::Refill(Time now) {
+  if (now <= last_refill_) return;
+  double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+  tokens_ = std::min(burst_, tokens_ + rate_ * elapsed);
+  last_refill_ = now;
+}
+
+}  // namespace hcproxy
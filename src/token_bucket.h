@@ -0,0 +1,68 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_TOKEN_BUCKET_H_
+#define ROMKATV_HCPROXY_TOKEN_BUCKET_H_
+
+#include <cstdint>
+#include <mutex>
+
+#include "time.h"
+
+namespace hcproxy {
+
+// Bandwidth limit: at most `bytes_per_sec` on average with bursts of up to
+// `burst_bytes`. Zero `bytes_per_sec` means unlimited. Zero `burst_bytes` means
+// one second worth of traffic.
+struct RateLimit {
+  std::uint64_t bytes_per_sec = 0;
+  std::uint64_t burst_bytes = 0;
+};
+
+// A token bucket. Tokens are bytes.
+//
+// Thread-safe.
+class TokenBucket {
+ public:
+  // The bucket starts full. Requires positive limit.bytes_per_sec.
+  explicit TokenBucket(const RateLimit& limit);
+  TokenBucket(TokenBucket&&) = delete;
+
+  std::int64_t burst() const { return burst_; }
+
+  // Returns the number of tokens available at `now`. Can be negative if more tokens
+  // have been consumed than there were available.
+  std::int64_t Available(Time now);
+
+  // Takes `n` tokens from the bucket. The balance may go negative, in which case
+  // it'll take a while before the bucket has tokens again.
+  void Consume(std::int64_t n);
+
+  // Returns the time it takes for the bucket to have `n` tokens, assuming no one
+  // consumes them in the meantime. `n` is capped at the burst size.
+  Duration TimeUntil(std::int64_t n, Time now);
+
+ private:
+  void Refill(Time now);
+
+  const double rate_;
+  const double burst_;
+  std::mutex mutex_;
+  double tokens_;
+  Time last_refill_;
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_TOKEN_BUCKET_H_
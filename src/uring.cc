@@ -0,0 +1,186 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include "check.h"
+#include "logging.h"
+
+namespace hcproxy {
+
+namespace {
+
+using ::std::chrono::nanoseconds;
+using ::std::chrono::seconds;
+
+int Setup(unsigned entries, io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int Enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg,
+          size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int Register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void* Map(int fd, size_t size, uint64_t offset) {
+  void* res = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  CHECK(res != MAP_FAILED) << Errno();
+  return res;
+}
+
+template <class T>
+T* At(void* base, uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+bool Supports(int fd, std::initializer_list<uint8_t> opcodes) {
+  constexpr unsigned kMaxOps = 256;
+  std::vector<char> buf(sizeof(io_uring_probe) + kMaxOps * sizeof(io_uring_probe_op));
+  auto* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+  if (Register(fd, IORING_REGISTER_PROBE, probe, kMaxOps) != 0) {
+    LOG(WARN) << "io_uring probe failed: " << Errno();
+    return false;
+  }
+  for (uint8_t op : opcodes) {
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      LOG(WARN) << "io_uring doesn't support opcode " << int{op};
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+IoUring* IoUring::New(unsigned entries, std::initializer_list<uint8_t> opcodes) {
+  io_uring_params p = {};
+  int fd = Setup(entries, &p);
+  if (fd < 0) {
+    LOG(WARN) << "io_uring_setup() failed: " << Errno();
+    return nullptr;
+  }
+  constexpr unsigned kFeatures = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if ((p.features & kFeatures) != kFeatures || !Supports(fd, opcodes)) {
+    if ((p.features & kFeatures) != kFeatures) LOG(WARN) << "io_uring lacks required features";
+    CHECK(close(fd) == 0) << Errno();
+    return nullptr;
+  }
+
+  auto* res = new IoUring;
+  res->fd_ = fd;
+  res->sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  res->cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    res->sq_ring_size_ = res->cq_ring_size_ = std::max(res->sq_ring_size_, res->cq_ring_size_);
+  }
+  res->sq_ring_ = Map(fd, res->sq_ring_size_, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    res->cq_ring_ = res->sq_ring_;
+  } else {
+    res->cq_ring_ = Map(fd, res->cq_ring_size_, IORING_OFF_CQ_RING);
+  }
+  res->sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  res->sqes_ = static_cast<io_uring_sqe*>(Map(fd, res->sqes_size_, IORING_OFF_SQES));
+
+  res->sq_head_ = At<unsigned>(res->sq_ring_, p.sq_off.head);
+  res->sq_tail_ = At<unsigned>(res->sq_ring_, p.sq_off.tail);
+  res->sq_array_ = At<unsigned>(res->sq_ring_, p.sq_off.array);
+  res->sq_mask_ = *At<unsigned>(res->sq_ring_, p.sq_off.ring_mask);
+  res->sq_entries_ = *At<unsigned>(res->sq_ring_, p.sq_off.ring_entries);
+  res->sqe_tail_ = *res->sq_tail_;
+
+  res->cq_head_ = At<unsigned>(res->cq_ring_, p.cq_off.head);
+  res->cq_tail_ = At<unsigned>(res->cq_ring_, p.cq_off.tail);
+  res->cq_mask_ = *At<unsigned>(res->cq_ring_, p.cq_off.ring_mask);
+  res->cqes_ = At<io_uring_cqe>(res->cq_ring_, p.cq_off.cqes);
+  return res;
+}
+
+IoUring::~IoUring() {
+  CHECK(munmap(sqes_, sqes_size_) == 0) << Errno();
+  if (cq_ring_ != sq_ring_) CHECK(munmap(cq_ring_, cq_ring_size_) == 0) << Errno();
+  CHECK(munmap(sq_ring_, sq_ring_size_) == 0) << Errno();
+  CHECK(close(fd_) == 0) << Errno();
+}
+
+unsigned IoUring::Pending() const {
+  return sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+}
+
+void IoUring::Reserve(unsigned n) {
+  CHECK(n <= sq_entries_);
+  if (sq_entries_ - Pending() < n) Submit(false, std::nullopt);
+  while (sq_entries_ - Pending() < n) {
+    // The completion queue is overflown, most likely because we are in the middle of
+    // reaping a large batch. Make room in it so that the kernel can flush the overflow
+    // and accept new entries.
+    Stash();
+    Submit(false, std::nullopt);
+  }
+}
+
+void IoUring::Stash() {
+  unsigned head = *cq_head_;
+  const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) stash_.push_back(cqes_[head & cq_mask_]);
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* IoUring::Sqe() {
+  Reserve(1);
+  const unsigned idx = sqe_tail_ & sq_mask_;
+  io_uring_sqe* sqe = &sqes_[idx];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array_[idx] = idx;
+  ++sqe_tail_;
+  return sqe;
+}
+
+void IoUring::Submit(bool wait, std::optional<Duration> timeout) {
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  __kernel_timespec ts = {};
+  io_uring_getevents_arg arg = {};
+  if (!stash_.empty()) wait = false;
+  if (wait) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout) {
+      auto ns = std::max(nanoseconds(0), std::chrono::ceil<nanoseconds>(*timeout));
+      ts.tv_sec = ns.count() / nanoseconds(seconds(1)).count();
+      ts.tv_nsec = ns.count() % nanoseconds(seconds(1)).count();
+      arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+  }
+  while (true) {
+    if (Enter(fd_, Pending(), wait ? 1 : 0, flags, &arg, sizeof(arg)) >= 0) return;
+    // ETIME: Timed out. EBUSY and EAGAIN: The completion queue is overflown; completions
+    // need to be reaped or stashed before more entries can be submitted.
+    if (errno == ETIME || errno == EBUSY || errno == EAGAIN) return;
+    CHECK(errno == EINTR) << Errno();
+  }
+}
+
+}  // namespace hcproxy
@@ -0,0 +1,111 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_URING_H_
+#define ROMKATV_HCPROXY_URING_H_
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <vector>
+
+#include "time.h"
+
+namespace hcproxy {
+
+// A thin wrapper around io_uring syscalls.
+//
+// Thread-compatible. NOT thread-safe.
+class IoUring {
+ public:
+  // Returns null if io_uring isn't available or doesn't support all of the specified
+  // opcodes. Requires IORING_FEAT_NODROP and IORING_FEAT_EXT_ARG.
+  static IoUring* New(unsigned entries, std::initializer_list<uint8_t> opcodes);
+
+  IoUring(IoUring&&) = delete;
+  ~IoUring();
+
+  // Makes sure the next `n` calls to Sqe() won't submit anything. Use it to keep
+  // linked entries in the same submission. If the kernel cannot accept more entries
+  // because the completion queue is overflown, moves completions aside for Reap().
+  void Reserve(unsigned n);
+
+  // Returns a zeroed submission queue entry. If the submission queue is full,
+  // submits all pending entries first.
+  io_uring_sqe* Sqe();
+
+  // Submits all pending entries. If `wait` is true, blocks until there is at least
+  // one completion or the timeout expires. Doesn't block if Reserve() has moved
+  // completions aside.
+  void Submit(bool wait, std::optional<Duration> timeout);
+
+  // Calls `f(const io_uring_cqe&)` for every available completion and consumes them.
+  // Returns the number of completions. `f` may call Sqe() and Reserve().
+  template <class F>
+  size_t Reap(F&& f) {
+    size_t n = 0;
+    if (!stash_.empty()) {
+      std::vector<io_uring_cqe> stash;
+      stash.swap(stash_);
+      for (const io_uring_cqe& cqe : stash) f(cqe);
+      n += stash.size();
+    }
+    // Consume completions one by one, so that the kernel can post more while `f`
+    // submits entries. If `f` moves completions aside, the head jumps past `tail`.
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (unsigned head; static_cast<int>(tail - (head = *cq_head_)) > 0; ++n) {
+      const io_uring_cqe cqe = cqes_[head & cq_mask_];
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+      f(cqe);
+    }
+    return n;
+  }
+
+ private:
+  IoUring() {}
+
+  unsigned Pending() const;
+  // Moves all available completions to stash_.
+  void Stash();
+
+  int fd_ = -1;
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_array_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  // The tail of the submission queue as seen by us. Published to the kernel by Submit().
+  unsigned sqe_tail_ = 0;
+
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+  // Completions moved out of the completion queue by Reserve(). Reap() serves them
+  // before the queue.
+  std::vector<io_uring_cqe> stash_;
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_URING_H_
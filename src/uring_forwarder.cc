@@ -0,0 +1,393 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "uring_forwarder.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+#include "check.h"
+#include "cpu.h"
+#include "logging.h"
+#include "pool.h"
+#include "stats.h"
+
+namespace hcproxy {
+
+namespace {
+
+constexpr std::string_view kResponse = "HTTP/1.1 200 OK\r\n\r\n";
+
+constexpr unsigned kRingSize = 4096;
+
+// The low bits of io_uring_sqe::user_data identify the operation within a chain.
+// The rest is a Flow*. Zero user_data is reserved for the wakeup poll.
+enum Op : uint64_t {
+  kPoll = 1,
+  kSpliceIn = 2,
+  kSpliceOut = 3,
+};
+
+constexpr uint64_t kOpMask = 3;
+
+void PrepPoll(io_uring_sqe* sqe, int fd, unsigned events, uint64_t data) {
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = data;
+}
+
+void PrepSplice(io_uring_sqe* sqe, int from, int to, unsigned len, uint64_t data) {
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->fd = to;
+  sqe->off = -1;
+  sqe->splice_fd_in = from;
+  sqe->splice_off_in = -1;
+  sqe->len = len;
+  sqe->splice_flags = SPLICE_F_NONBLOCK | SPLICE_F_MOVE;
+  sqe->user_data = data;
+}
+
+IoUring* NewRing(unsigned entries) {
+  return IoUring::New(entries, {IORING_OP_POLL_ADD, IORING_OP_SPLICE});
+}
+
+}  // namespace
+
+// One direction of a tunnel: from `src` socket through `pipe` into `dst` socket.
+struct UringForwarder::Flow {
+  uint64_t Tag(Op op) const {
+    static_assert(alignof(Flow) > kOpMask);
+    return reinterpret_cast<uint64_t>(this) | op;
+  }
+
+  Tunnel* tunnel;
+  const char* src_name;
+  const char* dst_name;
+  int src;
+  int dst;
+  PipePool* pool;
+  Pipe pipe;
+  bool has_pipe = false;
+  // Number of bytes in the pipe.
+  int size = 0;
+  // False after reading EOF from `src`.
+  bool src_open = true;
+  // True after `dst` has been shut down for writing.
+  bool done = false;
+  // The number of submitted operations that haven't completed yet.
+  int in_flight = 0;
+  // Results of operations of the current chain. Nullopt if the operation isn't
+  // part of the chain or hasn't completed.
+  std::optional<int> poll_res;
+  std::optional<int> in_res;
+  std::optional<int> out_res;
+};
+
+struct UringForwarder::Tunnel : Node, Pooled<Tunnel> {
+  Flow client_to_server;
+  Flow server_to_client;
+  int client_fd;
+  int server_fd;
+  // The time when Forward() was called. Reset when the tunnel reads data for the first time.
+  std::optional<Time> start;
+  Time deadline;
+  // True iff the tunnel is in expire_.
+  bool expiring = false;
+  bool terminating = false;
+};
+
+UringForwarder* UringForwarder::New(const Options& opt) {
+  CHECK(opt.read_write_timeout > Duration::zero());
+  CHECK(opt.client_to_server_pipes && opt.server_to_client_pipes && opt.num_tunnels);
+  IoUring* ring = NewRing(kRingSize);
+  if (!ring) return nullptr;
+  int event_fd = eventfd(0, EFD_NONBLOCK);
+  CHECK(event_fd >= 0) << Errno();
+  return new UringForwarder(opt, ring, event_fd);
+}
+
+bool UringForwarder::IsSupported() { return std::unique_ptr<IoUring>(NewRing(2)) != nullptr; }
+
+UringForwarder::UringForwarder(const Options& opt, IoUring* ring, int event_fd)
+    : opt_(opt),
+      ring_(*ring),
+      event_fd_(event_fd),
+      next_trim_(Clock::now() + opt.pipe_pool_idle_timeout) {
+  loop_ = std::thread(&UringForwarder::Loop, this);
+}
+
+void UringForwarder::Forward(int client_fd, int server_fd, bool send_response, Time start) {
+  CHECK(client_fd >= 0);
+  CHECK(server_fd >= 0);
+  bool wake;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wake = incoming_.empty();
+    incoming_.push_back({client_fd, server_fd, send_response, start});
+  }
+  if (wake) {
+    uint64_t one = 1;
+    CHECK(write(event_fd_, &one, sizeof(one)) == sizeof(one)) << Errno();
+  }
+}
+
+void UringForwarder::Pin(const std::vector<int>& cpus) { PinThread(loop_.native_handle(), cpus); }
+
+void UringForwarder::Loop() {
+  ArmWakeup();
+  while (true) {
+    Time deadline = next_trim_;
+    if (auto* t = static_cast<Tunnel*>(expire_.head())) deadline = std::min(deadline, t->deadline);
+    ring_.Submit(true, deadline - Clock::now());
+    now_ = Clock::now();
+    while (ring_.Reap([this](const io_uring_cqe& cqe) { OnCompletion(cqe); })) {
+    }
+    while (auto* t = static_cast<Tunnel*>(expire_.head())) {
+      if (t->deadline > now_) break;
+      LOG(INFO) << "[" << t->client_fd << "] (client) timed out waiting for IO";
+      Count(Counter::kForwardTimeouts);
+      Terminate(t);
+    }
+    if (now_ >= next_trim_) {
+      opt_.client_to_server_pipes->Trim();
+      opt_.server_to_client_pipes->Trim();
+      next_trim_ = now_ + opt_.pipe_pool_idle_timeout;
+    }
+  }
+}
+
+void UringForwarder::ArmWakeup() { PrepPoll(ring_.Sqe(), event_fd_, POLLIN, 0); }
+
+void UringForwarder::AcceptTunnels() {
+  uint64_t n;
+  CHECK(read(event_fd_, &n, sizeof(n)) == sizeof(n) || errno == EAGAIN) << Errno();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    accepted_.swap(incoming_);
+  }
+  for (const Incoming& x : accepted_) StartTunnel(x);
+  // Both vectors keep their capacity, so passing tunnels around doesn't allocate.
+  accepted_.clear();
+}
+
+void UringForwarder::StartTunnel(const Incoming& incoming) {
+  const int client_fd = incoming.client_fd;
+  const int server_fd = incoming.server_fd;
+  LOG(INFO) << "Forwarding traffic: "
+            << "[" << client_fd << "] (client)"
+            << " <=> "
+            << "[" << server_fd << "] (server)";
+  auto* t = new Tunnel;
+  t->client_fd = client_fd;
+  t->server_fd = server_fd;
+  t->start = incoming.start;
+  t->client_to_server.tunnel = t;
+  t->client_to_server.src_name = "client";
+  t->client_to_server.dst_name = "server";
+  t->client_to_server.src = client_fd;
+  t->client_to_server.dst = server_fd;
+  t->client_to_server.pool = opt_.client_to_server_pipes;
+  t->server_to_client.tunnel = t;
+  t->server_to_client.src_name = "server";
+  t->server_to_client.dst_name = "client";
+  t->server_to_client.src = server_fd;
+  t->server_to_client.dst = client_fd;
+  t->server_to_client.pool = opt_.server_to_client_pipes;
+  // Counted before anything can fail: MaybeClose() counts every tunnel as closed.
+  Count(Counter::kTunnelsOpened);
+  for (Flow* flow : {&t->client_to_server, &t->server_to_client}) {
+    if (!flow->pool->Acquire(&flow->pipe)) {
+      // MaybeClose() will release the pipe that we might have acquired and close the sockets.
+      t->terminating = true;
+      MaybeClose(t);
+      return;
+    }
+    flow->has_pipe = true;
+  }
+  if (incoming.send_response) {
+    Flow& response = t->server_to_client;
+    CHECK(static_cast<int>(kResponse.size()) <= response.pipe.capacity);
+    CHECK(write(response.pipe.write_fd, kResponse.data(), kResponse.size()) ==
+          static_cast<ssize_t>(kResponse.size()))
+        << Errno();
+    response.size = kResponse.size();
+  }
+  t->deadline = now_ + opt_.read_write_timeout;
+  t->expiring = true;
+  expire_.AddTail(t);
+  Next(&t->client_to_server);
+  Next(&t->server_to_client);
+}
+
+void UringForwarder::OnCompletion(const io_uring_cqe& cqe) {
+  if (cqe.user_data == 0) {
+    AcceptTunnels();
+    ArmWakeup();
+    return;
+  }
+  auto* flow = reinterpret_cast<Flow*>(cqe.user_data & ~kOpMask);
+  switch (cqe.user_data & kOpMask) {
+    case kPoll:
+      flow->poll_res = cqe.res;
+      break;
+    case kSpliceIn:
+      flow->in_res = cqe.res;
+      break;
+    case kSpliceOut:
+      flow->out_res = cqe.res;
+      break;
+    default:
+      LOG(FATAL) << "Invalid user_data: " << cqe.user_data;
+  }
+  CHECK(flow->in_flight > 0);
+  if (--flow->in_flight == 0) OnChainDone(flow);
+}
+
+void UringForwarder::OnChainDone(Flow* flow) {
+  Tunnel* t = flow->tunnel;
+  std::optional<int> poll = std::exchange(flow->poll_res, std::nullopt);
+  std::optional<int> in = std::exchange(flow->in_res, std::nullopt);
+  std::optional<int> out = std::exchange(flow->out_res, std::nullopt);
+  bool io = false;
+  if (in && *in > 0) {
+    flow->size += *in;
+    Count(flow->dst == t->server_fd ? Counter::kBytesClientToServer
+                                    : Counter::kBytesServerToClient,
+          *in);
+    if (t->start) {
+      Record(Histogram::kFirstByte, now_ - *t->start);
+      t->start.reset();
+    }
+    io = true;
+  }
+  if (out && *out > 0) {
+    flow->size -= *out;
+    io = true;
+  }
+  CHECK(flow->size >= 0 && flow->size <= flow->pipe.capacity);
+  if (t->terminating) {
+    MaybeClose(t);
+    return;
+  }
+  if (poll && *poll < 0) {
+    LOG(INFO) << "[" << flow->src << "] (" << flow->src_name << ") poll error: " << Errno(-*poll);
+    Count(Counter::kForwardErrors);
+    Terminate(t);
+    return;
+  }
+  if (in && *in < 0 && *in != -EAGAIN) {
+    LOG(INFO) << "[" << flow->src << "] (" << flow->src_name << ") read error: " << Errno(-*in);
+    Count(Counter::kForwardErrors);
+    Terminate(t);
+    return;
+  }
+  if (out && *out < 0 && *out != -EAGAIN) {
+    LOG(INFO) << "[" << flow->dst << "] (" << flow->dst_name << ") write error: " << Errno(-*out);
+    Count(Counter::kForwardErrors);
+    Terminate(t);
+    return;
+  }
+  if (in && *in == 0) {
+    LOG(INFO) << "[" << flow->src << "] (" << flow->src_name << ") read EOF";
+    flow->src_open = false;
+    io = true;
+  }
+  if (io) {
+    t->deadline = now_ + opt_.read_write_timeout;
+    expire_.Erase(t);
+    expire_.AddTail(t);
+  }
+  Next(flow);
+}
+
+void UringForwarder::Next(Flow* flow) {
+  CHECK(flow->in_flight == 0);
+  CHECK(!flow->done);
+  if (flow->size > 0) {
+    // Wait until `dst` is writable and flush the pipe.
+    ring_.Reserve(2);
+    io_uring_sqe* poll = ring_.Sqe();
+    PrepPoll(poll, flow->dst, POLLOUT, flow->Tag(kPoll));
+    poll->flags = IOSQE_IO_HARDLINK;
+    PrepSplice(ring_.Sqe(), flow->pipe.read_fd, flow->dst, flow->size, flow->Tag(kSpliceOut));
+    flow->in_flight = 2;
+  } else if (flow->src_open) {
+    // Wait until `src` is readable, fill the pipe and flush it. Hard links make the
+    // chain continue even if an operation transfers fewer bytes than requested.
+    ring_.Reserve(3);
+    io_uring_sqe* poll = ring_.Sqe();
+    PrepPoll(poll, flow->src, POLLIN | POLLRDHUP, flow->Tag(kPoll));
+    poll->flags = IOSQE_IO_HARDLINK;
+    io_uring_sqe* in = ring_.Sqe();
+    PrepSplice(in, flow->src, flow->pipe.write_fd, flow->pipe.capacity, flow->Tag(kSpliceIn));
+    in->flags = IOSQE_IO_HARDLINK;
+    PrepSplice(ring_.Sqe(), flow->pipe.read_fd, flow->dst, flow->pipe.capacity,
+               flow->Tag(kSpliceOut));
+    flow->in_flight = 3;
+  } else {
+    LOG(INFO) << "[" << flow->dst << "] (" << flow->dst_name << ") shutdown(SHUT_WR)";
+    CHECK(shutdown(flow->dst, SHUT_WR) == 0 || errno == ENOTCONN) << Errno();
+    flow->done = true;
+    MaybeClose(flow->tunnel);
+  }
+}
+
+void UringForwarder::Terminate(Tunnel* t) {
+  CHECK(!t->terminating);
+  t->terminating = true;
+  if (t->expiring) {
+    expire_.Erase(t);
+    t->expiring = false;
+  }
+  // This makes all pending polls on the sockets complete.
+  for (int fd : {t->client_fd, t->server_fd}) {
+    CHECK(shutdown(fd, SHUT_RDWR) == 0 || errno == ENOTCONN) << Errno();
+  }
+  MaybeClose(t);
+}
+
+void UringForwarder::MaybeClose(Tunnel* t) {
+  Flow* flows[] = {&t->client_to_server, &t->server_to_client};
+  for (Flow* flow : flows) {
+    if (flow->in_flight) return;
+    if (!t->terminating && !flow->done) return;
+  }
+  for (Flow* flow : flows) {
+    if (!flow->has_pipe) continue;
+    if (flow->size == 0) {
+      flow->pool->Release(flow->pipe);
+    } else {
+      CHECK(close(flow->pipe.read_fd) == 0) << Errno();
+      CHECK(close(flow->pipe.write_fd) == 0) << Errno();
+    }
+  }
+  LOG(INFO) << "[" << t->client_fd << "] (client) close";
+  CHECK(close(t->client_fd) == 0) << Errno();
+  LOG(INFO) << "[" << t->server_fd << "] (server) close";
+  CHECK(close(t->server_fd) == 0) << Errno();
+  if (t->expiring) expire_.Erase(t);
+  opt_.num_tunnels->fetch_sub(1, std::memory_order_relaxed);
+  Count(Counter::kTunnelsClosed);
+  delete t;
+}
+
+}  // namespace hcproxy
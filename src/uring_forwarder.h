@@ -0,0 +1,114 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ROMKATV_HCPROXY_URING_FORWARDER_H_
+#define ROMKATV_HCPROXY_URING_FORWARDER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "list.h"
+#include "pipe_pool.h"
+#include "time.h"
+#include "uring.h"
+
+namespace hcproxy {
+
+// Forwards traffic between pairs of sockets on its own thread. Each direction of a
+// tunnel is driven by linked io_uring operations: poll the source socket, splice
+// from the socket into a pipe, splice from the pipe into the destination socket.
+// Operations of all tunnels are submitted and reaped in batches, with one
+// io_uring_enter() per loop iteration.
+class UringForwarder {
+ public:
+  struct Options {
+    // See Forwarder::Options::read_write_timeout.
+    Duration read_write_timeout;
+    // Trim the pipe pools this often.
+    Duration pipe_pool_idle_timeout;
+    // Used only from the forwarding thread.
+    PipePool* client_to_server_pipes;
+    // Used only from the forwarding thread.
+    PipePool* server_to_client_pipes;
+    // Decremented when a tunnel is closed.
+    std::atomic<int64_t>* num_tunnels;
+  };
+
+  // Returns null if io_uring isn't available or doesn't support the operations we need.
+  static UringForwarder* New(const Options& opt);
+
+  // Returns true if New() can succeed as far as the kernel is concerned.
+  static bool IsSupported();
+
+  UringForwarder(UringForwarder&&) = delete;
+  ~UringForwarder() = delete;
+
+  // First sends HTTP 200 response to the client unless `send_response` is false. Then
+  // bidirectionally proxies raw bytes between the two sockets. The latency of the first
+  // forwarded byte is measured from `start`.
+  //
+  // Can be called from any thread. Does not block.
+  void Forward(int client_fd, int server_fd, bool send_response, Time start);
+
+  // Restricts the forwarding thread to the specified CPUs. Can be called from any thread.
+  void Pin(const std::vector<int>& cpus);
+
+ private:
+  struct Flow;
+  struct Tunnel;
+
+  struct Incoming {
+    int client_fd;
+    int server_fd;
+    bool send_response;
+    Time start;
+  };
+
+  UringForwarder(const Options& opt, IoUring* ring, int event_fd);
+
+  void Loop();
+  void ArmWakeup();
+  void AcceptTunnels();
+  void StartTunnel(const Incoming& incoming);
+  void OnCompletion(const io_uring_cqe& cqe);
+  void OnChainDone(Flow* flow);
+  void Next(Flow* flow);
+  void Terminate(Tunnel* t);
+  void MaybeClose(Tunnel* t);
+
+  const Options opt_;
+  IoUring& ring_;
+  const int event_fd_;
+  uint64_t event_fd_data_;
+  std::mutex mutex_;
+  // Tunnels passed to Forward() but not yet picked up by the forwarding thread.
+  std::vector<Incoming> incoming_;
+  // Tunnels taken from incoming_ by the forwarding thread.
+  std::vector<Incoming> accepted_;
+  // Live tunnels that aren't being terminated, sorted by deadline. The head is the first
+  // to expire.
+  List expire_;
+  Time now_;
+  // When to trim the pipe pools next.
+  Time next_trim_;
+  std::thread loop_;
+};
+
+}  // namespace hcproxy
+
+#endif  // ROMKATV_HCPROXY_URING_FORWARDER_H_
@@ -0,0 +1,291 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks that once warmed up, the proxy doesn't allocate heap memory for connections.
+// Every case runs in a child process of its own because RunProxy() never returns:
+//
+//   - The request names an IP address.
+//   - The request names a host with several addresses from the hosts file.
+//   - Tunnels are throttled and have to wait for tokens.
+//   - Tunnels are forwarded with io_uring, if it's available.
+//
+// Linked against objects built with -DHCP_MIN_LOG_LVL=WARN because INFO logs allocate.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "check.h"
+#include "logging.h"
+#include "proxy.h"
+
+namespace {
+
+std::atomic<uint64_t> g_allocs{0};
+
+}  // namespace
+
+// Count every allocation, including those made by operator new, which calls malloc().
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) {
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(p, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size) {
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  *p = __libc_memalign(alignment, size);
+  return *p ? 0 : ENOMEM;
+}
+
+}  // extern "C"
+
+namespace hcproxy {
+namespace {
+
+// Warm-up opens this many sessions at once, so that buffers sized by the number of
+// connections in flight (e.g., epoll event arrays) are large enough afterwards.
+constexpr int kConcurrentSessions = 64;
+constexpr int kWarmUpSessions = 200;
+constexpr int kSessions = 1000;
+// Bytes echoed through every session.
+constexpr size_t kPingSize = 4;
+// Throttled sessions echo this many bytes, which is more than the bursts allow.
+constexpr size_t kBulkSize = 64 << 10;
+
+sockaddr_in Addr(const char* ip, std::uint16_t port) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  CHECK(inet_pton(AF_INET, ip, &addr.sin_addr) == 1);
+  return addr;
+}
+
+// Returns a port on 127.0.0.1 that nobody is listening on.
+std::uint16_t FreePort() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK(fd >= 0) << Errno();
+  sockaddr_in addr = Addr("127.0.0.1", 0);
+  socklen_t len = sizeof(addr);
+  CHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), len) == 0) << Errno();
+  CHECK(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) << Errno();
+  CHECK(close(fd) == 0) << Errno();
+  return ntohs(addr.sin_port);
+}
+
+// Echoed chunks are small, so Nagle's algorithm would hold them until delayed ACKs.
+void NoDelay(int fd) {
+  int one = 1;
+  CHECK(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0) << Errno();
+}
+
+int Connect(std::uint16_t port) {
+  sockaddr_in addr = Addr("127.0.0.1", port);
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK(fd >= 0) << Errno();
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    CHECK(close(fd) == 0) << Errno();
+    return -1;
+  }
+  NoDelay(fd);
+  return fd;
+}
+
+void ReadFull(int fd, char* buf, size_t n) {
+  while (n) {
+    ssize_t r = read(fd, buf, n);
+    CHECK(r > 0) << Errno();
+    buf += r;
+    n -= r;
+  }
+}
+
+void WriteFull(int fd, const char* buf, size_t n) {
+  while (n) {
+    ssize_t r = write(fd, buf, n);
+    CHECK(r > 0) << Errno();
+    buf += r;
+    n -= r;
+  }
+}
+
+// Accepts connections one at a time on `ip` and echoes everything back. Returns the
+// port, which is picked by the kernel if `port` is zero. Connections wait in the backlog
+// while the server is busy.
+std::uint16_t StartEchoServer(const char* ip, std::uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK(fd >= 0) << Errno();
+  sockaddr_in addr = Addr(ip, port);
+  socklen_t len = sizeof(addr);
+  CHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), len) == 0) << Errno();
+  CHECK(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) << Errno();
+  CHECK(listen(fd, 128) == 0) << Errno();
+  std::thread([fd]() {
+    while (true) {
+      int conn = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+      CHECK(conn >= 0) << Errno();
+      NoDelay(conn);
+      char buf[1024];
+      for (ssize_t n; (n = read(conn, buf, sizeof(buf))) > 0;) WriteFull(conn, buf, n);
+      CHECK(close(conn) == 0) << Errno();
+    }
+  }).detach();
+  return ntohs(addr.sin_port);
+}
+
+// Sends `n` bytes through the tunnel and checks that they come back, a chunk at a time
+// so that the echo server never blocks.
+void Echo(int fd, size_t n) {
+  char out[16 << 10];
+  char in[sizeof(out)];
+  std::memset(out, 'x', sizeof(out));
+  while (n) {
+    size_t k = std::min(n, sizeof(out));
+    WriteFull(fd, out, k);
+    ReadFull(fd, in, k);
+    CHECK(std::memcmp(in, out, k) == 0);
+    n -= k;
+  }
+}
+
+// Opens a tunnel through the proxy to the echo server and echoes `payload` bytes
+// through it. Echoing requires the echo server to be free.
+int OpenSession(std::uint16_t proxy_port, const char* request, size_t payload) {
+  int fd;
+  while ((fd = Connect(proxy_port)) < 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  WriteFull(fd, request, std::strlen(request));
+  static constexpr char kResponse[] = "HTTP/1.1 200 OK\r\n\r\n";
+  char buf[sizeof(kResponse) - 1];
+  ReadFull(fd, buf, sizeof(buf));
+  CHECK(std::memcmp(buf, kResponse, sizeof(buf)) == 0);
+  Echo(fd, payload);
+  return fd;
+}
+
+void RunSession(std::uint16_t proxy_port, const char* request, size_t payload) {
+  CHECK(close(OpenSession(proxy_port, request, payload)) == 0) << Errno();
+}
+
+// Starts the proxy, warms it up and checks that `sessions` more sessions to the echo
+// server at host:echo_port don't allocate. Every session echoes `payload` bytes.
+void Check(Options opt, const char* host, std::uint16_t echo_port, size_t payload,
+           int sessions) {
+  opt.listen_port = FreePort();
+  opt.stats_path = "";
+  std::thread([opt]() { RunProxy(opt); }).detach();
+
+  char request[128];
+  std::snprintf(request, sizeof(request), "CONNECT %s:%d HTTP/1.1\r\n\r\n", host, echo_port);
+  int fds[kConcurrentSessions];
+  for (int& fd : fds) fd = OpenSession(opt.listen_port, request, 0);
+  for (int fd : fds) CHECK(close(fd) == 0) << Errno();
+  for (int i = 0; i != kWarmUpSessions; ++i) RunSession(opt.listen_port, request, payload);
+  const uint64_t allocs = g_allocs.load();
+  for (int i = 0; i != sessions; ++i) RunSession(opt.listen_port, request, payload);
+  // Let the proxy close the last tunnels.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  const uint64_t n = g_allocs.load() - allocs;
+  CHECK(n == 0) << n << " allocations in " << sessions << " sessions";
+}
+
+void CheckIpAddress() {
+  Check(Options(), "127.0.0.1", StartEchoServer("127.0.0.1", 0), kPingSize, kSessions);
+}
+
+void CheckHostname() {
+  const std::uint16_t port = StartEchoServer("127.0.0.1", 0);
+  StartEchoServer("127.0.0.2", port);
+  char dir[] = "/tmp/alloc_test.XXXXXX";
+  CHECK(mkdtemp(dir)) << Errno();
+  Options opt;
+  opt.dns_hosts_path = std::string(dir) + "/hosts";
+  std::ofstream(opt.dns_hosts_path) << "127.0.0.1 multi.test\n127.0.0.2 multi.test\n";
+  Check(opt, "multi.test", port, kPingSize, kSessions);
+}
+
+void CheckThrottled() {
+  Options opt;
+  opt.tunnel_rate_limit = {16 << 20, 32 << 10};
+  opt.client_rate_limit = {32 << 20, 64 << 10};
+  opt.global_rate_limit = {64 << 20, 128 << 10};
+  Check(opt, "127.0.0.1", StartEchoServer("127.0.0.1", 0), kBulkSize, kWarmUpSessions);
+}
+
+void CheckIoUring() {
+  Options opt;
+  opt.use_io_uring = true;
+  Check(opt, "127.0.0.1", StartEchoServer("127.0.0.1", 0), kPingSize, kSessions);
+}
+
+void RunInChild(const char* name, void (*f)()) {
+  pid_t pid = fork();
+  CHECK(pid >= 0) << Errno();
+  if (pid == 0) {
+    f();
+    _exit(0);
+  }
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid) << Errno();
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0) << name << ": failed";
+}
+
+}  // namespace
+}  // namespace hcproxy
+
+int main() {
+  using namespace hcproxy;
+  RunInChild("IP address", CheckIpAddress);
+  RunInChild("host with several addresses", CheckHostname);
+  RunInChild("throttled tunnels", CheckThrottled);
+  RunInChild("io_uring", CheckIoUring);
+  LOG(WARN) << "PASS";
+}
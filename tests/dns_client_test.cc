@@ -0,0 +1,437 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests DnsClient and DnsResolver against stub nameservers on 127.0.0.1 and 127.0.0.2.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "addr.h"
+#include "check.h"
+#include "dns.h"
+#include "dns_client.h"
+#include "logging.h"
+#include "time.h"
+
+namespace hcproxy {
+namespace {
+
+constexpr std::uint16_t kTypeA = 1;
+constexpr std::uint16_t kTypeAaaa = 28;
+
+constexpr int kRcodeServFail = 2;
+constexpr int kRcodeNxDomain = 3;
+
+void Put16(std::string& s, std::uint16_t x) {
+  s.push_back(x >> 8);
+  s.push_back(x & 0xFF);
+}
+
+void Put32(std::string& s, uint32_t x) {
+  Put16(s, x >> 16);
+  Put16(s, x & 0xFFFF);
+}
+
+std::uint16_t Get16(const std::string& s, size_t off) {
+  return static_cast<unsigned char>(s[off]) << 8 | static_cast<unsigned char>(s[off + 1]);
+}
+
+// How a stub nameserver answers queries for a name.
+struct Answer {
+  int rcode = 0;
+  uint32_t ttl = 60;
+  std::vector<std::string> a;
+  std::vector<std::string> aaaa;
+  // Reply with the TC flag and no records over UDP.
+  bool truncate = false;
+  // Don't reply.
+  bool drop = false;
+};
+
+// Answers A and AAAA queries over UDP and TCP. Counts the queries it receives.
+class StubServer {
+ public:
+  // Returns false if UDP or TCP `port` is taken. Picks a random port if it's zero.
+  bool Listen(const char* ip, std::uint16_t port) {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    CHECK(inet_pton(AF_INET, ip, &addr.sin_addr) == 1);
+    auto* sa = reinterpret_cast<sockaddr*>(&addr);
+    socklen_t len = sizeof(addr);
+    CHECK((udp_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) >= 0) << Errno();
+    CHECK((tcp_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0) << Errno();
+    int one = 1;
+    CHECK(setsockopt(tcp_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0) << Errno();
+    if (bind(udp_, sa, len) != 0 || getsockname(udp_, sa, &len) != 0 || bind(tcp_, sa, len) != 0) {
+      CHECK(errno == EADDRINUSE) << Errno();
+      Close();
+      return false;
+    }
+    port_ = ntohs(addr.sin_port);
+    return true;
+  }
+
+  // Undoes Listen().
+  void Close() {
+    CHECK(close(udp_) == 0) << Errno();
+    CHECK(close(tcp_) == 0) << Errno();
+  }
+
+  // Starts serving queries. Requires a successful Listen().
+  void Start() {
+    CHECK(listen(tcp_, 16) == 0) << Errno();
+    std::thread([this]() { Serve(); }).detach();
+  }
+
+  std::uint16_t port() const { return port_; }
+
+  void Set(const std::string& name, Answer answer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    answers_[name] = std::move(answer);
+  }
+
+  int NumQueries(const std::string& name, std::uint16_t type, bool tcp = false) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return counts_[std::make_tuple(name, type, tcp)];
+  }
+
+ private:
+  void Serve() {
+    pollfd fds[] = {{udp_, POLLIN, 0}, {tcp_, POLLIN, 0}};
+    while (true) {
+      CHECK(poll(fds, 2, -1) > 0) << Errno();
+      if (fds[0].revents) {
+        char buf[4 << 10];
+        sockaddr_storage from;
+        socklen_t len = sizeof(from);
+        ssize_t n = recvfrom(udp_, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &len);
+        CHECK(n >= 0) << Errno();
+        std::optional<std::string> reply = Reply(std::string(buf, n), false);
+        if (reply) {
+          sendto(udp_, reply->data(), reply->size(), 0, reinterpret_cast<sockaddr*>(&from), len);
+        }
+      }
+      if (fds[1].revents) {
+        int fd = accept4(tcp_, nullptr, nullptr, SOCK_CLOEXEC);
+        CHECK(fd >= 0) << Errno();
+        std::string query;
+        if (ReadFull(fd, 2, &query) && ReadFull(fd, Get16(query, 0), &query)) {
+          std::optional<std::string> reply = Reply(query.substr(2), true);
+          if (reply) {
+            std::string msg;
+            Put16(msg, reply->size());
+            msg += *reply;
+            CHECK(send(fd, msg.data(), msg.size(), MSG_NOSIGNAL) == ssize_t(msg.size()));
+          }
+        }
+        CHECK(close(fd) == 0) << Errno();
+      }
+    }
+  }
+
+  static bool ReadFull(int fd, size_t n, std::string* out) {
+    char buf[4 << 10];
+    while (n) {
+      ssize_t r = recv(fd, buf, std::min(n, sizeof(buf)), 0);
+      if (r <= 0) return false;
+      out->append(buf, r);
+      n -= r;
+    }
+    return true;
+  }
+
+  // Returns nothing if the query should be dropped.
+  std::optional<std::string> Reply(const std::string& query, bool tcp) {
+    CHECK(query.size() > 12);
+    std::string name;
+    size_t off = 12;
+    while (size_t len = static_cast<unsigned char>(query[off])) {
+      if (!name.empty()) name += '.';
+      name += query.substr(off + 1, len);
+      off += 1 + len;
+    }
+    ++off;
+    std::uint16_t type = Get16(query, off);
+    off += 4;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++counts_[std::make_tuple(name, type, tcp)];
+    auto it = answers_.find(name);
+    Answer answer;
+    if (it == answers_.end()) {
+      answer.rcode = kRcodeNxDomain;
+    } else {
+      answer = it->second;
+    }
+    if (answer.drop) return std::nullopt;
+    bool truncate = answer.truncate && !tcp;
+    const std::vector<std::string>& ips = type == kTypeA ? answer.a : answer.aaaa;
+    std::uint16_t ancount = truncate || answer.rcode ? 0 : ips.size();
+
+    std::string msg = query.substr(0, 2);
+    Put16(msg, 0x8180 | (truncate ? 0x0200 : 0) | answer.rcode);
+    Put16(msg, 1);  // QDCOUNT
+    Put16(msg, ancount);
+    Put16(msg, 0);  // NSCOUNT
+    Put16(msg, 0);  // ARCOUNT
+    msg += query.substr(12, off - 12);
+    for (size_t i = 0; i != ancount; ++i) {
+      Put16(msg, 0xC00C);  // pointer to the name in the question
+      Put16(msg, type);
+      Put16(msg, 1);  // CLASS IN
+      Put32(msg, answer.ttl);
+      char rdata[16];
+      int af = type == kTypeA ? AF_INET : AF_INET6;
+      CHECK(inet_pton(af, ips[i].c_str(), rdata) == 1) << ips[i];
+      size_t rdlen = type == kTypeA ? 4 : 16;
+      Put16(msg, rdlen);
+      msg.append(rdata, rdlen);
+    }
+    return msg;
+  }
+
+  int udp_;
+  int tcp_;
+  std::uint16_t port_;
+  std::mutex mutex_;
+  std::map<std::string, Answer> answers_;
+  std::map<std::tuple<std::string, std::uint16_t, bool>, int> counts_;
+};
+
+struct Result {
+  // Addresses formatted by IpPort. Empty on error.
+  std::vector<std::string> addrs;
+  Duration ttl;
+};
+
+Result Resolve(DnsClient* client, const std::string& host, int family) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::optional<Result> res;
+  client->Resolve(host, 80, family, [&](std::shared_ptr<const addrinfo> addr, Duration ttl) {
+    Result r{{}, ttl};
+    for (const addrinfo* ai = addr.get(); ai;) {
+      std::ostringstream strm;
+      strm << IpPort(*ai);
+      r.addrs.push_back(strm.str());
+      ai = ai->ai_next == addr.get() ? nullptr : ai->ai_next;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    res = std::move(r);
+    cv.notify_one();
+  });
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return res.has_value(); });
+  return std::move(*res);
+}
+
+std::vector<std::string> Addrs(std::vector<std::string> addrs) { return addrs; }
+
+struct Env {
+  StubServer* primary;
+  StubServer* secondary;
+  DnsClient::Options opt;
+};
+
+// Both nameservers are tried once with a 1s timeout.
+Env MakeEnv() {
+  Env env;
+  env.primary = new StubServer();
+  env.secondary = new StubServer();
+  // Both nameservers must use the same port.
+  while (true) {
+    if (env.primary->Listen("127.0.0.1", 0)) {
+      if (env.secondary->Listen("127.0.0.2", env.primary->port())) break;
+      env.primary->Close();
+    }
+  }
+  env.primary->Start();
+  env.secondary->Start();
+  char dir[] = "/tmp/hcproxy-dns-test-XXXXXX";
+  CHECK(mkdtemp(dir)) << Errno();
+  env.opt.dns_resolv_conf_path = std::string(dir) + "/resolv.conf";
+  env.opt.dns_hosts_path = std::string(dir) + "/hosts";
+  env.opt.dns_nameserver_port = env.primary->port();
+  std::ofstream(env.opt.dns_resolv_conf_path)
+      << "nameserver 127.0.0.1\nnameserver 127.0.0.2\noptions timeout:1 attempts:1\n";
+  std::ofstream(env.opt.dns_hosts_path) << "10.1.1.1 Hosts.Test  # comment\n";
+  return env;
+}
+
+void TestAddressFamilies(const Env& env) {
+  Answer answer;
+  answer.a = {"1.2.3.4", "1.2.3.5"};
+  answer.aaaa = {"2001:db8::1"};
+  env.primary->Set("both.test", answer);
+  DnsClient* client = DnsClient::New(env.opt);
+  CHECK(client);
+
+  Result r = Resolve(client, "both.test", AF_UNSPEC);
+  CHECK(r.addrs == Addrs({"[2001:db8::1]:80", "1.2.3.4:80", "1.2.3.5:80"}));
+  CHECK(r.ttl == std::chrono::seconds(60));
+
+  CHECK(Resolve(client, "BOTH.test.", AF_INET).addrs == Addrs({"1.2.3.4:80", "1.2.3.5:80"}));
+  CHECK(Resolve(client, "both.test", AF_INET6).addrs == Addrs({"[2001:db8::1]:80"}));
+  CHECK(env.primary->NumQueries("both.test", kTypeA) == 2);
+  CHECK(env.primary->NumQueries("both.test", kTypeAaaa) == 2);
+  CHECK(env.secondary->NumQueries("both.test", kTypeA) == 0);
+
+  // Neither IP literals nor hosts from the hosts file are sent to nameservers.
+  r = Resolve(client, "127.1.2.3", AF_UNSPEC);
+  CHECK(r.addrs == Addrs({"127.1.2.3:80"}));
+  CHECK(r.ttl == Duration::max());
+  CHECK(Resolve(client, "127.1.2.3", AF_INET6).addrs.empty());
+  CHECK(Resolve(client, "hosts.test", AF_UNSPEC).addrs == Addrs({"10.1.1.1:80"}));
+  CHECK(env.primary->NumQueries("hosts.test", kTypeA) == 0);
+}
+
+void TestTruncated(const Env& env) {
+  Answer answer;
+  for (int i = 0; i != 100; ++i) answer.a.push_back("10.0.0." + std::to_string(i));
+  answer.truncate = true;
+  env.primary->Set("big.test", answer);
+  DnsClient* client = DnsClient::New(env.opt);
+  CHECK(client);
+
+  Result r = Resolve(client, "big.test", AF_INET);
+  CHECK(r.addrs.size() == 100);
+  CHECK(r.addrs[99] == "10.0.0.99:80");
+  CHECK(env.primary->NumQueries("big.test", kTypeA, false) == 1);
+  CHECK(env.primary->NumQueries("big.test", kTypeA, true) == 1);
+}
+
+void TestFailover(const Env& env) {
+  Answer answer;
+  answer.a = {"1.1.1.1"};
+  env.secondary->Set("servfail.test", answer);
+  env.secondary->Set("timeout.test", answer);
+  answer.rcode = kRcodeServFail;
+  env.primary->Set("servfail.test", answer);
+  answer.drop = true;
+  env.primary->Set("timeout.test", answer);
+  DnsClient* client = DnsClient::New(env.opt);
+  CHECK(client);
+
+  CHECK(Resolve(client, "servfail.test", AF_INET).addrs == Addrs({"1.1.1.1:80"}));
+  CHECK(env.primary->NumQueries("servfail.test", kTypeA) == 1);
+  CHECK(env.secondary->NumQueries("servfail.test", kTypeA) == 1);
+
+  Time start = Clock::now();
+  CHECK(Resolve(client, "timeout.test", AF_INET).addrs == Addrs({"1.1.1.1:80"}));
+  CHECK(Clock::now() - start >= std::chrono::seconds(1));
+  CHECK(env.primary->NumQueries("timeout.test", kTypeA) == 1);
+  CHECK(env.secondary->NumQueries("timeout.test", kTypeA) == 1);
+
+  // With no nameservers left to try, the last error is reported.
+  env.secondary->Set("servfail.test", answer);
+  start = Clock::now();
+  CHECK(Resolve(client, "servfail.test", AF_INET).addrs.empty());
+  CHECK(Clock::now() - start >= std::chrono::seconds(1));
+  CHECK(env.primary->NumQueries("servfail.test", kTypeA) == 2);
+  CHECK(env.secondary->NumQueries("servfail.test", kTypeA) == 2);
+}
+
+void TestNxDomain(const Env& env) {
+  Answer answer;
+  answer.a = {"1.1.1.1"};
+  env.secondary->Set("nx.test", answer);
+  DnsClient* client = DnsClient::New(env.opt);
+  CHECK(client);
+
+  // NXDOMAIN is authoritative: the second nameserver isn't asked.
+  CHECK(Resolve(client, "nx.test", AF_UNSPEC).addrs.empty());
+  CHECK(env.primary->NumQueries("nx.test", kTypeA) == 1);
+  CHECK(env.primary->NumQueries("nx.test", kTypeAaaa) == 1);
+  CHECK(env.secondary->NumQueries("nx.test", kTypeA) == 0);
+  CHECK(env.secondary->NumQueries("nx.test", kTypeAaaa) == 0);
+}
+
+void TestTtl(const Env& env) {
+  Answer answer;
+  answer.a = {"1.1.1.1"};
+  answer.aaaa = {"::1"};
+  answer.ttl = 0;
+  env.primary->Set("zero.test", answer);
+  answer.ttl = 3600;
+  env.primary->Set("long.test", answer);
+  // Per RFC 2181, TTLs with the most significant bit set are treated as zero.
+  answer.ttl = 1u << 31;
+  env.primary->Set("negative.test", answer);
+
+  DnsClient* client = DnsClient::New(env.opt);
+  CHECK(client);
+  CHECK(Resolve(client, "zero.test", AF_UNSPEC).ttl == Duration::zero());
+  CHECK(Resolve(client, "long.test", AF_UNSPEC).ttl == std::chrono::seconds(3600));
+  CHECK(Resolve(client, "negative.test", AF_UNSPEC).ttl == Duration::zero());
+
+  // DnsResolver refreshes hosts as often as their TTLs require but no more than once a
+  // second, and no less than once per dns_cache_refresh_period.
+  DnsResolver::Options opt;
+  static_cast<DnsClient::Options&>(opt) = env.opt;
+  opt.dns_cache_refresh_period = std::chrono::seconds(2);
+  opt.dns_address_family = AF_INET;
+  auto* resolver = new DnsResolver(opt);
+  for (const char* host : {"zero.test:80", "long.test:80"}) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    resolver->Resolve(host, [&](const ServerAddrs* addrs) {
+      CHECK(addrs && addrs->size == 1);
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+      cv.notify_one();
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return done; });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(3500));
+  // Looked up at 0s, 1s, 2s and 3s, give or take a tick.
+  int zero = env.primary->NumQueries("zero.test", kTypeA) - 1;
+  CHECK(zero >= 3 && zero <= 5) << zero;
+  // Looked up at 0s and 2s.
+  CHECK(env.primary->NumQueries("long.test", kTypeA) - 1 == 2);
+}
+
+}  // namespace
+}  // namespace hcproxy
+
+int main() {
+  using namespace hcproxy;
+  Env env = MakeEnv();
+  TestAddressFamilies(env);
+  TestTruncated(env);
+  TestFailover(env);
+  TestNxDomain(env);
+  TestTtl(env);
+  LOG(INFO) << "PASS";
+}
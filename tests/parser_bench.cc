@@ -0,0 +1,187 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of CONNECT request parsing. Compares the scan variants from scan.h on
+// requests of different sizes, and Parser::ParseRequest() on a loopback TCP connection
+// against reading the request into a buffer of its own, as the parser used to do.
+//
+// Linked against objects built with -DHCP_MIN_LOG_LVL=WARN so that logs of parsed
+// requests don't dominate the results.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "check.h"
+#include "logging.h"
+#include "parser.h"
+#include "scan.h"
+#include "time.h"
+
+namespace hcproxy {
+namespace {
+
+using namespace internal_scan;
+
+// Keeps the compiler from optimizing away computations whose results aren't used.
+template <class T>
+void Use(const T& x) {
+  asm volatile("" : : "r"(x) : "memory");
+}
+
+// Calls `f()` repeatedly for about 200ms and returns the average duration of a call.
+template <class F>
+double NsPerCall(F&& f) {
+  size_t n = 0;
+  const Time start = Clock::now();
+  Time now;
+  do {
+    for (int i = 0; i != 64; ++i) f();
+    n += 64;
+    now = Clock::now();
+  } while (now - start < std::chrono::milliseconds(200));
+  return std::chrono::duration<double, std::nano>(now - start).count() / n;
+}
+
+std::string MakeRequest(size_t header_bytes) {
+  std::string req = "CONNECT www.example.com:443 HTTP/1.1\r\nHost: www.example.com:443\r\n";
+  while (req.size() < header_bytes) req += "X-Padding: " + std::string(40, 'x') + "\r\n";
+  return req + "\r\n";
+}
+
+void BenchScans() {
+  struct Variant {
+    const char* name;
+    size_t (*header_end)(const char*, size_t);
+    size_t (*token_end)(const char*, size_t);
+  };
+  std::vector<Variant> variants = {{"scalar", FindHeaderEndScalar, FindTokenEndScalar}};
+#if defined(__x86_64__)
+  variants.push_back({"sse2", FindHeaderEndSse2, FindTokenEndSse2});
+  if (HasAvx2()) variants.push_back({"avx2", FindHeaderEndAvx2, FindTokenEndAvx2});
+#endif
+  std::printf("%-28s %-8s %12s %12s\n", "input", "variant", "header ns", "token ns");
+  for (size_t size : {64, 256, 1024}) {
+    const std::string req = MakeRequest(size);
+    // The host token starts after "CONNECT ".
+    const char* host = req.data() + 8;
+    const size_t host_len = req.size() - 8;
+    for (const Variant& v : variants) {
+      CHECK(v.header_end(req.data(), req.size()) == req.size() - 4);
+      double header = NsPerCall([&]() { Use(v.header_end(req.data(), req.size())); });
+      double token = NsPerCall([&]() { Use(v.token_end(host, host_len)); });
+      std::printf("request of %-4zu bytes        %-8s %12.1f %12.1f\n", req.size(), v.name,
+                  header, token);
+    }
+  }
+}
+
+// Returns a connected pair of loopback TCP sockets.
+void TcpPair(int* client, int* server) {
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK(listener >= 0) << Errno();
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  CHECK(bind(listener, reinterpret_cast<sockaddr*>(&addr), len) == 0) << Errno();
+  CHECK(getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len) == 0) << Errno();
+  CHECK(listen(listener, 1) == 0) << Errno();
+  CHECK((*client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0) << Errno();
+  CHECK(connect(*client, reinterpret_cast<sockaddr*>(&addr), len) == 0) << Errno();
+  CHECK((*server = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) >= 0) << Errno();
+  CHECK(close(listener) == 0) << Errno();
+  int one = 1;
+  CHECK(setsockopt(*client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0) << Errno();
+}
+
+void Send(int fd, const std::string& data) {
+  CHECK(write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size())) << Errno();
+}
+
+// What the parser did before it peeked through a shared scratch buffer: every pending
+// request owns a buffer of max_request_size_bytes, and the request is complete when the
+// data read so far ends with "\r\n\r\n".
+std::string_view ReadRequest(int fd, std::vector<char>* buf) {
+  size_t size = 0;
+  while (size < 4 || std::string_view(buf->data() + size - 4, 4) != "\r\n\r\n") {
+    ssize_t n = read(fd, buf->data() + size, buf->size() - size);
+    CHECK(n > 0) << Errno();
+    size += n;
+  }
+  std::string_view req(buf->data(), size);
+  req.remove_prefix(8);
+  return req.substr(0, req.find_first_of(" \r"));
+}
+
+void BenchParser() {
+  int client, server;
+  TcpPair(&client, &server);
+  std::printf("\n%-40s %12s\n", "parser (write + parse)", "ns");
+  for (size_t size : {64, 256}) {
+    const std::string req = MakeRequest(size);
+    Parser::Options opt;
+    double baseline = NsPerCall([&]() {
+      Send(client, req);
+      std::vector<char> buf(opt.max_request_size_bytes);
+      Use(ReadRequest(server, &buf).size());
+    });
+    std::printf("request of %-4zu bytes, own buffer       %12.1f\n", req.size(), baseline);
+
+    opt.parse_inline = true;
+    auto* inline_parser = new Parser(opt);
+    double inline_ns = NsPerCall([&]() {
+      Send(client, req);
+      bool done = false;
+      inline_parser->ParseRequest(server, [&](std::string_view host_port) {
+        CHECK(host_port == "www.example.com:443");
+        done = true;
+      });
+      CHECK(done);
+    });
+    std::printf("request of %-4zu bytes, inline           %12.1f\n", req.size(), inline_ns);
+
+    opt.parse_inline = false;
+    auto* parser = new Parser(opt);
+    double loop_ns = NsPerCall([&]() {
+      Send(client, req);
+      std::atomic<bool> done{false};
+      parser->ParseRequest(server, [&](std::string_view host_port) {
+        CHECK(host_port == "www.example.com:443");
+        done.store(true, std::memory_order_release);
+      });
+      while (!done.load(std::memory_order_acquire)) {
+      }
+    });
+    std::printf("request of %-4zu bytes, event loop       %12.1f\n", req.size(), loop_ns);
+  }
+}
+
+}  // namespace
+}  // namespace hcproxy
+
+int main() {
+  hcproxy::BenchScans();
+  hcproxy::BenchParser();
+}
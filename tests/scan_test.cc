@@ -0,0 +1,139 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks that all variants of the scans in scan.h agree with each other and with
+// std::string_view, and that none of them reads past the end of the input.
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "check.h"
+#include "logging.h"
+#include "scan.h"
+
+namespace hcproxy {
+namespace {
+
+using namespace internal_scan;
+
+constexpr size_t kMaxSize = 512;
+
+// Returns a buffer of `n` bytes followed by an inaccessible page, so that reading past
+// the end of the input crashes.
+char* GuardedBuffer(size_t n) {
+  CHECK(n <= kMaxSize);
+  static char* end = []() {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    void* p = mmap(nullptr, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(p != MAP_FAILED) << Errno();
+    char* res = static_cast<char*>(p) + page;
+    CHECK(mprotect(res, page, PROT_NONE) == 0) << Errno();
+    return res;
+  }();
+  return end - n;
+}
+
+std::string Escape(std::string_view s) {
+  std::string res;
+  for (char c : s) {
+    switch (c) {
+      case '\r':
+        res += "\\r";
+        break;
+      case '\n':
+        res += "\\n";
+        break;
+      default:
+        res += c;
+    }
+  }
+  return res;
+}
+
+void Check(std::string_view input) {
+  char* p = GuardedBuffer(input.size());
+  std::memcpy(p, input.data(), input.size());
+  const size_t n = input.size();
+  const size_t header = std::min(input.find("\r\n\r\n"), n);
+  const size_t token = std::min(input.find_first_of(" \r"), n);
+  CHECK(FindHeaderEndScalar(p, n) == header) << Escape(input);
+  CHECK(FindTokenEndScalar(p, n) == token) << Escape(input);
+#if defined(__x86_64__)
+  CHECK(FindHeaderEndSse2(p, n) == header) << Escape(input);
+  CHECK(FindTokenEndSse2(p, n) == token) << Escape(input);
+  if (HasAvx2()) {
+    CHECK(FindHeaderEndAvx2(p, n) == header) << Escape(input);
+    CHECK(FindTokenEndAvx2(p, n) == token) << Escape(input);
+  }
+#endif
+  CHECK(FindHeaderEnd(p, n) == header) << Escape(input);
+  CHECK(FindTokenEnd(p, n) == token) << Escape(input);
+}
+
+// All strings of up to 8 characters over an alphabet that can form matches.
+void TestExhaustive() {
+  constexpr char kAlphabet[] = "\r\n a";
+  for (size_t n = 0; n <= 8; ++n) {
+    size_t total = 1;
+    for (size_t i = 0; i != n; ++i) total *= 4;
+    for (size_t k = 0; k != total; ++k) {
+      std::string s;
+      for (size_t i = 0, x = k; i != n; ++i, x /= 4) s += kAlphabet[x % 4];
+      Check(s);
+    }
+  }
+}
+
+// "\r\n\r\n" and decoys at every position of inputs of every size, so that matches
+// straddle the 16- and 32-byte blocks of the vectorized loops and their scalar tails.
+void TestBoundaries() {
+  for (std::string_view needle : {"\r\n\r\n", "\r\n\r", "\r\r\n\r\n", "\n\r\n\r\n", " "}) {
+    for (size_t n = 0; n <= 100; ++n) {
+      for (size_t pos = 0; pos + needle.size() <= n; ++pos) {
+        std::string s(n, 'a');
+        s.replace(pos, needle.size(), needle);
+        Check(s);
+      }
+    }
+  }
+}
+
+void TestRandom() {
+  std::mt19937 rng(42);
+  for (int i = 0; i != 200000; ++i) {
+    std::string s(rng() % kMaxSize, 'a');
+    // Dense enough to produce partial matches, sparse enough to leave long runs.
+    const unsigned density = 1 + rng() % 32;
+    for (char& c : s) {
+      if (rng() % density == 0) c = "\r\n \r\n"[rng() % 5];
+    }
+    Check(s);
+  }
+}
+
+}  // namespace
+}  // namespace hcproxy
+
+int main() {
+  using namespace hcproxy;
+  TestExhaustive();
+  TestBoundaries();
+  TestRandom();
+  LOG(INFO) << "PASS";
+}
@@ -0,0 +1,125 @@
+// Copyright 2018 Roman Perepelitsa
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Prints the counters and latency percentiles that hcproxy publishes in its stats segment.
+//
+// Usage: hcproxy-stats [-t] [path]
+//
+//   -t    Print counters of every thread in addition to the totals.
+//   path  The stats segment. Defaults to /dev/shm/hcproxy-stats.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "stats.h"
+
+namespace hcproxy {
+namespace {
+
+using internal_stats::ReadSlot;
+using internal_stats::Segment;
+
+int Main(int argc, char* argv[]) {
+  bool per_thread = false;
+  std::string path = "/dev/shm/hcproxy-stats";
+  for (int i = 1; i != argc; ++i) {
+    if (std::strcmp(argv[i], "-t") == 0) {
+      per_thread = true;
+    } else if (argv[i][0] == '-') {
+      std::fprintf(stderr, "Usage: %s [-t] [path]\n", argv[0]);
+      return 1;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::fprintf(stderr, "%s: %s\n", path.c_str(), std::strerror(errno));
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Segment)) {
+    std::fprintf(stderr, "%s: not an hcproxy stats segment\n", path.c_str());
+    return 1;
+  }
+  void* mem = mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    std::fprintf(stderr, "%s: %s\n", path.c_str(), std::strerror(errno));
+    return 1;
+  }
+  const Segment& segment = *static_cast<const Segment*>(mem);
+  if (segment.header.magic != internal_stats::kMagic ||
+      segment.header.version != internal_stats::kVersion ||
+      segment.header.num_counters != kNumCounters ||
+      segment.header.num_histograms != kNumHistograms ||
+      segment.header.histogram_buckets != kHistogramBuckets) {
+    std::fprintf(stderr, "%s: incompatible stats segment\n", path.c_str());
+    return 1;
+  }
+
+  std::uint32_t num_threads = segment.header.num_threads.load(std::memory_order_acquire);
+  if (num_threads > segment.header.max_threads) num_threads = segment.header.max_threads;
+  auto total = std::make_unique<StatsSnapshot>();
+  auto data = std::make_unique<StatsSnapshot>();
+  for (std::uint32_t t = 0; t != num_threads; ++t) {
+    ReadSlot(segment.slots[t], data.get());
+    for (size_t i = 0; i != kNumCounters; ++i) {
+      total->counters[i] += data->counters[i];
+      if (per_thread && data->counters[i]) {
+        std::printf("thread %d %s %llu\n", segment.slots[t].tid, kCounterNames[i],
+                    static_cast<unsigned long long>(data->counters[i]));
+      }
+    }
+    for (size_t h = 0; h != kNumHistograms; ++h) {
+      for (size_t i = 0; i != kHistogramBuckets; ++i) {
+        total->histograms[h][i] += data->histograms[h][i];
+      }
+      total->histogram_sums[h] += data->histogram_sums[h];
+    }
+  }
+  for (size_t i = 0; i != kNumCounters; ++i) {
+    std::printf("%s %llu\n", kCounterNames[i],
+                static_cast<unsigned long long>(total->counters[i]));
+  }
+  // Latencies in microseconds.
+  for (size_t h = 0; h != kNumHistograms; ++h) {
+    const std::uint64_t(&buckets)[kHistogramBuckets] = total->histograms[h];
+    std::uint64_t count = 0;
+    for (std::uint64_t n : buckets) count += n;
+    std::printf("latency_us %s count=%llu mean=%llu p50=%llu p99=%llu p99.9=%llu max=%llu\n",
+                kHistogramNames[h], static_cast<unsigned long long>(count),
+                static_cast<unsigned long long>(count ? total->histogram_sums[h] / count : 0),
+                static_cast<unsigned long long>(HistogramQuantile(buckets, 0.5)),
+                static_cast<unsigned long long>(HistogramQuantile(buckets, 0.99)),
+                static_cast<unsigned long long>(HistogramQuantile(buckets, 0.999)),
+                static_cast<unsigned long long>(HistogramQuantile(buckets, 1)));
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace hcproxy
+
+int main(int argc, char* argv[]) { return hcproxy::Main(argc, argv); }